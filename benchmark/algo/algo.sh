@@ -1,16 +1,14 @@
 #!/bin/bash
 
-input_program="./benchmark/CppLox"
+build_dir="./benchmark/build"
+input_program="$build_dir/CppLox"
 program_type="cycle_list"
 input_lox_file="./benchmark/algo/cycle_list/cycle_list.lox"
 input_file="./benchmark/algo/cycle_list/cycle_list.txt"
 output_profile="./benchmark/profile_output.txt"
-output_gmon_file="./gmon.out"
-
-g++ -g -pg ./source/*.cpp -o $input_program
-./$input_program $input_lox_file < $input_file 
-rm $output_profile
-gprof $input_program $output_gmon_file > $output_profile
-rm $output_gmon_file
-rm $input_program
 
+cmake -S . -B $build_dir -D CMAKE_BUILD_TYPE=Release
+cmake --build $build_dir
+# The report goes to stderr; the sampled stacks go to $input_lox_file.folded.
+$input_program --profile $input_lox_file < $input_file > /dev/null 2> $output_profile
+rm -rf $build_dir
@@ -0,0 +1,390 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+/**
+ * @brief What one run of a script measured.
+ */
+class Run
+{
+public:
+  double milliseconds;
+  long peakRSS;
+  std::map<std::string, double> counters;
+};
+
+/**
+ * @brief The runs of one script, summed up.
+ */
+class Result
+{
+public:
+  /**
+   * @brief The script's path relative to the benchmark directory.
+   */
+  std::string name;
+  double median;
+  double p95;
+  double fastest;
+
+  /**
+   * @brief The largest resident set of any run, in kilobytes.
+   */
+  long peakRSS;
+
+  /**
+   * @brief The `--gc-stats` counters of the last run, which don't change
+   * from run to run but for the pauses.
+   */
+  std::map<std::string, double> counters;
+
+  /**
+   * @brief Whether every run exited successfully.
+   */
+  bool ok;
+};
+
+/**
+ * @brief The `--gc-stats` counters written to the JSON file, and the keys
+ * they are written under.
+ */
+static const std::pair<const char*, const char*> COUNTERS[] = {
+    {"allocations", "allocations"},
+    {"allocated bytes", "allocated_bytes"},
+    {"collections", "collections"},
+    {"minor collections", "minor_collections"},
+    {"total pause us", "gc_pause_us"},
+};
+
+/**
+ * @brief How much slower than its baseline a script has to get to count as a
+ * regression, whatever the threshold, as the scripts that finish in a few
+ * milliseconds vary by more than any threshold from run to run.
+ */
+constexpr double MIN_REGRESSION_MS = 1.0;
+
+/**
+ * @brief Prints how to run the benchmarks and exits
+ */
+static void usage()
+{
+  fprintf(stderr,
+          "Usage: CppLox_bench <interpreter> <benchmark dir> [--iterations n]"
+          " [--json path] [--baseline path] [--threshold percent]"
+          " [--save-baseline]\n");
+  exit(64);
+}
+
+/**
+ * @brief Finds every script under the benchmark directory, in a stable order.
+ */
+static std::vector<fs::path> findScripts(const fs::path& directory)
+{
+  std::vector<fs::path> scripts;
+  for (auto& entry : fs::recursive_directory_iterator(directory)) {
+    if (entry.is_regular_file() && entry.path().extension() == ".lox")
+      scripts.push_back(entry.path());
+  }
+  std::sort(scripts.begin(), scripts.end());
+  return scripts;
+}
+
+/**
+ * @brief Reads the `name value` lines `--gc-stats` prints to stderr.
+ */
+static std::map<std::string, double> parseCounters(const std::string& text)
+{
+  std::map<std::string, double> counters;
+  size_t start = 0;
+  while (start < text.size()) {
+    auto end = text.find('\n', start);
+    if (end == std::string::npos)
+      end = text.size();
+    auto line = text.substr(start, end - start);
+    start = end + 1;
+
+    auto split = line.find_last_of(' ');
+    if (split == std::string::npos || line.compare(0, 2, "--") == 0)
+      continue;
+    auto name = line.substr(0, line.find_last_not_of(' ', split) + 1);
+    char* rest;
+    auto value = strtod(line.c_str() + split + 1, &rest);
+    if (*rest == '\0')
+      counters[name] = value;
+  }
+  return counters;
+}
+
+/**
+ * @brief Runs a script once with its input on stdin and its output thrown
+ * away.
+ *
+ * @return `false` if the interpreter couldn't be started or didn't exit
+ * successfully.
+ */
+static bool runScript(const char* interpreter,
+                      const fs::path& script,
+                      Run* run)
+{
+  auto input = script;
+  input.replace_extension(".txt");
+  int errors[2];
+  if (pipe(errors) != 0)
+    return false;
+
+  auto start = std::chrono::steady_clock::now();
+  auto pid = fork();
+  if (pid < 0)
+    return false;
+  if (pid == 0) {
+    auto in = open(fs::exists(input) ? input.c_str() : "/dev/null", O_RDONLY);
+    auto out = open("/dev/null", O_WRONLY);
+    dup2(in, STDIN_FILENO);
+    dup2(out, STDOUT_FILENO);
+    dup2(errors[1], STDERR_FILENO);
+    close(errors[0]);
+    execl(interpreter,
+          interpreter,
+          "--gc-stats",
+          script.c_str(),
+          (char*)NULL);
+    _exit(127);
+  }
+
+  close(errors[1]);
+  std::string text;
+  char buffer[4096];
+  ssize_t count;
+  while ((count = read(errors[0], buffer, sizeof(buffer))) > 0)
+    text.append(buffer, (size_t)count);
+  close(errors[0]);
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid)
+    return false;
+  run->milliseconds = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+#ifdef __APPLE__
+  run->peakRSS = usage.ru_maxrss / 1024;
+#else
+  run->peakRSS = usage.ru_maxrss;
+#endif
+  run->counters = parseCounters(text);
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "%s", text.c_str());
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Returns the nearest-rank percentile of some sorted times.
+ */
+static double percentile(const std::vector<double>& sorted, double fraction)
+{
+  auto rank = (size_t)(fraction * (double)sorted.size() + 0.999999);
+  return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+/**
+ * @brief Runs a script the given number of times.
+ */
+static Result benchmarkScript(const char* interpreter,
+                              const fs::path& directory,
+                              const fs::path& script,
+                              int iterations)
+{
+  Result result;
+  result.name = script.lexically_relative(directory).generic_string();
+  result.peakRSS = 0;
+  result.ok = true;
+
+  std::vector<double> times;
+  for (int i = 0; i < iterations && result.ok; i++) {
+    Run run;
+    result.ok = runScript(interpreter, script, &run);
+    times.push_back(run.milliseconds);
+    result.peakRSS = std::max(result.peakRSS, run.peakRSS);
+    result.counters = run.counters;
+  }
+  std::sort(times.begin(), times.end());
+  result.median = times.size() % 2 == 1
+      ? times[times.size() / 2]
+      : (times[times.size() / 2 - 1] + times[times.size() / 2]) / 2;
+  result.p95 = percentile(times, 0.95);
+  result.fastest = times[0];
+  return result;
+}
+
+/**
+ * @brief Writes the results as JSON, one script per line so that a baseline
+ * can be read back line by line.
+ *
+ * @return `true` if the file was written, `false` otherwise.
+ */
+static bool writeJSON(const char* path,
+                      int iterations,
+                      const std::vector<Result>& results)
+{
+  auto file = fopen(path, "w");
+  if (file == NULL)
+    return false;
+  fprintf(file, "{\n  \"iterations\": %d,\n  \"benchmarks\": [\n", iterations);
+  for (size_t i = 0; i < results.size(); i++) {
+    auto& result = results[i];
+    fprintf(file,
+            "    {\"name\": \"%s\", \"ok\": %s, \"median_ms\": %.3f, "
+            "\"p95_ms\": %.3f, \"min_ms\": %.3f, \"peak_rss_kb\": %ld",
+            result.name.c_str(),
+            result.ok ? "true" : "false",
+            result.median,
+            result.p95,
+            result.fastest,
+            result.peakRSS);
+    for (auto& counter : COUNTERS) {
+      auto found = result.counters.find(counter.first);
+      fprintf(file,
+              ", \"%s\": %.0f",
+              counter.second,
+              found == result.counters.end() ? 0.0 : found->second);
+    }
+    fprintf(file, "}%s\n", i + 1 < results.size() ? "," : "");
+  }
+  fprintf(file, "  ]\n}\n");
+  return fclose(file) == 0;
+}
+
+/**
+ * @brief Reads the median time of each script from a file `writeJSON`
+ * wrote.
+ */
+static std::map<std::string, double> readBaseline(const char* path)
+{
+  std::map<std::string, double> medians;
+  std::ifstream file(path);
+  std::string line;
+  while (std::getline(file, line)) {
+    auto name = line.find("\"name\": \"");
+    auto median = line.find("\"median_ms\": ");
+    if (name == std::string::npos || median == std::string::npos)
+      continue;
+    name += strlen("\"name\": \"");
+    auto nameEnd = line.find('"', name);
+    medians[line.substr(name, nameEnd - name)] =
+        strtod(line.c_str() + median + strlen("\"median_ms\": "), NULL);
+  }
+  return medians;
+}
+
+int main(int argc, const char* argv[])
+{
+  if (argc < 3)
+    usage();
+  auto interpreter = argv[1];
+  fs::path directory = argv[2];
+  auto iterations = 5;
+  const char* json = "bench.json";
+  const char* baseline = NULL;
+  auto threshold = 10.0;
+  auto saveBaseline = false;
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "--save-baseline") == 0) {
+      saveBaseline = true;
+    } else if (i + 1 == argc) {
+      usage();
+    } else if (strcmp(argv[i], "--iterations") == 0) {
+      iterations = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--json") == 0) {
+      json = argv[++i];
+    } else if (strcmp(argv[i], "--baseline") == 0) {
+      baseline = argv[++i];
+    } else if (strcmp(argv[i], "--threshold") == 0) {
+      threshold = atof(argv[++i]);
+    } else {
+      usage();
+    }
+  }
+  if (iterations < 1 || (saveBaseline && baseline == NULL))
+    usage();
+
+  std::map<std::string, double> medians;
+  if (baseline != NULL && !saveBaseline) {
+    medians = readBaseline(baseline);
+    if (medians.empty())
+      printf("No baseline in \"%s\", nothing to compare with.\n", baseline);
+  }
+
+  printf("%-44s %10s %10s %10s %12s %6s %9s\n",
+         "script",
+         "median ms",
+         "p95 ms",
+         "peak KB",
+         "allocations",
+         "gcs",
+         "change");
+  std::vector<Result> results;
+  auto regressions = 0;
+  auto failures = 0;
+  for (auto& script : findScripts(directory)) {
+    auto result = benchmarkScript(interpreter, directory, script, iterations);
+    results.push_back(result);
+
+    auto change = std::string();
+    auto base = medians.find(result.name);
+    if (!result.ok) {
+      change = "FAILED";
+      failures++;
+    } else if (base != medians.end() && base->second > 0) {
+      auto percent = 100.0 * (result.median - base->second) / base->second;
+      char buffer[32];
+      snprintf(buffer, sizeof(buffer), "%+.1f%%", percent);
+      change = buffer;
+      if (percent > threshold
+          && result.median - base->second > MIN_REGRESSION_MS)
+      {
+        change += " REGRESSED";
+        regressions++;
+      }
+    }
+    printf("%-44s %10.1f %10.1f %10ld %12.0f %6.0f %9s\n",
+           result.name.c_str(),
+           result.median,
+           result.p95,
+           result.peakRSS,
+           result.counters["allocations"],
+           result.counters["collections"]
+               + result.counters["minor collections"],
+           change.c_str());
+    fflush(stdout);
+  }
+
+  auto output = saveBaseline ? baseline : json;
+  if (!writeJSON(output, iterations, results)) {
+    fprintf(stderr, "Could not write file \"%s\".\n", output);
+    return 74;
+  }
+  printf("Wrote %s.\n", output);
+  if (regressions > 0) {
+    printf("%d script(s) regressed more than %.1f%%.\n",
+           regressions,
+           threshold);
+  }
+  return failures > 0 || regressions > 0 ? 1 : 0;
+}
@@ -1,13 +1,12 @@
 #!/bin/bash
 
-input_program="./benchmark/CppLox"
+build_dir="./benchmark/build"
+input_program="$build_dir/CppLox"
 input_file="./benchmark/src/class_load.lox"
 output_profile="./benchmark/profile_output.txt"
-output_gmon_file="./gmon.out"
-
-g++ -g -pg ./source/*.cpp -o $input_program
-./$input_program $input_file
-gprof $input_program $output_gmon_file > $output_profile
-rm $output_gmon_file
-rm $input_program
 
+cmake -S . -B $build_dir -D CMAKE_BUILD_TYPE=Release
+cmake --build $build_dir
+# The report goes to stderr; the sampled stacks go to $input_file.folded.
+$input_program --profile $input_file > /dev/null 2> $output_profile
+rm -rf $build_dir
@@ -0,0 +1,424 @@
+#include "bytecode.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "chunk.hpp"
+#include "memory.hpp"
+#include "vm.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#  define BYTECODE_MMAP
+#endif
+
+/**
+ * @brief The first four bytes of a cache file, read back as one word so a
+ * file from a machine of the other byte order doesn't match either.
+ */
+constexpr uint32_t BYTECODE_MAGIC = 0x43584f4c;  // "LOXC"
+
+/**
+ * @brief Bumped whenever the bytecode or the layout of the file changes.
+ */
+constexpr uint32_t BYTECODE_VERSION = 5;
+
+/**
+ * @brief The kinds of constant a chunk can hold.
+ */
+typedef enum
+{
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION
+} ConstantTag;
+
+/**
+ * @brief Appends a function and, inline in its constants, every function
+ * nested in it.
+ *
+ * @return `false` if a constant has a type the format can't store.
+ */
+bool putFunction(std::vector<uint8_t>& out, ObjFunction* function)
+{
+  auto chunk = &function->chunk;
+  put<int32_t>(out, function->arity);
+  put<int32_t>(out, function->upvalueCount);
+  put<uint8_t>(out, function->name != NULL);
+  if (function->name != NULL)
+    putString(out, function->name);
+
+  put<int32_t>(out, chunk->count);
+  out.insert(out.end(), chunk->code, chunk->code + chunk->count);
+  put<int32_t>(out, chunk->lineCount);
+  for (int i = 0; i < chunk->lineCount; i++) {
+    put<int32_t>(out, chunk->lines[i].offset);
+    put<int32_t>(out, chunk->lines[i].line);
+  }
+  put<int32_t>(out, chunk->cacheCount);
+
+  put<int32_t>(out, chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    auto constant = chunk->constants.values[i];
+    if (IS_NUMBER(constant)) {
+      put<uint8_t>(out, CONSTANT_NUMBER);
+      put<double>(out, AS_NUMBER(constant));
+    } else if (IS_STRING(constant)) {
+      put<uint8_t>(out, CONSTANT_STRING);
+      putString(out, AS_STRING(constant));
+    } else if (IS_FUNCTION(constant)) {
+      put<uint8_t>(out, CONSTANT_FUNCTION);
+      if (!putFunction(out, AS_FUNCTION(constant)))
+        return false;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool writeBytecode(const char* path,
+                   ObjFunction* function,
+                   const SourceStamp& source)
+{
+  auto vm = VM::getVM();
+  std::vector<uint8_t> out;
+  put<uint32_t>(out, BYTECODE_MAGIC);
+  put<uint32_t>(out, BYTECODE_VERSION);
+  put<int64_t>(out, source.size);
+  put<int64_t>(out, source.modified);
+
+  put<int32_t>(out, vm->globalNames.count);
+  for (int i = 0; i < vm->globalNames.count; i++)
+    putString(out, AS_STRING(vm->globalNames.values[i]));
+  if (!putFunction(out, function))
+    return false;
+
+  auto file = fopen(path, "wb");
+  if (file == NULL)
+    return false;
+  auto written = fwrite(out.data(), 1, out.size(), file);
+  return fclose(file) == 0 && written == out.size();
+}
+
+/**
+ * @brief Reads the big-endian 16-bit operand an instruction stores at `code`.
+ */
+static int readShort(const uint8_t* code)
+{
+  return (code[0] << 8) | code[1];
+}
+
+/**
+ * @brief Whether `constant` indexes a string in the chunk's constants.
+ */
+static bool isStringConstant(Chunk* chunk, int constant)
+{
+  return constant < chunk->constants.count
+      && IS_STRING(chunk->constants.values[constant]);
+}
+
+/**
+ * @brief Whether `constant` indexes a number in the chunk's constants.
+ */
+static bool isNumberConstant(Chunk* chunk, int constant)
+{
+  return constant < chunk->constants.count
+      && IS_NUMBER(chunk->constants.values[constant]);
+}
+
+/**
+ * @brief Checks that the code of a loaded function only refers to what the
+ * file and the VM actually have.
+ *
+ * The VM trusts its bytecode: it dispatches on the opcode through a table,
+ * reads constants, caches, upvalues and global slots without bounds checks
+ * and runs until a return. So that a corrupted cache file is rejected rather
+ * than run, every instruction has to be a known opcode that ends inside the
+ * code, every operand has to index an existing entry of the right kind and
+ * every jump has to land on an instruction. Then the code must keep the
+ * stack balanced as compiled code does, which also gives how deep it goes for
+ * calls to make room for.
+ *
+ * @return `false` if the code can't be run safely.
+ */
+static bool checkCode(ObjFunction* function)
+{
+  auto chunk = &function->chunk;
+  auto constantCount = chunk->constants.count;
+  auto globalCount = VM::getVM()->globalNames.count;
+  std::vector<bool> starts((size_t)chunk->count + 1, false);
+  std::vector<int> targets;
+  auto last = -1;
+
+  for (int offset = 0; offset < chunk->count;) {
+    auto code = chunk->code + offset;
+    auto instruction = code[0];
+    if (instruction >= OP_COUNT)
+      return false;
+    // The length of OP_CLOSURE depends on its constant, so check that first.
+    if (instruction == OP_CLOSURE
+        && (offset + 1 >= chunk->count || code[1] >= constantCount
+            || !IS_FUNCTION(chunk->constants.values[code[1]])))
+    {
+      return false;
+    }
+    auto length = chunk->instructionLength(offset);
+    if (length > chunk->count - offset)
+      return false;
+
+    auto valid = true;
+    switch (instruction) {
+      case OP_CONSTANT:
+        valid = code[1] < constantCount;
+        break;
+      case OP_CLASS:
+      case OP_METHOD:
+      case OP_GET_SUPER:
+      case OP_SUPER_INVOKE:
+        valid = isStringConstant(chunk, code[1]);
+        break;
+      case OP_GET_PROPERTY:
+      case OP_SET_PROPERTY:
+        valid = isStringConstant(chunk, code[1]) && readShort(code + 2) < chunk->cacheCount;
+        break;
+      case OP_INVOKE:
+        valid = isStringConstant(chunk, code[1]) && readShort(code + 3) < chunk->cacheCount;
+        break;
+      case OP_GET_UPVALUE:
+      case OP_SET_UPVALUE:
+        valid = code[1] < function->upvalueCount;
+        break;
+      case OP_DEFINE_GLOBAL:
+      case OP_GET_GLOBAL:
+      case OP_SET_GLOBAL:
+      case OP_SET_GLOBAL_POP:
+        valid = readShort(code + 1) < globalCount;
+        break;
+      case OP_INCR_LOCAL:
+        valid = isNumberConstant(chunk, code[2]);
+        break;
+      case OP_INCR_GLOBAL:
+        valid = readShort(code + 1) < globalCount && isNumberConstant(chunk, code[3]);
+        break;
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE:
+        targets.push_back(offset + 3 + readShort(code + 1));
+        break;
+      case OP_LOOP:
+        targets.push_back(offset + 3 - readShort(code + 1));
+        break;
+      case OP_LESS_LOCALS_JUMP:
+        targets.push_back(offset + 5 + readShort(code + 3));
+        break;
+      case OP_CLOSURE: {
+        auto nested = AS_FUNCTION(chunk->constants.values[code[1]]);
+        for (int i = 0; i < nested->upvalueCount && valid; i++) {
+          auto kind = code[2 + 2 * i];
+          auto index = code[3 + 2 * i];
+          valid = kind <= CAPTURE_VALUE
+              && (kind != CAPTURE_UPVALUE || index < function->upvalueCount);
+        }
+        break;
+      }
+      default:
+        break;
+    }
+    if (!valid)
+      return false;
+
+    starts[(size_t)offset] = true;
+    last = instruction;
+    offset += length;
+  }
+
+  // Falling off the end of the code would run whatever follows it, so the
+  // last instruction has to leave the function or loop back.
+  if (last != OP_RETURN && last != OP_LOOP)
+    return false;
+  for (auto target : targets) {
+    if (target < 0 || target >= chunk->count || !starts[(size_t)target])
+      return false;
+  }
+  function->maxSlots = chunk->maxStackDepth(function->arity + 1);
+  return function->maxSlots >= 0;
+}
+
+/**
+ * @brief Reads a function and the functions nested in it.
+ *
+ * The function is kept on the VM stack while it's filled in, as every string
+ * and function it refers to is allocated along the way.
+ *
+ * @return The function, or NULL if the file is malformed.
+ */
+ObjFunction* BytecodeReader::getFunction()
+{
+  auto vm = VM::getVM();
+  auto function = newFunction();
+  vm->push(OBJ_VAL(function));
+  auto loaded = this->fillFunction(function);
+  vm->pop();
+  return loaded ? function : NULL;
+}
+
+/**
+ * @brief Reads the fields, code and constants of a function.
+ *
+ * @return `false` if the file is malformed.
+ */
+bool BytecodeReader::fillFunction(ObjFunction* function)
+{
+  auto chunk = &function->chunk;
+  function->arity = this->get<int32_t>();
+  function->upvalueCount = this->get<int32_t>();
+  if (function->arity < 0 || function->arity >= UINT8_COUNT
+      || function->upvalueCount < 0 || function->upvalueCount > UINT8_COUNT)
+  {
+    return false;
+  }
+  if (this->get<uint8_t>()) {
+    function->name = this->getString();
+    if (function->name == NULL)
+      return false;
+    writeBarrier((Obj*)function, OBJ_VAL(function->name));
+  }
+
+  // Code has to end in a return, so there is at least one byte of it.
+  auto count = this->get<int32_t>();
+  if (count <= 0 || (size_t)count > (size_t)(this->end - this->current))
+    return false;
+  auto code = this->take((size_t)count);
+  if (code == NULL)
+    return false;
+  chunk->code = ALLOCATE<uint8_t>(count);
+  chunk->count = count;
+  chunk->capacity = count;
+  memcpy(chunk->code, code, count);
+
+  // Every byte needs a run, so the first one starts the code and each one
+  // starts inside it, after the last.
+  auto lineCount = this->get<int32_t>();
+  if (lineCount < 1 || lineCount > count)
+    return false;
+  for (int i = 0; i < lineCount; i++) {
+    auto offset = this->get<int32_t>();
+    auto line = this->get<int32_t>();
+    if (i == 0 ? offset != 0
+               : offset <= chunk->lines[chunk->lineCount - 1].offset
+                     || offset >= count)
+      return false;
+    chunk->addLine(offset, line);
+  }
+
+  auto cacheCount = this->get<int32_t>();
+  if (cacheCount < 0 || cacheCount > count)
+    return false;
+  for (int i = 0; i < cacheCount; i++)
+    chunk->addInlineCache();
+
+  auto constantCount = this->get<int32_t>();
+  if (constantCount < 0)
+    return false;
+  for (int i = 0; i < constantCount && !this->failed; i++) {
+    Value constant;
+    switch (this->get<uint8_t>()) {
+      case CONSTANT_NUMBER:
+        constant = NUMBER_VAL(this->get<double>());
+        break;
+      case CONSTANT_STRING: {
+        auto string = this->getString();
+        if (string == NULL)
+          return false;
+        constant = OBJ_VAL(string);
+        break;
+      }
+      case CONSTANT_FUNCTION: {
+        auto nested = this->getFunction();
+        if (nested == NULL)
+          return false;
+        constant = OBJ_VAL(nested);
+        break;
+      }
+      default:
+        return false;
+    }
+    chunk->addConstant(constant);
+    writeBarrier((Obj*)function, constant);
+  }
+  return !this->failed && checkCode(function);
+}
+
+/**
+ * @brief Reads the header and global slots, then the functions.
+ */
+static ObjFunction* readBytecodeFrom(BytecodeReader* reader,
+                                     const SourceStamp& source)
+{
+  auto vm = VM::getVM();
+  if (reader->get<uint32_t>() != BYTECODE_MAGIC
+      || reader->get<uint32_t>() != BYTECODE_VERSION
+      || reader->get<int64_t>() != source.size
+      || reader->get<int64_t>() != source.modified)
+  {
+    return NULL;
+  }
+
+  // The code refers to globals by slot, so every name has to get back the
+  // slot it had when the script was compiled.
+  auto globalCount = reader->get<int32_t>();
+  for (int i = 0; i < globalCount; i++) {
+    auto name = reader->getString();
+    if (name == NULL || vm->globalSlot(name) != i)
+      return NULL;
+  }
+  auto function = reader->getFunction();
+  return reader->current == reader->end ? function : NULL;
+}
+
+ObjFunction* readBytecode(const char* path, const SourceStamp& source)
+{
+  BytecodeReader reader;
+  reader.failed = false;
+#ifdef BYTECODE_MMAP
+  auto fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+    close(fd);
+    return NULL;
+  }
+  auto size = (size_t)info.st_size;
+  auto data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return NULL;
+
+  reader.current = (const uint8_t*)data;
+  reader.end = reader.current + size;
+  auto function = readBytecodeFrom(&reader, source);
+  munmap(data, size);
+  return function;
+#else
+  auto file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+  std::vector<uint8_t> data;
+  uint8_t block[4096];
+  size_t count;
+  while ((count = fread(block, 1, sizeof(block), file)) > 0)
+    data.insert(data.end(), block, block + count);
+  fclose(file);
+
+  reader.current = data.data();
+  reader.end = reader.current + data.size();
+  return readBytecodeFrom(&reader, source);
+#endif
+}
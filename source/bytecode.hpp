@@ -0,0 +1,159 @@
+#ifndef clox_bytecode_h
+#define clox_bytecode_h
+
+#include <string.h>
+
+#include <vector>
+
+#include "object.hpp"
+
+/**
+ * @brief What a cache file records of the source file it was compiled from,
+ * to tell when the source has changed since.
+ *
+ * The modification time is kept to the nanosecond where the platform has it,
+ * as a source edited within the second it was compiled in would otherwise
+ * keep its stale cache. The contents aren't hashed, so that loading a cache
+ * never reads the source. An edit that keeps the size of the file and lands
+ * within the same tick of the file system's clock therefore still runs the
+ * stale cache: that tick is a second on coarse file systems and about a
+ * scheduler tick on Linux, nanosecond fields notwithstanding. Run with
+ * `--compile-only` again, or delete the cache, after such an edit.
+ */
+struct SourceStamp
+{
+  int64_t size;
+  int64_t modified;
+};
+
+/**
+ * @brief Writes a compiled script to a bytecode cache file.
+ *
+ * The file holds the names of every global slot followed by the function
+ * tree: each chunk's code, lines and constants, with nested functions stored
+ * inline where their constant is.
+ *
+ * @param path The path of the cache file, replaced if it exists.
+ * @param function The top-level function returned by `compile`.
+ * @param source The stamp of the source file, checked when loading.
+ * @return `true` if the file was written, `false` otherwise.
+ */
+bool writeBytecode(const char* path,
+                   ObjFunction* function,
+                   const SourceStamp& source);
+
+/**
+ * @brief Loads a script from a bytecode cache file.
+ *
+ * Fails if the file wasn't written by this version of the interpreter, was
+ * written for a source file of another size or modification time, assumes
+ * global slots this VM has given to other names, or holds code that refers to
+ * constants, caches, upvalues or globals it doesn't have, or that doesn't
+ * keep the stack balanced.
+ *
+ * @param path The path of the cache file.
+ * @param source The stamp of the source file the cache must be for.
+ * @return The top-level function, or NULL if the file can't be used.
+ */
+ObjFunction* readBytecode(const char* path, const SourceStamp& source);
+
+/**
+ * @brief Appends a value of plain type to the bytes being built.
+ */
+template<typename T>
+inline void put(std::vector<uint8_t>& out, T value)
+{
+  auto bytes = (const uint8_t*)&value;
+  out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+/**
+ * @brief Appends a string as its length followed by its characters.
+ */
+inline void putString(std::vector<uint8_t>& out, ObjString* string)
+{
+  put<int32_t>(out, string->length);
+  out.insert(out.end(), string->chars, string->chars + string->length);
+}
+
+/**
+ * @brief Appends a function and, inline in its constants, every function
+ * nested in it, as a cache file stores them.
+ *
+ * @return `false` if a constant has a type the format can't store.
+ */
+bool putFunction(std::vector<uint8_t>& out, ObjFunction* function);
+
+/**
+ * @brief A position in the bytes of a cache file being loaded.
+ */
+class BytecodeReader
+{
+public:
+  const uint8_t* current;
+  const uint8_t* end;
+
+  /**
+   * @brief Set once a read runs past the end of the file.
+   */
+  bool failed;
+
+  /**
+   * @brief Returns the next `length` bytes and moves past them, or NULL if
+   * the file is shorter than that.
+   */
+  const uint8_t* take(size_t length)
+  {
+    if (this->failed || (size_t)(this->end - this->current) < length) {
+      this->failed = true;
+      return NULL;
+    }
+    auto bytes = this->current;
+    this->current += length;
+    return bytes;
+  }
+
+  /**
+   * @brief Reads a value of plain type, or returns 0 past the end of the file.
+   */
+  template<typename T>
+  T get()
+  {
+    T value = 0;
+    auto bytes = this->take(sizeof(T));
+    if (bytes != NULL)
+      memcpy(&value, bytes, sizeof(T));
+    return value;
+  }
+
+  /**
+   * @brief Reads a string and interns it, straight from the file's bytes.
+   *
+   * @return The string, or NULL if the file is truncated.
+   */
+  ObjString* getString()
+  {
+    auto length = this->get<int32_t>();
+    auto chars = length < 0 ? NULL : this->take((size_t)length);
+    if (chars == NULL) {
+      this->failed = true;
+      return NULL;
+    }
+    return copyString((const char*)chars, length);
+  }
+
+  /**
+   * @brief Reads a function and the functions nested in it.
+   *
+   * @return The function, or NULL if the file is malformed.
+   */
+  ObjFunction* getFunction();
+
+private:
+  /**
+   * @brief Reads the fields, code and constants of a function into it.
+   */
+  bool fillFunction(ObjFunction* function);
+};
+
+#endif
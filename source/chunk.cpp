@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <vector>
+
 #include "memory.hpp"
 #include "vm.hpp"
 
@@ -24,22 +26,76 @@ void Chunk::writeChunk(uint8_t byte, int line)
 {
   // Resizes internal arrays if necessary. Checks if current capacity is
   // sufficient for next element.
-  // If not, doubles capacity, reallocates 'code' and 'lines' arrays to new size
+  // If not, doubles capacity, reallocates the 'code' array to new size
   // using 'GROW_ARRAY' function.
   if (this->capacity < this->count + 1) {
     int old_capacity = this->capacity;
     this->capacity = GROW_CAPACITY(old_capacity);
     this->code = GROW_ARRAY<uint8_t>(this->code, old_capacity, this->capacity);
-    this->lines = GROW_ARRAY<int>(this->lines, old_capacity, this->capacity);
   }
 
-  // Appends the bytecode and line number to the array
-  // Increments the count of elements in the array
+  // Appends the bytecode to the array, starting a line run if it is on a new
+  // line. Increments the count of elements in the array
+  this->addLine(this->count, line);
   this->code[this->count] = byte;
-  this->lines[this->count] = line;
   this->count++;
 }
 
+/**
+ * @brief Start a line run at an offset, unless the last run is on that line
+ *
+ * @param offset offset of the first byte on the line
+ * @param line line number of the code
+ */
+void Chunk::addLine(int offset, int line)
+{
+  if (this->lineCount > 0 && this->lines[this->lineCount - 1].line == line)
+    return;
+  if (this->lineCapacity < this->lineCount + 1) {
+    int old_capacity = this->lineCapacity;
+    this->lineCapacity = GROW_CAPACITY(old_capacity);
+    this->lines =
+        GROW_ARRAY<LineStart>(this->lines, old_capacity, this->lineCapacity);
+  }
+  this->lines[this->lineCount].offset = offset;
+  this->lines[this->lineCount].line = line;
+  this->lineCount++;
+}
+
+/**
+ * @brief Drop the code from an offset on, with the line runs starting there
+ *
+ * @param count number of bytes to keep
+ */
+void Chunk::truncateChunk(int count)
+{
+  this->count = count;
+  while (this->lineCount > 0 && this->lines[this->lineCount - 1].offset >= count)
+  {
+    this->lineCount--;
+  }
+}
+
+/**
+ * @brief Find the line of a byte by binary search over the line runs
+ *
+ * @param offset offset of a byte of code
+ * @return int line the byte was compiled from
+ */
+int Chunk::getLine(int offset)
+{
+  int low = 0;
+  int high = this->lineCount - 1;
+  while (low < high) {
+    auto middle = low + (high - low + 1) / 2;
+    if (this->lines[middle].offset <= offset)
+      low = middle;
+    else
+      high = middle - 1;
+  }
+  return this->lines[low].line;
+}
+
 /**
  * @brief Initialises the Chunk
  */
@@ -51,7 +107,12 @@ void Chunk::initChunk()
   this->capacity = 0;
   this->code = NULL;
   this->constants.initValueArray();
+  this->lineCount = 0;
+  this->lineCapacity = 0;
   this->lines = NULL;
+  this->cacheCount = 0;
+  this->cacheCapacity = 0;
+  this->caches = NULL;
 }
 
 /**
@@ -60,7 +121,8 @@ void Chunk::initChunk()
 void Chunk::freeChunk()
 {
   FREE_ARRAY<uint8_t>(this->code, this->capacity);
-  FREE_ARRAY<int>(this->lines, this->capacity);
+  FREE_ARRAY<LineStart>(this->lines, this->lineCapacity);
+  FREE_ARRAY<InlineCache>(this->caches, this->cacheCapacity);
   this->constants.freeValueArray();
   this->initChunk();
 }
@@ -78,4 +140,291 @@ int Chunk::addConstant(Value value)
   this->constants.writeValueArray(value);
   vm->pop();
   return this->constants.count - 1;
+}
+
+/**
+ * @brief Add an empty inline cache to the chunk and return its index
+ *
+ * @return int index of the cache
+ */
+int Chunk::addInlineCache()
+{
+  if (this->cacheCapacity < this->cacheCount + 1) {
+    int old_capacity = this->cacheCapacity;
+    this->cacheCapacity = GROW_CAPACITY(old_capacity);
+    this->caches = GROW_ARRAY<InlineCache>(
+        this->caches, old_capacity, this->cacheCapacity);
+  }
+
+  auto cache = &this->caches[this->cacheCount];
+  for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+    cache->entries[i].shape = 0;
+    cache->entries[i].version = 0;
+    cache->entries[i].slot = -1;
+    cache->entries[i].transition = NULL;
+    cache->entries[i].method = NIL_VAL;
+  }
+  cache->next = 0;
+  return this->cacheCount++;
+}
+
+/**
+ * @brief Return the size of the instruction at an offset, operands included
+ *
+ * @param offset offset of the instruction's opcode
+ * @return int number of bytes the instruction occupies
+ */
+int Chunk::instructionLength(int offset)
+{
+  switch (this->code[offset]) {
+    case OP_CONSTANT:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_CLASS:
+    case OP_GET_SUPER:
+    case OP_METHOD:
+    case OP_BUILD_LIST:
+    case OP_SET_LOCAL_POP:
+      return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_SUPER_INVOKE:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+    case OP_INCR_LOCAL:
+      return 3;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_INCR_GLOBAL:
+      return 4;
+    case OP_INVOKE:
+    case OP_LESS_LOCALS_JUMP:
+      return 5;
+    case OP_CLOSURE: {
+      auto constant = this->code[offset + 1];
+      auto function = AS_FUNCTION(this->constants.values[constant]);
+      return 2 + 2 * function->upvalueCount;
+    }
+    default:
+      return 1;
+  }
+}
+
+/**
+ * @brief Work out how many stack slots the code uses at most
+ *
+ * Every instruction is reached with one depth however control gets to it, as
+ * statements leave the stack as they found it and the jumps within an
+ * expression all carry the same temporaries. So one walk from each
+ * instruction to those it leads to finds that depth, and then the deepest
+ * point.
+ *
+ * @param base slots a call starts with, the callee and its arguments
+ * @return int most slots in use at once, or -1 if the code is unbalanced
+ */
+int Chunk::maxStackDepth(int base)
+{
+  std::vector<int> depths((size_t)this->count, -1);
+  std::vector<int> pending;
+  auto reach = [&](int offset, int depth) {
+    if (offset < 0 || offset >= this->count)
+      return false;
+    if (depths[(size_t)offset] == -1) {
+      depths[(size_t)offset] = depth;
+      pending.push_back(offset);
+    }
+    return depths[(size_t)offset] == depth;
+  };
+  if (!reach(0, base))
+    return -1;
+
+  auto deepest = base;
+  while (!pending.empty()) {
+    auto offset = pending.back();
+    pending.pop_back();
+    auto code = this->code + offset;
+    auto depth = depths[(size_t)offset];
+    auto next = offset + this->instructionLength(offset);
+    auto pops = 0;
+    auto pushes = 0;
+    auto falls = true;
+    auto target = -1;
+    auto targetPushes = 0;
+    // The locals an instruction reads or writes, -1 for none.
+    int locals[2] = {-1, -1};
+
+    switch (code[0]) {
+      case OP_CONSTANT:
+      case OP_NIL:
+      case OP_TRUE:
+      case OP_FALSE:
+      case OP_GET_UPVALUE:
+      case OP_GET_GLOBAL:
+      case OP_CLASS:
+        pushes = 1;
+        break;
+      case OP_GET_LOCAL:
+        pushes = 1;
+        locals[0] = code[1];
+        break;
+      case OP_CLOSURE: {
+        pushes = 1;
+        // A local function captures itself from the slot it's pushed into.
+        auto function = AS_FUNCTION(this->constants.values[code[1]]);
+        for (int i = 0; i < function->upvalueCount; i++) {
+          if (code[2 + 2 * i] != CAPTURE_UPVALUE && code[3 + 2 * i] > depth)
+            return -1;
+        }
+        break;
+      }
+      case OP_EQUAL:
+      case OP_GREATER:
+      case OP_LESS:
+      case OP_ADD:
+      case OP_SUBTRACT:
+      case OP_MULTIPLY:
+      case OP_DIVIDE:
+      case OP_MODULUS:
+      case OP_ADD_NUMBER:
+      case OP_SUBTRACT_NUMBER:
+      case OP_INDEX_GET:
+      case OP_SET_PROPERTY:
+      case OP_INHERIT:
+      case OP_GET_SUPER:
+      case OP_METHOD:
+        pops = 2;
+        pushes = 1;
+        break;
+      case OP_NEGATE:
+      case OP_NOT:
+      case OP_GET_PROPERTY:
+      case OP_SET_UPVALUE:
+      case OP_SET_GLOBAL:
+        pops = 1;
+        pushes = 1;
+        break;
+      case OP_SET_LOCAL:
+        pops = 1;
+        pushes = 1;
+        locals[0] = code[1];
+        break;
+      case OP_INDEX_SET:
+        pops = 3;
+        pushes = 1;
+        break;
+      case OP_PRINT:
+      case OP_POP:
+      case OP_DEFINE_GLOBAL:
+      case OP_CLOSE_UPVALUE:
+      case OP_SET_GLOBAL_POP:
+        pops = 1;
+        break;
+      case OP_SET_LOCAL_POP:
+        pops = 1;
+        locals[0] = code[1];
+        break;
+      case OP_INCR_LOCAL:
+        locals[0] = code[1];
+        break;
+      case OP_INCR_GLOBAL:
+        break;
+      case OP_CALL:
+      case OP_TAIL_CALL:
+        pops = code[1] + 1;
+        pushes = 1;
+        break;
+      case OP_INVOKE:
+        pops = code[2] + 1;
+        pushes = 1;
+        break;
+      case OP_SUPER_INVOKE:
+        pops = code[2] + 2;
+        pushes = 1;
+        break;
+      case OP_BUILD_LIST:
+        // The list is pushed before the items are taken off.
+        if (depth + 1 > deepest)
+          deepest = depth + 1;
+        pops = code[1];
+        pushes = 1;
+        break;
+      case OP_JUMP_IF_FALSE:
+        // The condition stays on the stack either way.
+        target = next + ((code[1] << 8) | code[2]);
+        break;
+      case OP_JUMP:
+        falls = false;
+        target = next + ((code[1] << 8) | code[2]);
+        break;
+      case OP_LOOP:
+        falls = false;
+        target = next - ((code[1] << 8) | code[2]);
+        break;
+      case OP_LESS_LOCALS_JUMP:
+        // Only the exit path pushes the condition, for its target to pop.
+        locals[0] = code[1];
+        locals[1] = code[2];
+        target = next + ((code[3] << 8) | code[4]);
+        targetPushes = 1;
+        break;
+      case OP_RETURN:
+        pops = 1;
+        falls = false;
+        break;
+      default:
+        return -1;
+    }
+
+    if (depth < pops || locals[0] >= depth || locals[1] >= depth)
+      return -1;
+    depth += pushes - pops;
+    if (depth + targetPushes > deepest)
+      deepest = depth + targetPushes;
+    if (falls && !reach(next, depth))
+      return -1;
+    if (target != -1 && !reach(target, depth + targetPushes))
+      return -1;
+  }
+  return deepest;
+}
+
+/**
+ * @brief Record a lookup in the first free entry, or evict round-robin
+ *
+ * @param shape receiver shape the lookup was made for
+ * @param version class version, only checked for methods
+ * @param slot field slot, or -1 for a method
+ * @param transition shape after adding the field, or NULL
+ * @param method method that was found
+ */
+void InlineCache::update(uint32_t shape,
+                         uint32_t version,
+                         int slot,
+                         ObjShape* transition,
+                         Value method)
+{
+  InlineCacheEntry* entry = NULL;
+  for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+    if (this->entries[i].shape == 0) {
+      entry = &this->entries[i];
+      break;
+    }
+  }
+  if (entry == NULL) {
+    entry = &this->entries[this->next];
+    this->next = (this->next + 1) % INLINE_CACHE_WAYS;
+  }
+
+  entry->shape = shape;
+  entry->version = version;
+  entry->slot = slot;
+  entry->transition = transition;
+  entry->method = method;
 }
\ No newline at end of file
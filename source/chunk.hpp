@@ -4,6 +4,8 @@
 #include "common.hpp"
 #include "value.hpp"
 
+class ObjShape;
+
 /**
  * @brief List of OpCode supported by the Lox Virtual Machine
  */
@@ -29,6 +31,7 @@ typedef enum
   OP_JUMP_IF_FALSE,
   OP_LOOP,
   OP_CALL,
+  OP_TAIL_CALL,
   OP_INVOKE,
   OP_SUPER_INVOKE,
   OP_CLOSURE,
@@ -49,9 +52,140 @@ typedef enum
   OP_SET_GLOBAL,
   OP_BUILD_LIST,
   OP_INDEX_GET,
-  OP_INDEX_SET
+  OP_INDEX_SET,
+  // Quickened forms, never emitted by the compiler. The VM rewrites the
+  // generic opcode into these once it has seen number operands.
+  OP_ADD_NUMBER,
+  OP_SUBTRACT_NUMBER,
+  // Superinstructions, only produced by the compiler's peephole pass.
+  OP_SET_LOCAL_POP,
+  OP_SET_GLOBAL_POP,
+  OP_INCR_LOCAL,
+  OP_INCR_GLOBAL,
+  OP_LESS_LOCALS_JUMP
 } OpCode;
 
+/**
+ * @brief The number of opcodes, for tables indexed by opcode.
+ */
+constexpr int OP_COUNT = OP_LESS_LOCALS_JUMP + 1;
+
+/**
+ * @brief How `OP_CLOSURE` fills each variable of the closure it creates, the
+ * first of the two bytes that follow it per variable.
+ *
+ * @value CAPTURE_UPVALUE Shares a variable of the enclosing closure.
+ * @value CAPTURE_LOCAL Shares a local of the enclosing function through an
+ * upvalue.
+ * @value CAPTURE_VALUE Copies a local of the enclosing function that is never
+ * assigned, which needs no upvalue.
+ */
+typedef enum
+{
+  CAPTURE_UPVALUE,
+  CAPTURE_LOCAL,
+  CAPTURE_VALUE
+} CaptureKind;
+
+/**
+ * @brief Number of receivers an inline cache remembers before it starts
+ * evicting entries.
+ */
+constexpr int INLINE_CACHE_WAYS = 4;
+
+/**
+ * @brief One remembered lookup result of an inline cache.
+ *
+ * An entry is keyed on the `ObjShape::id` of the receiver. Field entries
+ * store the slot the shape assigns to the field. Transition entries
+ * additionally store the shape an instance moves to when a store adds the
+ * field. Method entries are only valid while the `ObjClass::version` they
+ * were recorded with is current.
+ */
+class InlineCacheEntry
+{
+public:
+  /**
+   * @brief The receiver shape this entry was recorded for, 0 if unused.
+   */
+  uint32_t shape;
+
+  /**
+   * @brief The class version a method entry was recorded for.
+   */
+  uint32_t version;
+
+  /**
+   * @brief Field slot in `ObjInstance::fields`, or -1 for a method entry.
+   */
+  int slot;
+
+  /**
+   * @brief The shape after adding the field, NULL unless the store adds it.
+   */
+  ObjShape* transition;
+
+  /**
+   * @brief The resolved method for method entries.
+   */
+  Value method;
+};
+
+/**
+ * @brief A polymorphic inline cache attached to one property access site.
+ *
+ * `OP_GET_PROPERTY`, `OP_SET_PROPERTY` and `OP_INVOKE` carry the index of their
+ * cache in the owning chunk as a 16-bit operand.
+ */
+class InlineCache
+{
+public:
+  /**
+   * @brief The remembered lookups, most recently filled last.
+   */
+  InlineCacheEntry entries[INLINE_CACHE_WAYS];
+
+  /**
+   * @brief The entry replaced next once every way is in use.
+   */
+  int next;
+
+  /**
+   * @brief Records a lookup result, replacing entries round-robin when full.
+   *
+   * @param shape The receiver shape the lookup was made for.
+   * @param version The class version, only checked for methods.
+   * @param slot The field slot, or -1 for a method.
+   * @param transition The shape after adding the field, or NULL.
+   * @param method The method found, ignored for fields.
+   */
+  void update(uint32_t shape,
+              uint32_t version,
+              int slot,
+              ObjShape* transition,
+              Value method);
+};
+
+/**
+ * @brief The line of the code from an offset on, up to the next run.
+ *
+ * Consecutive instructions mostly come from the same line, so a chunk keeps
+ * one run per change of line rather than a line per byte.
+ */
+class LineStart
+{
+public:
+  /**
+   * @brief Offset of the first byte on the line.
+   */
+  int offset;
+
+  /**
+   * @brief The line number.
+   */
+  int line;
+};
+
 /**
  * @brief Represents a chunk of compiled bytecode.
  *
@@ -78,15 +212,40 @@ public:
   uint8_t* code;
 
   /**
-   * @brief An array mapping instruction offsets to line numbers.
+   * @brief The number of line runs in the chunk.
+   */
+  int lineCount;
+
+  /**
+   * @brief The allocated capacity of the line run array.
+   */
+  int lineCapacity;
+
+  /**
+   * @brief The line runs of the code, by increasing offset.
    */
-  int* lines;
+  LineStart* lines;
 
   /**
    * @brief An array of constant values used in the chunk.
    */
   ValueArray constants;
 
+  /**
+   * @brief The number of inline caches in the chunk.
+   */
+  int cacheCount;
+
+  /**
+   * @brief The allocated capacity of the inline cache array.
+   */
+  int cacheCapacity;
+
+  /**
+   * @brief Inline caches of the property access sites in this chunk.
+   */
+  InlineCache* caches;
+
   /**
    * @brief Constructs a new, empty chunk.
    */
@@ -105,6 +264,30 @@ public:
    */
   void writeChunk(uint8_t byte, int line);
 
+  /**
+   * @brief Records that the code from an offset on comes from a line
+   *
+   * @param offset Offset of the first byte on the line, at or after the
+   * start of the last run
+   * @param line Line number of the code
+   */
+  void addLine(int offset, int line);
+
+  /**
+   * @brief Drops the code from an offset on
+   *
+   * @param count The number of bytes to keep
+   */
+  void truncateChunk(int count);
+
+  /**
+   * @brief Returns the line number of the byte at an offset
+   *
+   * @param offset Offset of a byte of code
+   * @return int The line the byte was compiled from
+   */
+  int getLine(int offset);
+
   /**
    * @brief Free all resources associated with a chunk
    */
@@ -117,6 +300,35 @@ public:
    * @return int The index of the appended element
    */
   int addConstant(Value value);
+
+  /**
+   * @brief Adds an empty inline cache to the chunk
+   *
+   * @return int The index of the new cache
+   */
+  int addInlineCache();
+
+  /**
+   * @brief Returns the size of the instruction at an offset, operands included
+   *
+   * @param offset Offset of the instruction's opcode
+   * @return int The number of bytes the instruction occupies
+   */
+  int instructionLength(int offset);
+
+  /**
+   * @brief Works out how many stack slots the code uses at most
+   *
+   * Follows every path through the code from its first instruction, so the
+   * code must already be known to hold only whole instructions whose jumps
+   * land on instructions.
+   *
+   * @param base The slots a call starts with, the callee and its arguments
+   * @return int The most slots in use at once, or -1 if the code pops more
+   * than it pushed, reads a local above the top or reaches an instruction
+   * with the stack at two different depths
+   */
+  int maxStackDepth(int base);
 };
 
 #endif
\ No newline at end of file
@@ -11,10 +11,29 @@
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 
+// Set by the CppLox_NAN_BOXING CMake option
 // #define NAN_BOXING
 
+// Set by the CppLox_PARALLEL_GC CMake option
 // #define ENABLE_MP
 
+// Set by the CppLox_COMPUTED_GOTO CMake option
+// #define ENABLE_COMPUTED_GOTO
+// Set by the CppLox_POOL_ALLOCATOR CMake option
+// #define ENABLE_POOL_ALLOCATOR
+// Set by the CppLox_GC_MAX_PAUSE CMake option, in microseconds
+#ifndef GC_MAX_PAUSE
+#  define GC_MAX_PAUSE 0
+#endif
+// Set by the CppLox_OUTPUT_BUFFER CMake option, in bytes, 0 for stdio's own
+#ifndef OUTPUT_BUFFER_SIZE
+#  define OUTPUT_BUFFER_SIZE 65536
+#endif
+// Set by the CppLox_FRAMES_MAX CMake option, the deepest calls may nest
+#ifndef FRAMES_MAX
+#  define FRAMES_MAX 1048576
+#endif
+
 constexpr int UINT8_COUNT = (UINT8_MAX + 1);
 
 #endif
@@ -25,6 +25,8 @@
  *  - `hadError`: Flag indicating if a syntax error has occurred.
  *  - `panicMode`: Flag indicating if the parser is in panic mode (recovering
  * from errors).
+ *  - `operandStart`: Where the code of the left operand of the infix operator
+ * being parsed starts, so that a constant operand can be folded.
  */
 class Parser
 {
@@ -33,6 +35,7 @@ public:
   Token previous;
   bool hadError;
   bool panicMode;
+  int operandStart;
 };
 
 /**
@@ -93,6 +96,8 @@ public:
  *  - `name`: The name of the local variable.
  *  - `depth`: The depth of the variable in the scope chain.
  *  - `isCaptured`: Flag indicating if the variable is captured in a closure.
+ *  - `isAssigned`: Flag indicating if the variable is assigned after its
+ * declaration, so closures have to share it rather than copy it.
  */
 class Local
 {
@@ -100,6 +105,7 @@ public:
   Token name;
   int depth;
   bool isCaptured;
+  bool isAssigned;
 };
 
 /**
@@ -119,6 +125,22 @@ public:
   bool isLocal;
 };
 
+/**
+ * @brief Where an `OP_CLOSURE` of the function being compiled captures one of
+ * its locals.
+ *
+ * @details
+ *  - `offset`: Offset of the capture's kind byte, `CAPTURE_LOCAL` until the
+ * local goes out of scope.
+ *  - `local`: Index of the captured local.
+ */
+class CaptureSite
+{
+public:
+  int offset;
+  int local;
+};
+
 /**
  * @brief Enumeration representing different function types.
  *
@@ -147,6 +169,9 @@ typedef enum
  *  - `localCount`: Count of local variables.
  *  - `upvalues`: Array of upvalues.
  *  - `scopeDepth`: Current scope depth.
+ *  - `lastCall`: Offset of the last call instruction emitted, or -1, to spot
+ * a call whose result is returned right away.
+ *  - `captures`: The `OP_CLOSURE` captures of locals still in scope.
  */
 class Compiler
 {
@@ -159,6 +184,10 @@ public:
   int localCount;
   Upvalue upvalues[UINT8_COUNT];
   int scopeDepth;
+  int lastCall;
+  CaptureSite* captures;
+  int captureCount;
+  int captureCapacity;
 };
 
 /**
@@ -179,19 +208,22 @@ public:
 };
 
 /**
- * @brief Global parser instance.
+ * @brief The parser of the calling thread.
+ *
+ * The compiler's state is per thread, so that threads running different VMs
+ * can compile at the same time.
  */
-static Parser parser;
+static thread_local Parser parser;
 
 /**
  * @brief Pointer to the current compiler instance.
  */
-static Compiler* current = NULL;
+static thread_local Compiler* current = NULL;
 
 /**
  * @brief Pointer to the current class compiler instance.
  */
-static ClassCompiler* currentClass = NULL;
+static thread_local ClassCompiler* currentClass = NULL;
 
 /**
  * @brief Parses an expression.
@@ -404,6 +436,35 @@ static void emitBytes(uint8_t byte1, uint8_t byte2)
   emitByte(byte2);
 }
 
+/**
+ * @brief Allocates an inline cache for a property access site.
+ *
+ * Adds a new cache to the current chunk and emits its index as a two byte
+ * operand. Reports an error if the chunk runs out of cache indices.
+ */
+static void emitInlineCache()
+{
+  auto cache = currentChunk()->addInlineCache();
+  if (cache > UINT16_MAX) {
+    error("Too many property accesses in one chunk.");
+  }
+  emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+/**
+ * @brief Emits an instruction that accesses a global variable.
+ *
+ * Writes the opcode followed by the global's slot as a two byte operand.
+ *
+ * @param instruction The global variable opcode.
+ * @param slot The slot of the global variable.
+ */
+static void emitGlobal(uint8_t instruction, int slot)
+{
+  emitByte(instruction);
+  emitBytes((slot >> 8) & 0xff, slot & 0xff);
+}
+
 /**
  * @brief Emits a jump instruction and reserves space for the offset.
  *
@@ -450,6 +511,235 @@ static void emitConstant(Value value)
   emitBytes(OP_CONSTANT, makeConstant(value));
 }
 
+/**
+ * @brief How much code, constants and inline caches the current chunk had at
+ * some point, so that what was added since can be dropped.
+ */
+class CodeMark
+{
+public:
+  int count;
+  int constantCount;
+  int cacheCount;
+};
+
+/**
+ * @brief Marks the end of the current chunk.
+ *
+ * @return The mark to pass to `discardCode`.
+ */
+static CodeMark markCode()
+{
+  auto chunk = currentChunk();
+  CodeMark mark;
+  mark.count = chunk->count;
+  mark.constantCount = chunk->constants.count;
+  mark.cacheCount = chunk->cacheCount;
+  return mark;
+}
+
+/**
+ * @brief Drops the code emitted since a mark, with the constants and inline
+ * caches added for it.
+ *
+ * Nothing outside the code can refer to what it added, as long as no jump
+ * from before the mark was patched to land after it.
+ *
+ * @param mark A mark from `markCode`.
+ */
+static void discardCode(CodeMark mark)
+{
+  auto chunk = currentChunk();
+  chunk->truncateChunk(mark.count);
+  if (chunk->constants.count > mark.constantCount)
+    chunk->constants.count = mark.constantCount;
+  chunk->cacheCount = mark.cacheCount;
+  if (current->lastCall >= mark.count)
+    current->lastCall = -1;
+  while (current->captureCount > 0
+         && current->captures[current->captureCount - 1].offset >= mark.count)
+  {
+    current->captureCount--;
+  }
+}
+
+/**
+ * @brief Reads the value the code between two offsets loads, if all the code
+ * does is load a constant.
+ *
+ * @param start The offset the code starts at.
+ * @param end The offset just past the code.
+ * @param value Set to the constant.
+ * @return `true` if the code is a single constant load.
+ */
+static bool constantBetween(int start, int end, Value* value)
+{
+  auto chunk = currentChunk();
+  if (end - start == 2 && chunk->code[start] == OP_CONSTANT) {
+    *value = chunk->constants.values[chunk->code[start + 1]];
+    return true;
+  }
+  if (end - start != 1)
+    return false;
+  switch (chunk->code[start]) {
+    case OP_NIL:
+      *value = NIL_VAL;
+      return true;
+    case OP_TRUE:
+      *value = BOOL_VAL(true);
+      return true;
+    case OP_FALSE:
+      *value = BOOL_VAL(false);
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+ * @brief Drops the code from an offset on, which only loads constants, along
+ * with the constants that were added for it last.
+ *
+ * @param start The offset of the first load.
+ */
+static void discardConstants(int start)
+{
+  auto chunk = currentChunk();
+  int loaded[2];
+  auto loadCount = 0;
+  for (auto offset = start; offset < chunk->count; offset++) {
+    if (chunk->code[offset] == OP_CONSTANT && loadCount < 2)
+      loaded[loadCount++] = chunk->code[++offset];
+  }
+  while (loadCount > 0 && loaded[loadCount - 1] == chunk->constants.count - 1)
+  {
+    chunk->constants.count--;
+    loadCount--;
+  }
+  chunk->truncateChunk(start);
+}
+
+/**
+ * @brief Replaces the code from an offset on, which only loads constants,
+ * with a load of the value computed from them.
+ *
+ * @param start The offset of the first load.
+ * @param value The folded value.
+ */
+static void emitFolded(int start, Value value)
+{
+  discardConstants(start);
+  if (IS_NIL(value)) {
+    emitByte(OP_NIL);
+  } else if (IS_BOOL(value)) {
+    emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emitConstant(value);
+  }
+}
+
+/**
+ * @brief Checks whether a constant is false in a condition, as the VM does.
+ */
+static bool isFalseConstant(Value value)
+{
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+/**
+ * @brief Computes a unary operator on a constant, as the VM would.
+ *
+ * @return `false` if the VM would raise an error instead.
+ */
+static bool foldUnary(TokenType operatorType, Value operand, Value* result)
+{
+  switch (operatorType) {
+    case TOKEN_BANG:
+      *result = BOOL_VAL(isFalseConstant(operand));
+      return true;
+    case TOKEN_MINUS:
+      if (!IS_NUMBER(operand))
+        return false;
+      *result = NUMBER_VAL(-AS_NUMBER(operand));
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+ * @brief Checks whether a number converts to an int the way the modulus
+ * instruction converts its operands, without overflowing.
+ */
+static bool fitsInt(double number)
+{
+  return number > -2147483648.0 && number < 2147483648.0;
+}
+
+/**
+ * @brief Computes a binary operator on constants, as the VM would.
+ *
+ * @return `false` if the VM would raise an error instead.
+ */
+static bool foldBinary(TokenType operatorType, Value a, Value b, Value* result)
+{
+  if (operatorType == TOKEN_EQUAL_EQUAL || operatorType == TOKEN_BANG_EQUAL) {
+    auto equal = valuesEqual(a, b);
+    *result = BOOL_VAL(operatorType == TOKEN_EQUAL_EQUAL ? equal : !equal);
+    return true;
+  }
+  if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+    auto left = AS_STRING(a);
+    auto right = AS_STRING(b);
+    auto length = left->length + right->length;
+    auto chars = ALLOCATE<char>(length + 1);
+    memcpy(chars, left->chars, left->length);
+    memcpy(chars + left->length, right->chars, right->length);
+    chars[length] = '\0';
+    *result = OBJ_VAL(takeString(chars, length));
+    return true;
+  }
+  if (!IS_NUMBER(a) || !IS_NUMBER(b))
+    return false;
+
+  auto x = AS_NUMBER(a);
+  auto y = AS_NUMBER(b);
+  switch (operatorType) {
+    case TOKEN_GREATER:
+      *result = BOOL_VAL(x > y);
+      return true;
+    case TOKEN_GREATER_EQUAL:
+      *result = BOOL_VAL(!(x < y));
+      return true;
+    case TOKEN_LESS:
+      *result = BOOL_VAL(x < y);
+      return true;
+    case TOKEN_LESS_EQUAL:
+      *result = BOOL_VAL(!(x > y));
+      return true;
+    case TOKEN_PLUS:
+      *result = NUMBER_VAL(x + y);
+      return true;
+    case TOKEN_MINUS:
+      *result = NUMBER_VAL(x - y);
+      return true;
+    case TOKEN_STAR:
+      *result = NUMBER_VAL(x * y);
+      return true;
+    case TOKEN_SLASH:
+      *result = NUMBER_VAL(x / y);
+      return true;
+    case TOKEN_MODULUS:
+      // The VM takes the remainder of the operands cast to int.
+      if (!fitsInt(x) || !fitsInt(y) || (int)y == 0)
+        return false;
+      *result = NUMBER_VAL((double)((int)x % (int)y));
+      return true;
+    default:
+      return false;
+  }
+}
+
 /**
  * @brief Patches a jump instruction with the calculated offset.
  *
@@ -491,6 +781,10 @@ static void initCompiler(Compiler* compiler, FunctionType type)
 
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
+  compiler->lastCall = -1;
+  compiler->captures = NULL;
+  compiler->captureCount = 0;
+  compiler->captureCapacity = 0;
   compiler->function = newFunction();
   current = compiler;
 
@@ -507,6 +801,7 @@ static void initCompiler(Compiler* compiler, FunctionType type)
   auto local = &current->locals[current->localCount++];
   local->depth = 0;
   local->isCaptured = false;
+  local->isAssigned = false;
   if (type != TYPE_FUNCTION) {
     local->name.start = "this";
     local->name.length = 4;
@@ -516,20 +811,254 @@ static void initCompiler(Compiler* compiler, FunctionType type)
   }
 }
 
+/**
+ * @brief Returns the offset a jump instruction transfers control to.
+ *
+ * @param chunk The chunk containing the jump.
+ * @param offset The offset of the jump instruction.
+ * @return The offset of the jump target.
+ */
+static int jumpTarget(Chunk* chunk, int offset)
+{
+  auto length = chunk->instructionLength(offset);
+  auto jump = (chunk->code[offset + length - 2] << 8)
+      | chunk->code[offset + length - 1];
+  if (chunk->code[offset] == OP_LOOP)
+    return offset + length - jump;
+  return offset + length + jump;
+}
+
+/**
+ * @brief Checks whether an instruction is a jump the peephole pass relocates.
+ *
+ * @param instruction The opcode to check.
+ * @return True for all jumps, whose offset is their last two operand bytes.
+ */
+static bool isJump(uint8_t instruction)
+{
+  return instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE
+      || instruction == OP_LOOP || instruction == OP_LESS_LOCALS_JUMP;
+}
+
+/**
+ * @brief Matches a fusable instruction sequence at an offset.
+ *
+ * Recognises the sequences loops compile to and writes the equivalent
+ * superinstruction to `out`. Jump operands are left for the caller to patch.
+ * A sequence is only fused if no jump lands inside it.
+ *
+ * @param chunk The chunk being optimised.
+ * @param offset The offset of the first instruction of the sequence.
+ * @param targets Marks every offset that is the target of a jump.
+ * @param out Receives the superinstruction.
+ * @param length Receives the size of the superinstruction.
+ * @return The number of bytes of the original sequence, or 0 if none matched.
+ */
+static int fuseInstructions(Chunk* chunk,
+                            int offset,
+                            bool* targets,
+                            uint8_t* out,
+                            int* length)
+{
+  constexpr int maxFused = 5;
+  int starts[maxFused + 1];
+  uint8_t ops[maxFused];
+  int found = 0;
+
+  starts[0] = offset;
+  while (found < maxFused && starts[found] < chunk->count) {
+    if (found > 0 && targets[starts[found]])
+      break;
+    ops[found] = chunk->code[starts[found]];
+    starts[found + 1] = starts[found] + chunk->instructionLength(starts[found]);
+    found++;
+  }
+  auto code = chunk->code;
+
+  // x = x + constant;
+  if (found >= 5 && ops[1] == OP_CONSTANT && ops[2] == OP_ADD
+      && ops[4] == OP_POP && IS_NUMBER(chunk->constants.values[code[starts[1] + 1]]))
+  {
+    if (ops[0] == OP_GET_LOCAL && ops[3] == OP_SET_LOCAL
+        && code[offset + 1] == code[starts[3] + 1])
+    {
+      out[0] = OP_INCR_LOCAL;
+      out[1] = code[offset + 1];
+      out[2] = code[starts[1] + 1];
+      *length = 3;
+      return starts[5] - offset;
+    }
+    if (ops[0] == OP_GET_GLOBAL && ops[3] == OP_SET_GLOBAL
+        && code[offset + 1] == code[starts[3] + 1]
+        && code[offset + 2] == code[starts[3] + 2])
+    {
+      out[0] = OP_INCR_GLOBAL;
+      out[1] = code[offset + 1];
+      out[2] = code[offset + 2];
+      out[3] = code[starts[1] + 1];
+      *length = 4;
+      return starts[5] - offset;
+    }
+  }
+
+  // Loop condition a < b on two locals.
+  if (found >= 5 && ops[0] == OP_GET_LOCAL && ops[1] == OP_GET_LOCAL
+      && ops[2] == OP_LESS && ops[3] == OP_JUMP_IF_FALSE && ops[4] == OP_POP)
+  {
+    out[0] = OP_LESS_LOCALS_JUMP;
+    out[1] = code[offset + 1];
+    out[2] = code[starts[1] + 1];
+    *length = 5;
+    return starts[5] - offset;
+  }
+
+  // x = value;
+  if (found >= 2 && ops[1] == OP_POP) {
+    if (ops[0] == OP_SET_LOCAL) {
+      out[0] = OP_SET_LOCAL_POP;
+      out[1] = code[offset + 1];
+      *length = 2;
+      return starts[2] - offset;
+    }
+    if (ops[0] == OP_SET_GLOBAL) {
+      out[0] = OP_SET_GLOBAL_POP;
+      out[1] = code[offset + 1];
+      out[2] = code[offset + 2];
+      *length = 3;
+      return starts[2] - offset;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Fuses common instruction sequences into superinstructions.
+ *
+ * Rewrites the chunk's code in a single pass and then relocates every jump,
+ * since fusing shrinks the code between a jump and its target. Fused
+ * instructions keep the line of the first instruction they replace.
+ *
+ * @param chunk The chunk to optimise.
+ */
+static void optimizeChunk(Chunk* chunk)
+{
+  auto count = chunk->count;
+  auto targets = ALLOCATE<bool>(count + 1);
+  for (int i = 0; i <= count; i++) {
+    targets[i] = false;
+  }
+  for (int offset = 0; offset < count;) {
+    if (isJump(chunk->code[offset]))
+      targets[jumpTarget(chunk, offset)] = true;
+    offset += chunk->instructionLength(offset);
+  }
+
+  // newOffsets maps every old instruction start to its new offset, and
+  // oldTargets remembers where each jump in the new code has to land.
+  auto code = ALLOCATE<uint8_t>(chunk->capacity);
+  // The new runs are built over the old ones, which always stay ahead.
+  auto lines = chunk->lines;
+  auto lineCount = chunk->lineCount;
+  auto line = 0;
+  chunk->lineCount = 0;
+  auto newOffsets = ALLOCATE<int>(count + 1);
+  auto oldTargets = ALLOCATE<int>(count);
+  int newCount = 0;
+  for (int offset = 0; offset < count;) {
+    newOffsets[offset] = newCount;
+
+    int length;
+    auto consumed =
+        fuseInstructions(chunk, offset, targets, &code[newCount], &length);
+    if (consumed == 0) {
+      consumed = length = chunk->instructionLength(offset);
+      memcpy(&code[newCount], &chunk->code[offset], length);
+    }
+    // Fused jumps inherit the target of the jump they absorbed.
+    for (int inner = offset; inner < offset + consumed;) {
+      if (isJump(chunk->code[inner]))
+        oldTargets[newCount] = jumpTarget(chunk, inner);
+      inner += chunk->instructionLength(inner);
+    }
+    while (line + 1 < lineCount && lines[line + 1].offset <= offset) {
+      line++;
+    }
+    chunk->addLine(newCount, lines[line].line);
+
+    newCount += length;
+    offset += consumed;
+  }
+  newOffsets[count] = newCount;
+
+  FREE_ARRAY<uint8_t>(chunk->code, chunk->capacity);
+  chunk->code = code;
+  chunk->count = newCount;
+
+  for (int offset = 0; offset < newCount;) {
+    auto length = chunk->instructionLength(offset);
+    if (isJump(code[offset])) {
+      auto target = newOffsets[oldTargets[offset]];
+      auto jump = code[offset] == OP_LOOP ? offset + length - target
+                                          : target - offset - length;
+      code[offset + length - 2] = (jump >> 8) & 0xff;
+      code[offset + length - 1] = jump & 0xff;
+    }
+    offset += length;
+  }
+
+  FREE_ARRAY<bool>(targets, count + 1);
+  FREE_ARRAY<int>(newOffsets, count + 1);
+  FREE_ARRAY<int>(oldTargets, count);
+}
+
+/**
+ * @brief Decides how the closures compiled so far capture the locals about
+ * to go out of scope.
+ *
+ * Every assignment to a local is compiled within its scope, so by now it is
+ * known whether it is ever assigned. One that isn't keeps the value it was
+ * declared with, which closures copy instead of sharing it through an
+ * upvalue.
+ *
+ * @param localCount The number of locals that stay in scope.
+ */
+static void settleCaptures(int localCount)
+{
+  auto chunk = currentChunk();
+  auto kept = 0;
+  for (int i = 0; i < current->captureCount; i++) {
+    auto site = current->captures[i];
+    if (site.local < localCount) {
+      current->captures[kept++] = site;
+    } else if (!current->locals[site.local].isAssigned) {
+      chunk->code[site.offset] = CAPTURE_VALUE;
+    }
+  }
+  current->captureCount = kept;
+}
+
 /**
  * @brief Completes the compilation process for the current scope and returns
  * the compiled function.
  *
- * Emits a return instruction, optionally prints the disassembled code for
- * debugging, and returns the compiled function. The current compiler is set to
- * the enclosing compiler.
+ * Emits a return instruction, fuses common instruction sequences, optionally
+ * prints the disassembled code for debugging, and returns the compiled
+ * function. The current compiler is set to the enclosing compiler.
  *
  * @return The compiled function object.
  */
 static ObjFunction* endCompiler()
 {
   emitReturn();
+  settleCaptures(0);
+  FREE_ARRAY<CaptureSite>(current->captures, current->captureCapacity);
   ObjFunction* function = current->function;
+  if (!parser.hadError) {
+    optimizeChunk(currentChunk());
+    function->maxSlots = currentChunk()->maxStackDepth(function->arity + 1);
+  }
+  // Its name and constants were stored without write barriers.
+  rememberObject((Obj*)function);
 
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
@@ -556,13 +1085,16 @@ static void endScope()
          && current->locals[current->localCount - 1].depth
              > current->scopeDepth)
   {
-    if (current->locals[current->localCount - 1].isCaptured) {
+    // Closures copy the locals that are never assigned.
+    auto local = &current->locals[current->localCount - 1];
+    if (local->isCaptured && local->isAssigned) {
       emitByte(OP_CLOSE_UPVALUE);
     } else {
       emitByte(OP_POP);
     }
     current->localCount--;
   }
+  settleCaptures(current->localCount);
 }
 
 /**
@@ -589,6 +1121,23 @@ static uint8_t identifierConstant(Token* name)
   return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+/**
+ * @brief Resolves a global variable to its slot in the VM.
+ *
+ * Reports an error if the slot doesn't fit in a two byte operand.
+ *
+ * @param name The identifier token.
+ * @return The index of the global in `VM::globalValues`.
+ */
+static int globalSlot(Token* name)
+{
+  auto slot = VM::getVM()->globalSlot(copyString(name->start, name->length));
+  if (slot > UINT16_MAX) {
+    error("Too many global variables.");
+  }
+  return slot;
+}
+
 /**
  * @brief Compares two tokens for identifier equality.
  *
@@ -699,6 +1248,22 @@ static int resolveUpvalue(Compiler* compiler, Token* name)
   return -1;
 }
 
+/**
+ * @brief Marks the local an upvalue refers to as assigned, through as many
+ * enclosing functions as it takes to reach it.
+ *
+ * @param compiler The compiler instance.
+ * @param upvalue The index of the upvalue in the compiler's upvalue list.
+ */
+static void markUpvalueAssigned(Compiler* compiler, int upvalue)
+{
+  auto index = compiler->upvalues[upvalue].index;
+  if (compiler->upvalues[upvalue].isLocal)
+    compiler->enclosing->locals[index].isAssigned = true;
+  else
+    markUpvalueAssigned(compiler->enclosing, index);
+}
+
 /**
  * @brief Adds a local variable to the current scope.
  *
@@ -717,6 +1282,7 @@ static void addLocal(Token name)
   local->name = name;
   local->depth = -1;
   local->isCaptured = false;
+  local->isAssigned = false;
 }
 
 /**
@@ -763,14 +1329,14 @@ static void declareVariable()
 /**
  * @brief Parses a variable declaration.
  *
- * Consumes an identifier token, declares the variable, and creates a constant
- * for it. Returns the index of the constant representing the variable's name.
+ * Consumes an identifier token and declares the variable. Returns the slot of
+ * the variable if it is a global.
  *
  * @param errorMessage The error message to display if the token is not an
  * identifier.
- * @return The index of the constant representing the variable's name.
+ * @return The slot of the global variable, or 0 for a local.
  */
-static uint8_t parseVariable(const char* errorMessage)
+static int parseVariable(const char* errorMessage)
 {
   consume(TOKEN_IDENTIFIER, errorMessage);
 
@@ -778,7 +1344,7 @@ static uint8_t parseVariable(const char* errorMessage)
   if (current->scopeDepth > 0)
     return 0;
 
-  return identifierConstant(&parser.previous);
+  return globalSlot(&parser.previous);
 }
 
 /**
@@ -787,15 +1353,15 @@ static uint8_t parseVariable(const char* errorMessage)
  * Marks the current local variable as initialized if in a scope, otherwise
  * emits a DEFINE_GLOBAL opcode.
  *
- * @param global The index of the global variable.
+ * @param global The slot of the global variable.
  */
-static void defineVariable(uint8_t global)
+static void defineVariable(int global)
 {
   if (current->scopeDepth > 0) {
     markInitialized();
     return;
   }
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
 /**
@@ -842,16 +1408,23 @@ static void namedVariable(Token name, bool canAssign)
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(&name);
+    arg = globalSlot(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
+  auto op = getOp;
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, (uint8_t)arg);
-  } else {
-    emitBytes(getOp, (uint8_t)arg);
+    op = setOp;
+    if (op == OP_SET_LOCAL)
+      current->locals[arg].isAssigned = true;
+    else if (op == OP_SET_UPVALUE)
+      markUpvalueAssigned(current, arg);
   }
+  if (op == OP_GET_GLOBAL || op == OP_SET_GLOBAL)
+    emitGlobal(op, arg);
+  else
+    emitBytes(op, (uint8_t)arg);
 }
 
 /**
@@ -935,7 +1508,8 @@ static void this_(bool canAssign)
  * @brief Parses a binary expression.
  *
  * Handles binary operators by parsing the right-hand side, emitting the
- * appropriate opcode, and handling precedence.
+ * appropriate opcode, and handling precedence. When both operands are
+ * constants, emits the result instead.
  *
  * @param canAssign Indicates whether assignment is allowed (unused in this
  * function).
@@ -943,9 +1517,22 @@ static void this_(bool canAssign)
 static void binary(bool canAssign)
 {
   TokenType operatorType = parser.previous.type;
+  auto leftStart = parser.operandStart;
+  auto rightStart = currentChunk()->count;
   ParseRule* rule = getRule(operatorType);
   parsePrecedence((Precedence)(rule->precedence + 1));
 
+  Value left;
+  Value right;
+  Value folded;
+  if (constantBetween(leftStart, rightStart, &left)
+      && constantBetween(rightStart, currentChunk()->count, &right)
+      && foldBinary(operatorType, left, right, &folded))
+  {
+    emitFolded(leftStart, folded);
+    return;
+  }
+
   switch (operatorType) {
     case TOKEN_BANG_EQUAL:
       emitBytes(OP_EQUAL, OP_NOT);
@@ -996,6 +1583,7 @@ static void binary(bool canAssign)
 static void call(bool canAssign)
 {
   uint8_t argCount = argumentList();
+  current->lastCall = currentChunk()->count;
   emitBytes(OP_CALL, argCount);
 }
 
@@ -1014,13 +1602,15 @@ static void dot(bool canAssign)
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
     emitBytes(OP_SET_PROPERTY, name);
-
+    emitInlineCache();
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     emitBytes(OP_INVOKE, name);
     emitByte(argCount);
+    emitInlineCache();
   } else {
     emitBytes(OP_GET_PROPERTY, name);
+    emitInlineCache();
   }
 }
 
@@ -1132,20 +1722,59 @@ static void emitLoop(int loopStart)
   emitByte(offset & 0xff);
 }
 
+/**
+ * @brief Compiles a statement that can never run and drops its code.
+ *
+ * It is still compiled for the errors it has.
+ */
+static void deadStatement()
+{
+  auto mark = markCode();
+  statement();
+  discardCode(mark);
+}
+
 /**
  * @brief Parses a block of statements.
  *
- * Parses declarations until the closing brace is encountered.
+ * Parses declarations until the closing brace is encountered. The code of the
+ * declarations after a return statement is dropped, as nothing can reach it.
  */
 static void block()
 {
   while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    auto returns = check(TOKEN_RETURN);
     declaration();
+    if (returns) {
+      auto mark = markCode();
+      while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+        declaration();
+      discardCode(mark);
+    }
   }
 
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
+/**
+ * @brief Remembers that the byte about to be emitted captures a local, for
+ * `settleCaptures` to decide whether closures copy it.
+ *
+ * @param local The index of the captured local.
+ */
+static void addCaptureSite(int local)
+{
+  if (current->captureCapacity < current->captureCount + 1) {
+    auto oldCapacity = current->captureCapacity;
+    current->captureCapacity = GROW_CAPACITY(oldCapacity);
+    current->captures = GROW_ARRAY<CaptureSite>(
+        current->captures, oldCapacity, current->captureCapacity);
+  }
+  current->captures[current->captureCount].offset = currentChunk()->count;
+  current->captures[current->captureCount].local = local;
+  current->captureCount++;
+}
+
 /**
  * @brief Compiles a function declaration.
  *
@@ -1166,7 +1795,7 @@ static void function(FunctionType type)
       if (current->function->arity > 255) {
         errorAtCurrent("Can't have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("Expect parameter name.");
+      auto constant = parseVariable("Expect parameter name.");
       defineVariable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -1178,7 +1807,12 @@ static void function(FunctionType type)
   emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
   for (int i = 0; i < function->upvalueCount; i++) {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
+    if (compiler.upvalues[i].isLocal) {
+      addCaptureSite(compiler.upvalues[i].index);
+      emitByte(CAPTURE_LOCAL);
+    } else {
+      emitByte(CAPTURE_UPVALUE);
+    }
     emitByte(compiler.upvalues[i].index);
   }
 }
@@ -1216,7 +1850,7 @@ static void classDeclaration()
   declareVariable();
 
   emitBytes(OP_CLASS, nameConstant);
-  defineVariable(nameConstant);
+  defineVariable(current->scopeDepth > 0 ? 0 : globalSlot(&className));
 
   ClassCompiler classCompiler;
   classCompiler.hasSuperclass = false;
@@ -1263,7 +1897,7 @@ static void classDeclaration()
  */
 static void funDeclaration()
 {
-  uint8_t global = parseVariable("Expect function name.");
+  auto global = parseVariable("Expect function name.");
   markInitialized();
   function(TYPE_FUNCTION);
   defineVariable(global);
@@ -1277,7 +1911,7 @@ static void funDeclaration()
  */
 static void varDeclaration()
 {
-  uint8_t global = parseVariable("Expect variable name.");
+  auto global = parseVariable("Expect variable name.");
 
   if (match(TOKEN_EQUAL)) {
     expression();
@@ -1305,7 +1939,8 @@ static void expressionStatement()
  * @brief Parses a for statement.
  *
  * Handles the syntax and logic for for loops, including initializer, condition,
- * increment, and body.
+ * increment, and body. A constant condition is left out of the loop, and so
+ * are the increment and body when it is false.
  */
 static void forStatement()
 {
@@ -1320,15 +1955,24 @@ static void forStatement()
   }
 
   int loopStart = currentChunk()->count;
+  auto loop = markCode();
 
   int exitJump = -1;
+  auto neverRuns = false;
   if (!match(TOKEN_SEMICOLON)) {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-    // Jump out of the loop if the condition is false.
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);  // Condition.
+    Value condition;
+    if (constantBetween(loopStart, currentChunk()->count, &condition)) {
+      // A true condition loops until a return, a false one never enters.
+      discardConstants(loopStart);
+      neverRuns = isFalseConstant(condition);
+    } else {
+      // Jump out of the loop if the condition is false.
+      exitJump = emitJump(OP_JUMP_IF_FALSE);
+      emitByte(OP_POP);  // Condition.
+    }
   }
 
   if (!match(TOKEN_RIGHT_PAREN)) {
@@ -1345,6 +1989,8 @@ static void forStatement()
 
   statement();
   emitLoop(loopStart);
+  if (neverRuns)
+    discardCode(loop);
 
   if (exitJump != -1) {
     patchJump(exitJump);
@@ -1357,14 +2003,34 @@ static void forStatement()
 /**
  * @brief Parses an if statement.
  *
- * Handles the if and optional else branches.
+ * Handles the if and optional else branches. A constant condition compiles to
+ * the branch it picks alone.
  */
 static void ifStatement()
 {
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  auto conditionStart = currentChunk()->count;
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+  Value condition;
+  if (constantBetween(conditionStart, currentChunk()->count, &condition)) {
+    // Only the branch the condition picks is kept.
+    discardConstants(conditionStart);
+    auto taken = !isFalseConstant(condition);
+    if (taken)
+      statement();
+    else
+      deadStatement();
+    if (match(TOKEN_ELSE)) {
+      if (taken)
+        deadStatement();
+      else
+        statement();
+    }
+    return;
+  }
+
   auto thenJump = emitJump(OP_JUMP_IF_FALSE);
   emitByte(OP_POP);
   statement();
@@ -1394,7 +2060,7 @@ static void printStatement()
  * @brief Parses a return statement.
  *
  * Handles return statements with and without return values, and checks for
- * valid return contexts.
+ * valid return contexts. Returning the result of a call makes it a tail call.
  */
 static void returnStatement()
 {
@@ -1410,6 +2076,9 @@ static void returnStatement()
     }
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+    // A call whose result is returned right away can take over the frame.
+    if (current->lastCall == currentChunk()->count - 2)
+      currentChunk()->code[current->lastCall] = OP_TAIL_CALL;
     emitByte(OP_RETURN);
   }
 }
@@ -1417,7 +2086,8 @@ static void returnStatement()
 /**
  * @brief Parses a while statement.
  *
- * Handles the while loop condition, body, and loop control.
+ * Handles the while loop condition, body, and loop control. A constant
+ * condition is left out of the loop, and so is the body when it is false.
  */
 static void whileStatement()
 {
@@ -1426,6 +2096,19 @@ static void whileStatement()
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+  Value condition;
+  if (constantBetween(loopStart, currentChunk()->count, &condition)) {
+    // A true condition loops until a return, a false one never enters.
+    discardConstants(loopStart);
+    if (isFalseConstant(condition)) {
+      deadStatement();
+    } else {
+      statement();
+      emitLoop(loopStart);
+    }
+    return;
+  }
+
   auto exitJump = emitJump(OP_JUMP_IF_FALSE);
   emitByte(OP_POP);
   statement();
@@ -1524,7 +2207,16 @@ static void statement()
  */
 static void number(bool canAssign)
 {
-  double value = strtod(parser.previous.start, NULL);
+  // A mapped source file isn't terminated after its last token, so strtod
+  // parses a terminated copy, kept on the heap for the rare long literal.
+  char buffer[64];
+  auto length = (size_t)parser.previous.length;
+  auto text = length < sizeof(buffer) ? buffer : ALLOCATE<char>(length + 1);
+  memcpy(text, parser.previous.start, length);
+  text[length] = '\0';
+  double value = strtod(text, NULL);
+  if (text != buffer)
+    FREE_ARRAY<char>(text, length + 1);
   emitConstant(NUMBER_VAL(value));
 }
 
@@ -1551,6 +2243,7 @@ static void string(bool canAssign)
  */
 static void parsePrecedence(Precedence precedence)
 {
+  auto start = currentChunk()->count;
   advance();
   ParseFn prefixRule = getRule(parser.previous.type)->prefix;
   if (prefixRule == NULL) {
@@ -1564,6 +2257,7 @@ static void parsePrecedence(Precedence precedence)
   while (precedence <= getRule(parser.current.type)->precedence) {
     advance();
     ParseFn infixRule = getRule(parser.previous.type)->infix;
+    parser.operandStart = start;
     infixRule(canAssign);
   }
 
@@ -1576,7 +2270,7 @@ static void parsePrecedence(Precedence precedence)
  * @brief Parses a unary expression.
  *
  * Handles unary operators (negation and logical NOT) by parsing the operand and
- * emitting the corresponding opcode.
+ * emitting the corresponding opcode, or the result for a constant operand.
  *
  * @param canAssign Indicates whether assignment is allowed (unused in this
  * function).
@@ -1586,8 +2280,18 @@ static void unary(bool canAssign)
   auto operatorType = parser.previous.type;
 
   // Compile the operand.
+  auto operandStart = currentChunk()->count;
   parsePrecedence(PREC_UNARY);
 
+  Value operand;
+  Value folded;
+  if (constantBetween(operandStart, currentChunk()->count, &operand)
+      && foldUnary(operatorType, operand, &folded))
+  {
+    emitFolded(operandStart, folded);
+    return;
+  }
+
   // Emit the operator instruction.
   switch (operatorType) {
     case TOKEN_BANG:
@@ -1601,8 +2305,32 @@ static void unary(bool canAssign)
   }
 }
 
+/**
+ * @brief Parses an `or` expression.
+ *
+ * A constant left operand decides the result: a true one is the result and
+ * the right operand is never evaluated, a false one leaves the right operand
+ * as the result.
+ *
+ * @param canAssign Indicates whether assignment is allowed (unused in this
+ * function).
+ */
 static void or_(bool canAssign)
 {
+  Value left;
+  auto leftStart = parser.operandStart;
+  if (constantBetween(leftStart, currentChunk()->count, &left)) {
+    if (isFalseConstant(left)) {
+      discardConstants(leftStart);
+      parsePrecedence(PREC_OR);
+    } else {
+      auto mark = markCode();
+      parsePrecedence(PREC_OR);
+      discardCode(mark);
+    }
+    return;
+  }
+
   int elseJump = emitJump(OP_JUMP_IF_FALSE);
   int endJump = emitJump(OP_JUMP);
 
@@ -1613,8 +2341,32 @@ static void or_(bool canAssign)
   patchJump(endJump);
 }
 
+/**
+ * @brief Parses an `and` expression.
+ *
+ * A constant left operand decides the result: a false one is the result and
+ * the right operand is never evaluated, a true one leaves the right operand
+ * as the result.
+ *
+ * @param canAssign Indicates whether assignment is allowed (unused in this
+ * function).
+ */
 static void and_(bool canAssign)
 {
+  Value left;
+  auto leftStart = parser.operandStart;
+  if (constantBetween(leftStart, currentChunk()->count, &left)) {
+    if (isFalseConstant(left)) {
+      auto mark = markCode();
+      parsePrecedence(PREC_AND);
+      discardCode(mark);
+    } else {
+      discardConstants(leftStart);
+      parsePrecedence(PREC_AND);
+    }
+    return;
+  }
+
   int endJump = emitJump(OP_JUMP_IF_FALSE);
 
   emitByte(OP_POP);
@@ -1695,14 +2447,15 @@ static ParseRule* getRule(TokenType type)
  * process. Returns the compiled function or NULL if errors occurred.
  *
  * @param source The source code to compile.
+ * @param length The number of characters in the source code.
  * @return The compiled function object, or NULL on error.
  */
-ObjFunction* compile(const char* source)
+ObjFunction* compile(const char* source, size_t length)
 {
   auto scanner = Scanner::getScanner();
-  scanner->initScanner(source);
+  scanner->initScanner(source, length);
   Compiler compiler;
-  ObjFunction* compile(const char* source);
+  ObjFunction* compile(const char* source, size_t length);
   initCompiler(&compiler, TYPE_SCRIPT);
 
   parser.hadError = false;
@@ -1726,7 +2479,9 @@ void markCompilerRoots()
 {
   Compiler* compiler = current;
   while (compiler != NULL) {
-    markObject((Obj*)compiler->function);
+    // Functions are still being written to while they compile.
+    rememberObject((Obj*)compiler->function);
+    rescanObject((Obj*)compiler->function);
     compiler = compiler->enclosing;
   }
 }
\ No newline at end of file
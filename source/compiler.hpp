@@ -9,9 +9,11 @@
  * Creates a scanner, compiler, and parser to process the source code and
  generate bytecode.
 
- * @param source The source code to be compiled.
+ * @param source The source code to be compiled, which doesn't need to be
+ null-terminated.
+ * @param length The number of characters in the source code.
  * @return A pointer to the compiled function object, or NULL on error.
  */
-ObjFunction* compile(const char* source);
+ObjFunction* compile(const char* source, size_t length);
 
 #endif
\ No newline at end of file
@@ -4,6 +4,78 @@
 
 #include "object.hpp"
 #include "value.hpp"
+#include "vm.hpp"
+
+/**
+ * @brief The name of every opcode, indexed by its value.
+ */
+static const char* const opcodeNames[] = {
+    "OP_CONSTANT",
+    "OP_NIL",
+    "OP_TRUE",
+    "OP_FALSE",
+    "OP_EQUAL",
+    "OP_GREATER",
+    "OP_LESS",
+    "OP_RETURN",
+    "OP_NEGATE",
+    "OP_ADD",
+    "OP_SUBTRACT",
+    "OP_MULTIPLY",
+    "OP_DIVIDE",
+    "OP_MODULUS",
+    "OP_NOT",
+    "OP_PRINT",
+    "OP_JUMP",
+    "OP_JUMP_IF_FALSE",
+    "OP_LOOP",
+    "OP_CALL",
+    "OP_TAIL_CALL",
+    "OP_INVOKE",
+    "OP_SUPER_INVOKE",
+    "OP_CLOSURE",
+    "OP_GET_UPVALUE",
+    "OP_SET_UPVALUE",
+    "OP_GET_PROPERTY",
+    "OP_SET_PROPERTY",
+    "OP_POP",
+    "OP_GET_LOCAL",
+    "OP_SET_LOCAL",
+    "OP_DEFINE_GLOBAL",
+    "OP_CLOSE_UPVALUE",
+    "OP_CLASS",
+    "OP_INHERIT",
+    "OP_GET_SUPER",
+    "OP_METHOD",
+    "OP_GET_GLOBAL",
+    "OP_SET_GLOBAL",
+    "OP_BUILD_LIST",
+    "OP_INDEX_GET",
+    "OP_INDEX_SET",
+    "OP_ADD_NUMBER",
+    "OP_SUBTRACT_NUMBER",
+    "OP_SET_LOCAL_POP",
+    "OP_SET_GLOBAL_POP",
+    "OP_INCR_LOCAL",
+    "OP_INCR_GLOBAL",
+    "OP_LESS_LOCALS_JUMP",
+};
+
+static_assert(sizeof(opcodeNames) / sizeof(opcodeNames[0]) == OP_COUNT,
+              "Every opcode needs a name.");
+
+/**
+ * @brief Returns the name of an opcode, for reports.
+ *
+ * @param instruction The opcode.
+ * @return The name of the opcode, or "OP_UNKNOWN" if it isn't one.
+ */
+const char* opcodeName(int instruction)
+{
+  if (instruction < 0 || instruction >= OP_COUNT)
+    return "OP_UNKNOWN";
+  return opcodeNames[instruction];
+}
 
 /**
  * @brief Prints a simple instruction and returns the next offset.
@@ -93,6 +165,70 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset)
   return offset + 2;
 }
 
+/**
+ * @brief Disassembles a global variable instruction.
+
+ * Prints the instruction name, the global's slot and its name.
+
+ * @param name The name of the instruction.
+ * @param chunk The chunk containing the instruction.
+ * @param offset The offset of the instruction in the chunk.
+ * @return The next offset in the chunk.
+ */
+static int globalInstruction(const char* name, Chunk* chunk, int offset)
+{
+  uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+  slot |= chunk->code[offset + 2];
+  printf("%-16s %4d '", name, slot);
+  printValue(VM::getVM()->globalNames.values[slot]);
+  printf("'\n");
+  return offset + 3;
+}
+
+/**
+ * @brief Disassembles an increment superinstruction.
+
+ * Prints the instruction name, the local or global slot and the constant added
+ * to it.
+
+ * @param name The name of the instruction.
+ * @param chunk The chunk containing the instruction.
+ * @param offset The offset of the instruction in the chunk.
+ * @return The next offset in the chunk.
+ */
+static int incrementInstruction(const char* name, Chunk* chunk, int offset)
+{
+  auto length = chunk->instructionLength(offset);
+  int slot = chunk->code[offset + 1];
+  if (length == 4)
+    slot = (slot << 8) | chunk->code[offset + 2];
+  uint8_t constant = chunk->code[offset + length - 1];
+  printf("%-16s %4d += '", name, slot);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + length;
+}
+
+/**
+ * @brief Disassembles a compare-and-jump superinstruction.
+
+ * Prints the instruction name, the two local slots and the jump target.
+
+ * @param name The name of the instruction.
+ * @param chunk The chunk containing the instruction.
+ * @param offset The offset of the instruction in the chunk.
+ * @return The next offset in the chunk.
+ */
+static int compareJumpInstruction(const char* name, Chunk* chunk, int offset)
+{
+  uint8_t a = chunk->code[offset + 1];
+  uint8_t b = chunk->code[offset + 2];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+  jump |= chunk->code[offset + 4];
+  printf("%-16s %4d %4d -> %d\n", name, a, b, offset + 5 + jump);
+  return offset + 5;
+}
+
 /**
  * @brief Disassembles an invoke instruction.
 
@@ -113,6 +249,50 @@ static int invokeInstruction(const char* name, Chunk* chunk, int offset)
   return offset + 3;
 }
 
+/**
+ * @brief Disassembles a property instruction with an inline cache.
+
+ * Prints the instruction name, the property name and the cache index.
+
+ * @param name The name of the instruction.
+ * @param chunk The chunk containing the instruction.
+ * @param offset The offset of the instruction in the chunk.
+ * @return The next offset in the chunk.
+ */
+static int propertyInstruction(const char* name, Chunk* chunk, int offset)
+{
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+  cache |= chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' ic %d\n", cache);
+  return offset + 4;
+}
+
+/**
+ * @brief Disassembles an invoke instruction with an inline cache.
+
+ * Prints the instruction name, argument count, the invoked function's name and
+ * the cache index.
+
+ * @param name The name of the instruction.
+ * @param chunk The chunk containing the instruction.
+ * @param offset The offset of the instruction in the chunk.
+ * @return The next offset in the chunk.
+ */
+static int cachedInvokeInstruction(const char* name, Chunk* chunk, int offset)
+{
+  uint8_t constant = chunk->code[offset + 1];
+  uint8_t argCount = chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+  cache |= chunk->code[offset + 4];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' ic %d\n", cache);
+  return offset + 5;
+}
+
 /**
  * @brief Disassembles a single instruction from the given chunk at the
  * specified offset.
@@ -128,10 +308,11 @@ int disassembleInstruction(Chunk* chunk, int offset)
 {
   printf("%04d ", offset);
 
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  auto line = chunk->getLine(offset);
+  if (offset > 0 && line == chunk->getLine(offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
 
   uint8_t instruction = chunk->code[offset];
@@ -181,11 +362,13 @@ int disassembleInstruction(Chunk* chunk, int offset)
 
       ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
       for (int j = 0; j < function->upvalueCount; j++) {
-        int isLocal = chunk->code[offset++];
+        int kind = chunk->code[offset++];
         int index = chunk->code[offset++];
         printf("%04d      |                     %s %d\n",
                offset - 2,
-               isLocal ? "local" : "upvalue",
+               kind == CAPTURE_UPVALUE ? "upvalue"
+                   : kind == CAPTURE_LOCAL ? "local"
+                                           : "value",
                index);
       }
 
@@ -194,11 +377,11 @@ int disassembleInstruction(Chunk* chunk, int offset)
     case OP_POP:
       return simpleInstruction("OP_POP", offset);
     case OP_DEFINE_GLOBAL:
-      return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+      return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
     case OP_GET_GLOBAL:
-      return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+      return globalInstruction("OP_GET_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-      return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+      return globalInstruction("OP_SET_GLOBAL", chunk, offset);
     case OP_GET_LOCAL:
       return byteInstruction("OP_GET_LOCAL", chunk, offset);
     case OP_SET_LOCAL:
@@ -211,6 +394,8 @@ int disassembleInstruction(Chunk* chunk, int offset)
       return jumpInstruction("OP_LOOP", -1, chunk, offset);
     case OP_CALL:
       return byteInstruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+      return byteInstruction("OP_TAIL_CALL", chunk, offset);
     case OP_GET_UPVALUE:
       return byteInstruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
@@ -222,18 +407,32 @@ int disassembleInstruction(Chunk* chunk, int offset)
     case OP_CLASS:
       return constantInstruction("OP_CLASS", chunk, offset);
     case OP_GET_PROPERTY:
-      return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
-      return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+      return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
     case OP_INVOKE:
-      return invokeInstruction("OP_INVOKE", chunk, offset);
+      return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
       // TODO: fix debugging of this instructions
     case OP_BUILD_LIST:
-      return simpleInstruction("OP_BUILD_LIST", offset);
+      return byteInstruction("OP_BUILD_LIST", chunk, offset);
     case OP_INDEX_GET:
       return simpleInstruction("OP_INDEX_GET", offset);
     case OP_INDEX_SET:
       return simpleInstruction("OP_INDEX_SET", offset);
+    case OP_ADD_NUMBER:
+      return simpleInstruction("OP_ADD_NUMBER", offset);
+    case OP_SUBTRACT_NUMBER:
+      return simpleInstruction("OP_SUBTRACT_NUMBER", offset);
+    case OP_SET_LOCAL_POP:
+      return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+    case OP_SET_GLOBAL_POP:
+      return globalInstruction("OP_SET_GLOBAL_POP", chunk, offset);
+    case OP_INCR_LOCAL:
+      return incrementInstruction("OP_INCR_LOCAL", chunk, offset);
+    case OP_INCR_GLOBAL:
+      return incrementInstruction("OP_INCR_GLOBAL", chunk, offset);
+    case OP_LESS_LOCALS_JUMP:
+      return compareJumpInstruction("OP_LESS_LOCALS_JUMP", chunk, offset);
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
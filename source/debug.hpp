@@ -27,4 +27,12 @@ void disassembleChunk(Chunk* chunk, const char* name);
  */
 int disassembleInstruction(Chunk* chunk, int offset);
 
+/**
+ * @brief Returns the name of an opcode, for reports.
+ *
+ * @param instruction The opcode.
+ * @return The name of the opcode, or "OP_UNKNOWN" if it isn't one.
+ */
+const char* opcodeName(int instruction);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,283 @@
+#include "input.hpp"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mutex>
+
+#include "output.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#  include <errno.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#  define INPUT_POSIX
+#endif
+
+/**
+ * @brief The size of the first buffer read into, when stdin can't be mapped.
+ */
+constexpr size_t INPUT_BUFFER_SIZE = 64 * 1024;
+
+/**
+ * @brief The longest number `readInputNumber` parses with `strtod`.
+ */
+constexpr size_t NUMBER_MAX = 511;
+
+/**
+ * @brief The input read so far, or all of stdin when it is mapped.
+ *
+ * There is one buffer for the whole process, so VMs running on different
+ * threads take turns reading stdin rather than each reading it again.
+ */
+static char* inputData = NULL;
+static size_t inputPosition = 0;
+static size_t inputLength = 0;
+static size_t inputCapacity = 0;
+static bool inputMapped = false;
+static bool inputOpened = false;
+
+/**
+ * @brief Whether stdin has nothing more to read into the buffer.
+ */
+static bool inputEnded = false;
+
+/**
+ * @brief Held by the thread reading the buffer, see `lockInput`.
+ */
+static std::mutex inputMutex;
+
+/**
+ * @brief Maps stdin if it is a regular file, or allocates the read buffer.
+ */
+static void openInput()
+{
+  inputOpened = true;
+#ifdef INPUT_POSIX
+  struct stat info;
+  if (fstat(STDIN_FILENO, &info) == 0 && S_ISREG(info.st_mode)
+      && info.st_size > 0)
+  {
+    auto offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    auto data = mmap(
+        NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+    if (offset >= 0 && offset <= info.st_size && data != MAP_FAILED) {
+      inputData = (char*)data;
+      inputPosition = (size_t)offset;
+      inputLength = (size_t)info.st_size;
+      inputCapacity = inputLength;
+      inputMapped = true;
+      inputEnded = true;
+      return;
+    }
+    if (data != MAP_FAILED)
+      munmap(data, (size_t)info.st_size);
+  }
+#endif
+  inputData = (char*)malloc(INPUT_BUFFER_SIZE);
+  if (inputData == NULL) {
+    fprintf(stderr, "Not enough memory to read input.\n");
+    exit(74);
+  }
+  inputCapacity = INPUT_BUFFER_SIZE;
+}
+
+/**
+ * @brief Reads more of stdin onto the end of the unread input.
+ *
+ * The unread input is moved to the front of the buffer first, so offsets from
+ * `inputPosition` stay valid across the call but pointers into the buffer
+ * don't. Anything printed is flushed before waiting, so prompts show up.
+ *
+ * @return `true` if more input was read, `false` at the end of stdin.
+ */
+static bool fillInput()
+{
+  if (!inputOpened) {
+    openInput();
+    if (inputMapped)
+      return true;
+  }
+  if (inputEnded)
+    return false;
+
+  if (inputPosition > 0) {
+    memmove(inputData, inputData + inputPosition, inputLength - inputPosition);
+    inputLength -= inputPosition;
+    inputPosition = 0;
+  }
+  if (inputLength == inputCapacity) {
+    auto data = (char*)realloc(inputData, inputCapacity * 2);
+    if (data == NULL) {
+      fprintf(stderr, "Not enough memory to read input.\n");
+      exit(74);
+    }
+    inputData = data;
+    inputCapacity *= 2;
+  }
+
+  flushOutput();
+#ifdef INPUT_POSIX
+  ssize_t count;
+  do {
+    count =
+        read(STDIN_FILENO, inputData + inputLength, inputCapacity - inputLength);
+  } while (count < 0 && errno == EINTR);
+#else
+  auto count = (long)fread(
+      inputData + inputLength, 1, inputCapacity - inputLength, stdin);
+#endif
+  if (count <= 0) {
+    inputEnded = true;
+    return false;
+  }
+  inputLength += (size_t)count;
+  return true;
+}
+
+/**
+ * @brief Returns whether the unread input has at least `offset + 1` characters,
+ * reading more of stdin if it needs to.
+ */
+static inline bool hasInput(size_t offset)
+{
+  while (inputPosition + offset >= inputLength) {
+    if (!fillInput())
+      return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Consumes the whitespace at the start of the unread input.
+ */
+static void skipWhitespace()
+{
+  while (hasInput(0) && isspace((unsigned char)inputData[inputPosition]))
+    inputPosition++;
+}
+
+std::unique_lock<std::mutex> lockInput()
+{
+  return std::unique_lock<std::mutex>(inputMutex);
+}
+
+int readInputChar()
+{
+  if (!hasInput(0))
+    return -1;
+  return (unsigned char)inputData[inputPosition++];
+}
+
+bool readInputWord(const char** chars, size_t* length)
+{
+  skipWhitespace();
+  size_t count = 0;
+  while (hasInput(count)
+         && !isspace((unsigned char)inputData[inputPosition + count]))
+  {
+    count++;
+  }
+
+  *chars = inputData + inputPosition;
+  *length = count;
+  inputPosition += count;
+  return count > 0;
+}
+
+bool readInputNumber(double* number)
+{
+  skipWhitespace();
+
+  // Most numbers in input are small integers, which are exact as doubles.
+  size_t count = 0;
+  if (hasInput(0)
+      && (inputData[inputPosition] == '-' || inputData[inputPosition] == '+'))
+  {
+    count++;
+  }
+  double value = 0;
+  size_t digits = 0;
+  while (digits < 15 && hasInput(count)
+         && isdigit((unsigned char)inputData[inputPosition + count]))
+  {
+    value = value * 10 + (inputData[inputPosition + count] - '0');
+    count++;
+    digits++;
+  }
+  if (digits > 0
+      && (!hasInput(count)
+          || isspace((unsigned char)inputData[inputPosition + count])))
+  {
+    *number = inputData[inputPosition] == '-' ? -value : value;
+    inputPosition += count;
+    return true;
+  }
+
+  // Anything else goes through strtod, on a terminated copy of the word.
+  char buffer[NUMBER_MAX + 1];
+  count = 0;
+  while (count < NUMBER_MAX && hasInput(count)
+         && !isspace((unsigned char)inputData[inputPosition + count]))
+  {
+    buffer[count] = inputData[inputPosition + count];
+    count++;
+  }
+  buffer[count] = '\0';
+
+  char* end;
+  *number = strtod(buffer, &end);
+  inputPosition += (size_t)(end - buffer);
+  return end != buffer;
+}
+
+bool readInputLine(const char** chars, size_t* length)
+{
+  if (!hasInput(0))
+    return false;
+
+  size_t count = 0;
+  while (hasInput(count) && inputData[inputPosition + count] != '\n')
+    count++;
+  auto ended = !hasInput(count);
+
+  *chars = inputData + inputPosition;
+  *length = count;
+  inputPosition += ended ? count : count + 1;
+  if (count > 0 && (*chars)[count - 1] == '\r')
+    (*length)--;
+  return true;
+}
+
+void readInputAll(const char** chars, size_t* length)
+{
+  while (fillInput()) {
+  }
+
+  *chars = inputData + inputPosition;
+  *length = inputLength - inputPosition;
+  inputPosition = inputLength;
+}
+
+void freeInput()
+{
+  std::lock_guard<std::mutex> lock(inputMutex);
+#ifdef INPUT_POSIX
+  if (inputMapped)
+    munmap(inputData, inputCapacity);
+  else
+    free(inputData);
+#else
+  free(inputData);
+#endif
+  inputData = NULL;
+  inputPosition = 0;
+  inputLength = 0;
+  inputCapacity = 0;
+  inputMapped = false;
+  inputOpened = false;
+  inputEnded = false;
+}
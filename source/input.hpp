@@ -0,0 +1,79 @@
+#ifndef clox_input_h
+#define clox_input_h
+
+#include <stddef.h>
+
+#include <mutex>
+
+/**
+ * @brief Gives standard input to the calling thread until the lock is
+ * released.
+ *
+ * Every VM reads through the same buffer, so isolates share stdin as the
+ * threads of a program do, each read taking what comes next. The reads below
+ * must be made with the lock held, and so must any use of the characters they
+ * return, as a read on another thread can move them.
+ *
+ * @return The lock, held.
+ */
+std::unique_lock<std::mutex> lockInput();
+
+/**
+ * @brief Reads the next character of standard input.
+ *
+ * @return The character, or -1 at the end of the input.
+ */
+int readInputChar();
+
+/**
+ * @brief Reads the next whitespace separated word of standard input.
+ *
+ * Leading whitespace is skipped and the whitespace after the word is left
+ * unread, as `std::cin >>` does. The characters stay valid until the next read.
+ *
+ * @param chars Set to the first character of the word.
+ * @param length Set to the length of the word, or 0 at the end of the input.
+ * @return `true` if a word was read, `false` at the end of the input.
+ */
+bool readInputWord(const char** chars, size_t* length);
+
+/**
+ * @brief Reads the next number of standard input.
+ *
+ * Accepts everything `strtod` does after skipping leading whitespace. A word
+ * that isn't a number is left unread.
+ *
+ * @param number Set to the number read.
+ * @return `true` if a number was read, `false` otherwise.
+ */
+bool readInputNumber(double* number);
+
+/**
+ * @brief Reads the rest of the current line of standard input.
+ *
+ * The line ending, `\n` or `\r\n`, is consumed but not returned. The characters
+ * stay valid until the next read.
+ *
+ * @param chars Set to the first character of the line.
+ * @param length Set to the length of the line.
+ * @return `true` if a line was read, `false` at the end of the input.
+ */
+bool readInputLine(const char** chars, size_t* length);
+
+/**
+ * @brief Reads everything left on standard input.
+ *
+ * The characters stay valid until the next read.
+ *
+ * @param chars Set to the first character of the input.
+ * @param length Set to the length of the input.
+ */
+void readInputAll(const char** chars, size_t* length);
+
+/**
+ * @brief Releases the input buffer, or unmaps standard input, once no VM
+ * reads it any more.
+ */
+void freeInput();
+
+#endif
@@ -0,0 +1,1029 @@
+#include "isolate.hpp"
+
+#include <math.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "bytecode.hpp"
+#include "memory.hpp"
+#include "vm.hpp"
+
+/**
+ * @brief The kinds of value a message can hold.
+ *
+ * Every object that can be shared is numbered in the order it is written, so
+ * that a later occurrence is written as a reference to the number. An object
+ * is written before the objects it refers to, which follow it in order.
+ */
+typedef enum
+{
+  MESSAGE_NIL,
+  MESSAGE_TRUE,
+  MESSAGE_FALSE,
+  MESSAGE_UNDEFINED,
+  MESSAGE_NUMBER,
+  MESSAGE_STRING,
+  MESSAGE_REFERENCE,
+  MESSAGE_LIST,
+  MESSAGE_NUM_ARRAY,
+  MESSAGE_INSTANCE,
+  MESSAGE_CLASS,
+  MESSAGE_CLOSURE,
+  MESSAGE_UPVALUE,
+  MESSAGE_FUNCTION,
+  MESSAGE_NATIVE,
+  MESSAGE_BOUND_METHOD
+} MessageTag;
+
+/**
+ * @brief Writes the object graph of some values.
+ *
+ * The graph is walked with a stack of its own rather than by recursion, as a
+ * long linked list would overflow the thread's stack.
+ */
+class MessageWriter
+{
+public:
+  std::vector<uint8_t> body;
+
+  /**
+   * @brief The number of every shared object written so far.
+   */
+  std::unordered_map<Obj*, uint32_t> ids;
+
+  /**
+   * @brief The number the next shared object gets.
+   */
+  uint32_t nextId;
+
+  /**
+   * @brief The values still to write, the next one last.
+   */
+  std::vector<Value> pending;
+
+  /**
+   * @brief Set once a function is written.
+   */
+  bool hasFunctions;
+
+  /**
+   * @brief Whether the globals the written functions use are sent too.
+   */
+  bool sendsGlobals;
+
+  /**
+   * @brief Which global slots the functions written so far use.
+   */
+  std::vector<bool> usedGlobals;
+
+  /**
+   * @brief The slots of `usedGlobals`, in the order they were met.
+   */
+  std::vector<int> globalQueue;
+
+  /**
+   * @brief Writes the pending values and everything they refer to.
+   *
+   * @return `false` if a value can't be copied.
+   */
+  bool writePending()
+  {
+    while (!this->pending.empty()) {
+      auto value = this->pending.back();
+      this->pending.pop_back();
+      if (!this->writeValue(value))
+        return false;
+    }
+    return true;
+  }
+
+private:
+  /**
+   * @brief Queues the global slots a function and the functions nested in it
+   * use, each the first time it is met.
+   */
+  void noteGlobals(ObjFunction* function)
+  {
+    auto chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count;
+         offset += chunk->instructionLength(offset))
+    {
+      switch (chunk->code[offset]) {
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP:
+        case OP_INCR_GLOBAL: {
+          auto slot = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+          if ((size_t)slot < this->usedGlobals.size()
+              && !this->usedGlobals[(size_t)slot])
+          {
+            this->usedGlobals[(size_t)slot] = true;
+            this->globalQueue.push_back(slot);
+          }
+          break;
+        }
+        default:
+          break;
+      }
+    }
+    for (int i = 0; i < chunk->constants.count; i++) {
+      if (IS_FUNCTION(chunk->constants.values[i]))
+        this->noteGlobals(AS_FUNCTION(chunk->constants.values[i]));
+    }
+  }
+
+  /**
+   * @brief Numbers a shared object the first time it is met, or writes a
+   * reference to its number.
+   *
+   * @return `true` if the object has to be written.
+   */
+  bool remember(Obj* object)
+  {
+    auto found = this->ids.find(object);
+    if (found != this->ids.end()) {
+      put<uint8_t>(this->body, MESSAGE_REFERENCE);
+      put<uint32_t>(this->body, found->second);
+      return false;
+    }
+    this->ids[object] = this->nextId++;
+    return true;
+  }
+
+  /**
+   * @brief Writes a value, leaving the values it refers to pending.
+   */
+  bool writeValue(Value value)
+  {
+    if (IS_NIL(value)) {
+      put<uint8_t>(this->body, MESSAGE_NIL);
+      return true;
+    }
+    if (IS_BOOL(value)) {
+      put<uint8_t>(this->body, AS_BOOL(value) ? MESSAGE_TRUE : MESSAGE_FALSE);
+      return true;
+    }
+    if (IS_UNDEFINED(value)) {
+      put<uint8_t>(this->body, MESSAGE_UNDEFINED);
+      return true;
+    }
+    if (IS_NUMBER(value)) {
+      put<uint8_t>(this->body, MESSAGE_NUMBER);
+      put<double>(this->body, AS_NUMBER(value));
+      return true;
+    }
+
+    auto object = AS_OBJ(value);
+    switch (object->type) {
+      case OBJ_STRING:
+        put<uint8_t>(this->body, MESSAGE_STRING);
+        putString(this->body, (ObjString*)object);
+        return true;
+      case OBJ_ROPE:
+        put<uint8_t>(this->body, MESSAGE_STRING);
+        putString(this->body, flattenRope((ObjRope*)object));
+        return true;
+      case OBJ_NATIVE:
+        put<uint8_t>(this->body, MESSAGE_NATIVE);
+        put<uintptr_t>(this->body, (uintptr_t)((ObjNative*)object)->function);
+        return true;
+      case OBJ_FUNCTION:
+        if (!this->remember(object))
+          return true;
+        put<uint8_t>(this->body, MESSAGE_FUNCTION);
+        this->hasFunctions = true;
+        if (this->sendsGlobals)
+          this->noteGlobals((ObjFunction*)object);
+        return putFunction(this->body, (ObjFunction*)object);
+      case OBJ_NUM_ARRAY: {
+        if (!this->remember(object))
+          return true;
+        auto array = (ObjNumArray*)object;
+        put<uint8_t>(this->body, MESSAGE_NUM_ARRAY);
+        put<uint32_t>(this->body, (uint32_t)array->count);
+        auto bytes = (const uint8_t*)array->items;
+        this->body.insert(
+            this->body.end(), bytes, bytes + array->count * sizeof(double));
+        return true;
+      }
+      case OBJ_LIST: {
+        if (!this->remember(object))
+          return true;
+        auto list = (ObjList*)object;
+        put<uint8_t>(this->body, MESSAGE_LIST);
+        put<uint32_t>(this->body, (uint32_t)list->count);
+        for (int i = list->count - 1; i >= 0; i--)
+          this->pending.push_back(list->items[i]);
+        return true;
+      }
+      case OBJ_INSTANCE: {
+        if (!this->remember(object))
+          return true;
+        auto instance = (ObjInstance*)object;
+        put<uint8_t>(this->body, MESSAGE_INSTANCE);
+        put<uint32_t>(this->body, (uint32_t)instance->shape->fieldCount);
+        // Each shape adds the field in its last slot, so walking up from the
+        // instance's shape meets the fields from the last slot to the first.
+        for (auto shape = instance->shape; shape->fieldCount > 0;
+             shape = shape->parent)
+        {
+          this->pending.push_back(instance->fields[shape->fieldCount - 1]);
+          this->pending.push_back(OBJ_VAL(shape->name));
+        }
+        this->pending.push_back(OBJ_VAL(instance->klass));
+        return true;
+      }
+      case OBJ_CLASS: {
+        if (!this->remember(object))
+          return true;
+        auto klass = (ObjClass*)object;
+        put<uint8_t>(this->body, MESSAGE_CLASS);
+        putString(this->body, klass->name);
+        uint32_t count = 0;
+        for (int i = 0; i < klass->methods.capacity; i++) {
+          if (!klass->methods.hasEntry(i))
+            continue;
+          this->pending.push_back(klass->methods.entries[i].value);
+          this->pending.push_back(OBJ_VAL(klass->methods.entries[i].key));
+          count++;
+        }
+        put<uint32_t>(this->body, count);
+        return true;
+      }
+      case OBJ_CLOSURE: {
+        if (!this->remember(object))
+          return true;
+        auto closure = (ObjClosure*)object;
+        put<uint8_t>(this->body, MESSAGE_CLOSURE);
+        put<uint32_t>(this->body, (uint32_t)closure->upvalueCount);
+        for (int i = closure->upvalueCount - 1; i >= 0; i--)
+          this->pending.push_back(closure->upvalues[i]);
+        this->pending.push_back(OBJ_VAL(closure->function));
+        return true;
+      }
+      case OBJ_UPVALUE:
+        if (!this->remember(object))
+          return true;
+        put<uint8_t>(this->body, MESSAGE_UPVALUE);
+        this->pending.push_back(*((ObjUpvalue*)object)->location);
+        return true;
+      case OBJ_BOUND_METHOD: {
+        if (!this->remember(object))
+          return true;
+        auto bound = (ObjBoundMethod*)object;
+        put<uint8_t>(this->body, MESSAGE_BOUND_METHOD);
+        this->pending.push_back(OBJ_VAL(bound->method));
+        this->pending.push_back(bound->receiver);
+        return true;
+      }
+      default:
+        return false;
+    }
+  }
+};
+
+/**
+ * @brief Copies values into a message, and optionally the globals that the
+ * code of the functions among them can reach.
+ *
+ * The globals follow the values, each as its slot and then its value, and
+ * end with a slot of -1. A global's value can hold functions that use more
+ * globals, which are queued in turn.
+ */
+static bool writeValues(Message* message,
+                        const Value* values,
+                        int count,
+                        bool withGlobals)
+{
+  auto vm = VM::getVM();
+  MessageWriter writer;
+  writer.nextId = 1;
+  writer.hasFunctions = false;
+  writer.sendsGlobals = withGlobals;
+  if (withGlobals)
+    writer.usedGlobals.resize((size_t)vm->globalValues.count, false);
+  // The values are sent as the items of a list, numbered 0.
+  put<uint8_t>(writer.body, MESSAGE_LIST);
+  put<uint32_t>(writer.body, (uint32_t)count);
+  for (int i = count - 1; i >= 0; i--)
+    writer.pending.push_back(values[i]);
+  if (!writer.writePending())
+    return false;
+  if (withGlobals) {
+    for (size_t i = 0; i < writer.globalQueue.size(); i++) {
+      auto slot = writer.globalQueue[i];
+      put<int32_t>(writer.body, slot);
+      writer.pending.push_back(vm->globalValues.values[slot]);
+      if (!writer.writePending())
+        return false;
+    }
+    put<int32_t>(writer.body, -1);
+  }
+
+  message->clear();
+  put<uint8_t>(*message, writer.hasFunctions);
+  if (writer.hasFunctions) {
+    put<int32_t>(*message, vm->globalNames.count);
+    for (int i = 0; i < vm->globalNames.count; i++)
+      putString(*message, AS_STRING(vm->globalNames.values[i]));
+  }
+  message->insert(message->end(), writer.body.begin(), writer.body.end());
+  return true;
+}
+
+bool writeMessage(Message* message, const Value* values, int count)
+{
+  return writeValues(message, values, count, false);
+}
+
+/**
+ * @brief An object of a message being read whose references are still being
+ * read.
+ */
+class MessageFrame
+{
+public:
+  MessageTag tag;
+
+  /**
+   * @brief The number of the object.
+   */
+  uint32_t id;
+
+  /**
+   * @brief The references read so far.
+   */
+  uint32_t index;
+
+  /**
+   * @brief The references the object has.
+   */
+  uint32_t count;
+};
+
+/**
+ * @brief Rebuilds the object graph of a message in the current VM.
+ *
+ * Every object it creates is kept reachable, as creating the next one can
+ * collect.
+ */
+class MessageReader : public BytecodeReader
+{
+public:
+  /**
+   * @brief The shared objects read so far, by number, with nil for the ones
+   * that can only be created once their references are read.
+   */
+  ObjList* objects;
+
+  /**
+   * @brief The field and method names, and the receivers, read while the
+   * value that goes with them is.
+   */
+  ObjList* partners;
+
+  std::vector<MessageFrame> frames;
+
+  /**
+   * @brief Reads a value and everything it refers to.
+   *
+   * @return `false` if the message is malformed.
+   */
+  bool readValue(Value* result)
+  {
+    for (;;) {
+      Value value;
+      auto complete = false;
+      if (!this->readHeader(&value, &complete))
+        return false;
+      while (complete) {
+        if (this->frames.empty()) {
+          *result = value;
+          return true;
+        }
+        auto frame = &this->frames.back();
+        if (!this->addReference(frame, value))
+          return false;
+        if (++frame->index < frame->count)
+          break;
+        value = this->objects->items[frame->id];
+        this->frames.pop_back();
+      }
+    }
+  }
+
+private:
+  /**
+   * @brief Numbers a shared object, or reserves its number.
+   */
+  uint32_t remember(Value value)
+  {
+    auto vm = VM::getVM();
+    vm->push(value);
+    appendToList(this->objects, value);
+    vm->pop();
+    return (uint32_t)this->objects->count - 1;
+  }
+
+  /**
+   * @brief Keeps a value until its partner is read.
+   */
+  void keep(Value value)
+  {
+    auto vm = VM::getVM();
+    vm->push(value);
+    appendToList(this->partners, value);
+    vm->pop();
+  }
+
+  /**
+   * @brief Takes back the value kept last.
+   */
+  Value takeKept()
+  {
+    return this->partners->items[--this->partners->count];
+  }
+
+  /**
+   * @brief Checks that a count fits in the rest of the message, each item
+   * taking at least `size` bytes.
+   */
+  bool fits(uint32_t count, size_t size)
+  {
+    return !this->failed
+        && (size_t)count <= (size_t)(this->end - this->current) / size;
+  }
+
+  /**
+   * @brief Starts reading the references of an object.
+   *
+   * @return `true` if it has any, `false` if it is complete.
+   */
+  bool expect(MessageTag tag, uint32_t id, uint32_t count)
+  {
+    if (count == 0)
+      return false;
+    MessageFrame frame;
+    frame.tag = tag;
+    frame.id = id;
+    frame.index = 0;
+    frame.count = count;
+    this->frames.push_back(frame);
+    return true;
+  }
+
+  /**
+   * @brief Reads a value, or creates an object and starts reading its
+   * references.
+   *
+   * @param value Set to the value, unless it has references to read.
+   * @param complete Set to `true` if the value is complete.
+   * @return `false` if the message is malformed.
+   */
+  bool readHeader(Value* value, bool* complete)
+  {
+    auto vm = VM::getVM();
+    auto tag = (MessageTag)this->get<uint8_t>();
+    if (this->failed)
+      return false;
+    *complete = true;
+    switch (tag) {
+      case MESSAGE_NIL:
+        *value = NIL_VAL;
+        return true;
+      case MESSAGE_TRUE:
+        *value = BOOL_VAL(true);
+        return true;
+      case MESSAGE_FALSE:
+        *value = BOOL_VAL(false);
+        return true;
+      case MESSAGE_UNDEFINED:
+        *value = UNDEFINED_VAL;
+        return true;
+      case MESSAGE_NUMBER:
+        *value = NUMBER_VAL(this->get<double>());
+        return !this->failed;
+      case MESSAGE_STRING: {
+        auto string = this->getString();
+        *value = OBJ_VAL(string);
+        return string != NULL;
+      }
+      case MESSAGE_REFERENCE: {
+        auto id = this->get<uint32_t>();
+        if (this->failed || id >= (uint32_t)this->objects->count)
+          return false;
+        *value = this->objects->items[id];
+        return true;
+      }
+      case MESSAGE_NATIVE:
+        *value = OBJ_VAL(newNative((NativeFn)this->get<uintptr_t>()));
+        return !this->failed;
+      case MESSAGE_FUNCTION: {
+        auto function = this->getFunction();
+        if (function == NULL)
+          return false;
+        *value = OBJ_VAL(function);
+        this->remember(*value);
+        return true;
+      }
+      case MESSAGE_NUM_ARRAY: {
+        auto count = this->get<uint32_t>();
+        if (!this->fits(count, sizeof(double)))
+          return false;
+        auto array = newNumArray((int)count, 0);
+        memcpy(array->items, this->take(count * sizeof(double)),
+               count * sizeof(double));
+        *value = OBJ_VAL(array);
+        this->remember(*value);
+        return true;
+      }
+      case MESSAGE_LIST: {
+        auto count = this->get<uint32_t>();
+        if (!this->fits(count, 1))
+          return false;
+        auto list = newList();
+        *value = OBJ_VAL(list);
+        auto id = this->remember(*value);
+        reserveList(list, (int)count);
+        *complete = !this->expect(tag, id, count);
+        return true;
+      }
+      case MESSAGE_INSTANCE: {
+        auto fieldCount = this->get<uint32_t>();
+        if (!this->fits(fieldCount, 2))
+          return false;
+        auto id = this->remember(NIL_VAL);
+        *complete = !this->expect(tag, id, 1 + 2 * fieldCount);
+        return true;
+      }
+      case MESSAGE_CLASS: {
+        auto name = this->getString();
+        auto methodCount = this->get<uint32_t>();
+        if (name == NULL || !this->fits(methodCount, 2))
+          return false;
+        vm->push(OBJ_VAL(name));
+        auto klass = newClass(name);
+        *value = OBJ_VAL(klass);
+        auto id = this->remember(*value);
+        vm->pop();
+        *complete = !this->expect(tag, id, 2 * methodCount);
+        return true;
+      }
+      case MESSAGE_CLOSURE: {
+        auto upvalueCount = this->get<uint32_t>();
+        if (!this->fits(upvalueCount, 1))
+          return false;
+        auto id = this->remember(NIL_VAL);
+        *complete = !this->expect(tag, id, 1 + upvalueCount);
+        return true;
+      }
+      case MESSAGE_UPVALUE: {
+        auto upvalue = newUpvalue(NULL);
+        upvalue->location = &upvalue->closed;
+        auto id = this->remember(OBJ_VAL((Obj*)upvalue));
+        *complete = !this->expect(tag, id, 1);
+        return true;
+      }
+      case MESSAGE_BOUND_METHOD:
+        *complete = !this->expect(tag, this->remember(NIL_VAL), 2);
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  /**
+   * @brief Stores a value an object refers to, creating the object if it
+   * was waiting for it.
+   *
+   * @return `false` if the value doesn't fit where it goes.
+   */
+  bool addReference(MessageFrame* frame, Value value)
+  {
+    auto vm = VM::getVM();
+    auto object = this->objects->items[frame->id];
+    switch (frame->tag) {
+      case MESSAGE_LIST: {
+        auto list = AS_LIST(object);
+        list->items[list->count++] = value;
+        writeListBarrier(list, list->count - 1, value);
+        return true;
+      }
+      case MESSAGE_INSTANCE:
+        if (frame->index == 0) {
+          if (!IS_CLASS(value))
+            return false;
+          auto instance = newInstance(AS_CLASS(value));
+          storeToList(this->objects, (int)frame->id, OBJ_VAL(instance));
+        } else if (frame->index % 2 == 1) {
+          if (!IS_STRING(value))
+            return false;
+          this->keep(value);
+        } else {
+          auto name = this->takeKept();
+          vm->push(name);
+          vm->push(value);
+          setInstanceField(AS_INSTANCE(object), AS_STRING(name), value);
+          vm->pop();
+          vm->pop();
+        }
+        return true;
+      case MESSAGE_CLASS:
+        if (frame->index % 2 == 0) {
+          if (!IS_STRING(value))
+            return false;
+          this->keep(value);
+        } else {
+          auto name = this->takeKept();
+          if (!IS_CLOSURE(value))
+            return false;
+          vm->push(name);
+          AS_CLASS(object)->methods.tableSet(AS_STRING(name), value);
+          vm->pop();
+        }
+        return true;
+      case MESSAGE_CLOSURE:
+        if (frame->index == 0) {
+          if (!IS_FUNCTION(value)
+              || (uint32_t)AS_FUNCTION(value)->upvalueCount != frame->count - 1)
+          {
+            return false;
+          }
+          auto closure = newClosure(AS_FUNCTION(value));
+          storeToList(this->objects, (int)frame->id, OBJ_VAL(closure));
+        } else {
+          AS_CLOSURE(object)->upvalues[frame->index - 1] = value;
+          writeBarrier(AS_OBJ(object), value);
+        }
+        return true;
+      case MESSAGE_UPVALUE: {
+        auto upvalue = (ObjUpvalue*)AS_OBJ(object);
+        upvalue->closed = value;
+        writeBarrier((Obj*)upvalue, value);
+        return true;
+      }
+      case MESSAGE_BOUND_METHOD:
+        if (frame->index == 0) {
+          this->keep(value);
+        } else {
+          if (!IS_CLOSURE(value))
+            return false;
+          auto receiver = this->takeKept();
+          vm->push(receiver);
+          auto bound = newBoundMethod(receiver, AS_CLOSURE(value));
+          storeToList(this->objects, (int)frame->id, OBJ_VAL(bound));
+          vm->pop();
+        }
+        return true;
+      default:
+        return false;
+    }
+  }
+};
+
+/**
+ * @brief Rebuilds the values of a message, and with `withGlobals` stores the
+ * globals `writeValues` sent along in their slots.
+ */
+static ObjList* readValues(const Message& message, bool withGlobals)
+{
+  auto vm = VM::getVM();
+  MessageReader reader;
+  reader.current = message.data();
+  reader.end = reader.current + message.size();
+  reader.failed = false;
+
+  // As in a bytecode cache file, the code of the functions refers to globals
+  // by slot, so every name has to get the slot it had in the sender.
+  if (reader.get<uint8_t>()) {
+    auto globalCount = reader.get<int32_t>();
+    for (int i = 0; i < globalCount; i++) {
+      auto name = reader.getString();
+      if (name == NULL || vm->globalSlot(name) != i)
+        return NULL;
+    }
+  }
+
+  reader.objects = newList();
+  vm->push(OBJ_VAL(reader.objects));
+  reader.partners = newList();
+  vm->push(OBJ_VAL(reader.partners));
+  Value value;
+  auto read = reader.readValue(&value);
+  while (read && withGlobals) {
+    auto slot = reader.get<int32_t>();
+    if (reader.failed || slot < 0)
+      break;
+    Value global;
+    read = slot < vm->globalValues.count && reader.readValue(&global);
+    if (read)
+      vm->globalValues.values[slot] = global;
+  }
+  read = read && !reader.failed && reader.current == reader.end;
+  vm->pop();
+  vm->pop();
+  return read && IS_LIST(value) ? AS_LIST(value) : NULL;
+}
+
+ObjList* readMessage(const Message& message)
+{
+  return readValues(message, false);
+}
+
+/**
+ * @brief A call running in an isolate, or waiting for a thread to.
+ */
+class IsolateTask
+{
+public:
+  /**
+   * @brief The call's callee and arguments with the globals they use, then
+   * its result.
+   */
+  Message message;
+
+  std::mutex lock;
+  std::condition_variable finished;
+  bool done;
+
+  /**
+   * @brief Whether the call raised a runtime error or its result couldn't be
+   * copied.
+   */
+  bool failed;
+};
+
+/**
+ * @brief A queue of messages between isolates.
+ */
+class Channel
+{
+public:
+  std::mutex lock;
+  std::condition_variable received;
+  std::deque<Message> messages;
+};
+
+/**
+ * @brief The most threads the pool grows to. Past it, a task waits in the
+ * queue until one of the threads is done with its own.
+ */
+constexpr size_t ISOLATE_THREADS_MAX = 256;
+
+/**
+ * @brief The isolate threads and everything that has a handle.
+ *
+ * Threads outlive the isolate that spawned them, so none of this is ever
+ * freed: `shutdownIsolates` only joins the threads.
+ */
+class Isolates
+{
+public:
+  std::mutex lock;
+  std::condition_variable queued;
+
+  /**
+   * @brief The tasks waiting for a thread.
+   */
+  std::deque<std::shared_ptr<IsolateTask>> queue;
+
+  /**
+   * @brief The threads waiting for a task.
+   */
+  size_t idleThreads;
+
+  /**
+   * @brief The threads of the pool that haven't been joined yet.
+   */
+  std::vector<std::thread> threads;
+
+  /**
+   * @brief Set once the program is done, so threads exit when there are no
+   * more tasks.
+   */
+  bool stopping;
+
+  std::unordered_map<uint64_t, std::shared_ptr<IsolateTask>> tasks;
+  std::unordered_map<uint64_t, std::shared_ptr<Channel>> channels;
+  uint64_t nextHandle;
+};
+
+/**
+ * @brief Returns the registry of isolates, creating it on first use.
+ */
+static Isolates* getIsolates()
+{
+  static auto isolates = []()
+  {
+    auto created = new Isolates();
+    created->idleThreads = 0;
+    created->stopping = false;
+    created->nextHandle = 1;
+    return created;
+  }();
+  return isolates;
+}
+
+/**
+ * @brief Converts a handle from Lox to the key it's stored under.
+ *
+ * @return The key, or 0 if the number isn't a handle at all.
+ */
+static uint64_t handleKey(double handle)
+{
+  // A handle is positive, so it is whole when it isn't above its truncation.
+  if (!(handle >= 1 && handle < 9007199254740992.0) || handle > trunc(handle))
+    return 0;
+  return (uint64_t)handle;
+}
+
+/**
+ * @brief Runs a task in a new VM on the calling thread.
+ */
+static void runIsolate(IsolateTask* task)
+{
+  auto vm = new VM();
+  vm->initVM();
+  auto previous = VM::setVM(vm);
+
+  auto failed = true;
+  auto values = readValues(task->message, true);
+  if (values != NULL) {
+    vm->push(OBJ_VAL(values));
+    auto argCount = values->count - 1;
+    for (int i = 0; i < values->count; i++)
+      vm->push(values->items[i]);
+    Value result;
+    if (vm->runCall(argCount, &result) == INTERPRET_OK)
+      failed = !writeMessage(&task->message, &result, 1);
+  }
+
+  vm->freeVM();
+  VM::setVM(previous);
+  delete vm;
+
+  std::lock_guard<std::mutex> guard(task->lock);
+  task->failed = failed;
+  task->done = true;
+  task->finished.notify_all();
+}
+
+/**
+ * @brief The loop of an isolate thread, which runs tasks as they are queued
+ * until the program stops.
+ */
+static void runIsolateThread()
+{
+  auto isolates = getIsolates();
+  std::unique_lock<std::mutex> guard(isolates->lock);
+  for (;;) {
+    isolates->idleThreads++;
+    isolates->queued.wait(
+        guard,
+        [isolates]() { return !isolates->queue.empty() || isolates->stopping; });
+    isolates->idleThreads--;
+    if (isolates->queue.empty())
+      return;
+    auto task = isolates->queue.front();
+    isolates->queue.pop_front();
+    guard.unlock();
+    runIsolate(task.get());
+    guard.lock();
+  }
+}
+
+double spawnIsolate(Value callee, const Value* args, int argCount)
+{
+  if (!IS_CLOSURE(callee) && !IS_BOUND_METHOD(callee) && !IS_CLASS(callee)
+      && !IS_NATIVE(callee))
+  {
+    return -1;
+  }
+
+  std::vector<Value> values;
+  values.push_back(callee);
+  values.insert(values.end(), args, args + argCount);
+
+  auto task = std::make_shared<IsolateTask>();
+  task->done = false;
+  task->failed = false;
+  if (!writeValues(&task->message, values.data(), (int)values.size(), true))
+    return -1;
+
+  auto isolates = getIsolates();
+  std::lock_guard<std::mutex> guard(isolates->lock);
+  auto handle = isolates->nextHandle++;
+  isolates->tasks[handle] = task;
+  isolates->queue.push_back(task);
+  // Every queued task needs a thread of its own, as the ones running may be
+  // waiting for it.
+  if (isolates->queue.size() > isolates->idleThreads
+      && isolates->threads.size() < ISOLATE_THREADS_MAX)
+  {
+    isolates->threads.emplace_back(runIsolateThread);
+  } else {
+    isolates->queued.notify_one();
+  }
+  return (double)handle;
+}
+
+void shutdownIsolates()
+{
+  auto isolates = getIsolates();
+  std::unique_lock<std::mutex> guard(isolates->lock);
+  isolates->stopping = true;
+  isolates->queued.notify_all();
+  // The tasks still running can spawn more threads, so take them one at a
+  // time until none are left.
+  while (!isolates->threads.empty()) {
+    auto thread = std::move(isolates->threads.back());
+    isolates->threads.pop_back();
+    guard.unlock();
+    thread.join();
+    guard.lock();
+  }
+}
+
+bool joinIsolate(double handle, Value* result)
+{
+  auto isolates = getIsolates();
+  std::shared_ptr<IsolateTask> task;
+  {
+    std::lock_guard<std::mutex> guard(isolates->lock);
+    auto found = isolates->tasks.find(handleKey(handle));
+    if (found == isolates->tasks.end())
+      return false;
+    task = found->second;
+    isolates->tasks.erase(found);
+  }
+
+  std::unique_lock<std::mutex> guard(task->lock);
+  task->finished.wait(guard, [&task]() { return task->done; });
+  if (task->failed)
+    return false;
+  auto values = readMessage(task->message);
+  if (values == NULL)
+    return false;
+  *result = values->items[0];
+  return true;
+}
+
+double newChannel()
+{
+  auto isolates = getIsolates();
+  std::lock_guard<std::mutex> guard(isolates->lock);
+  auto handle = isolates->nextHandle++;
+  isolates->channels[handle] = std::make_shared<Channel>();
+  return (double)handle;
+}
+
+/**
+ * @brief Looks up the channel a handle is for.
+ *
+ * @return The channel, or NULL if the handle is unknown.
+ */
+static std::shared_ptr<Channel> findChannel(double handle)
+{
+  auto isolates = getIsolates();
+  std::lock_guard<std::mutex> guard(isolates->lock);
+  auto found = isolates->channels.find(handleKey(handle));
+  return found == isolates->channels.end() ? NULL : found->second;
+}
+
+bool sendToChannel(double channel, Value value)
+{
+  auto found = findChannel(channel);
+  Message message;
+  if (found == NULL || !writeMessage(&message, &value, 1))
+    return false;
+  std::lock_guard<std::mutex> guard(found->lock);
+  found->messages.push_back(std::move(message));
+  found->received.notify_one();
+  return true;
+}
+
+bool receiveFromChannel(double channel, Value* result)
+{
+  auto found = findChannel(channel);
+  if (found == NULL)
+    return false;
+  Message message;
+  {
+    std::unique_lock<std::mutex> guard(found->lock);
+    found->received.wait(guard,
+                         [&found]() { return !found->messages.empty(); });
+    message = std::move(found->messages.front());
+    found->messages.pop_front();
+  }
+  auto values = readMessage(message);
+  if (values == NULL)
+    return false;
+  *result = values->items[0];
+  return true;
+}
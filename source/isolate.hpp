@@ -0,0 +1,107 @@
+#ifndef clox_isolate_h
+#define clox_isolate_h
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "object.hpp"
+
+/**
+ * @brief Values copied out of one VM, to be rebuilt in another.
+ *
+ * Isolates share no objects, so that each VM keeps collecting its own heap
+ * without locks. A value crosses from one to another as a message: its whole
+ * object graph, with shared objects and cycles kept, in a format that only
+ * depends on the process the message stays in.
+ */
+typedef std::vector<uint8_t> Message;
+
+/**
+ * @brief Copies values of the current VM into a message.
+ *
+ * Functions are copied with their code, which refers to globals by slot, so a
+ * message holding one also holds the names of the VM's global slots.
+ *
+ * @param message The message to fill, replaced if it isn't empty.
+ * @param values The values to copy, which must be reachable.
+ * @param count The number of values.
+ * @return `false` if a value can't be copied.
+ */
+bool writeMessage(Message* message, const Value* values, int count);
+
+/**
+ * @brief Rebuilds the values of a message in the current VM.
+ *
+ * @param message A message `writeMessage` wrote.
+ * @return A new list of the values, which isn't reachable yet, or NULL if the
+ * message holds functions that assume global slots this VM has given to other
+ * names.
+ */
+ObjList* readMessage(const Message& message);
+
+/**
+ * @brief Calls a value in a new isolate on another thread.
+ *
+ * The isolate starts with a copy of the callee and its arguments, and of the
+ * globals that the code they hold can reach, the others left undefined. It
+ * runs on a thread of a pool that grows when every thread is busy, since an
+ * isolate may wait on a channel for one that hasn't started yet, up to a
+ * limit past which it waits for a thread to be free.
+ *
+ * @param callee The function, method or class to call.
+ * @param args The arguments of the call.
+ * @param argCount The number of arguments.
+ * @return The handle `joinIsolate` takes, or -1 if the call can't be copied.
+ */
+double spawnIsolate(Value callee, const Value* args, int argCount);
+
+/**
+ * @brief Waits for every isolate to finish and joins the threads they ran
+ * on, which the program has to before it exits.
+ *
+ * Isolates spawned while waiting are waited for too, so a program that
+ * leaves one blocked on a channel never exits.
+ */
+void shutdownIsolates();
+
+/**
+ * @brief Waits for an isolate to finish and copies its result into the
+ * current VM.
+ *
+ * @param handle A handle from `spawnIsolate`, which can be joined once.
+ * @param result Set to the value the call returned.
+ * @return `false` if the handle is unknown or the call failed.
+ */
+bool joinIsolate(double handle, Value* result);
+
+/**
+ * @brief Creates a channel isolates can send values through.
+ *
+ * A channel is a queue of messages with no bound, which any isolate holding
+ * its handle can send to or receive from.
+ *
+ * @return The handle of the channel.
+ */
+double newChannel();
+
+/**
+ * @brief Copies a value of the current VM onto the end of a channel.
+ *
+ * @param channel A handle from `newChannel`.
+ * @param value The value to send.
+ * @return `false` if the handle is unknown or the value can't be copied.
+ */
+bool sendToChannel(double channel, Value value);
+
+/**
+ * @brief Takes the first value off a channel, waiting for one if it is
+ * empty, and copies it into the current VM.
+ *
+ * @param channel A handle from `newChannel`.
+ * @param result Set to the value received.
+ * @return `false` if the handle is unknown or the value can't be copied.
+ */
+bool receiveFromChannel(double channel, Value* result);
+
+#endif
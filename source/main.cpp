@@ -1,10 +1,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <unistd.h>
+#  define SOURCE_MMAP
+#endif
+
+#include "bytecode.hpp"
 #include "chunk.hpp"
 #include "common.hpp"
+#include "compiler.hpp"
 #include "debug.hpp"
+#include "input.hpp"
+#include "isolate.hpp"
+#include "memory.hpp"
+#include "output.hpp"
+#include "profile.hpp"
 #include "vm.hpp"
 
 /**
@@ -23,13 +40,14 @@ private:
     char line[1024];
     while (true) {
       printf("> ");
+      flushOutput();
 
       if (!fgets(line, sizeof(line), stdin)) {
         printf("\n");
         break;
       }
 
-      vm->interpret(line);
+      vm->interpret(line, strlen(line));
     }
   }
 
@@ -37,10 +55,11 @@ private:
    * @brief Reads the contents of a file into a newly allocated buffer.
    *
    * @param path The path to the file to be read.
+   * @param length Set to the number of characters read.
    * @return A pointer to the newly allocated buffer containing the file
    * contents, or NULL on failure.
    */
-  char* readFile(const char* path)
+  char* readFile(const char* path, size_t* length)
   {
     // Opens file in read binary mode.
     // Checks if file pointer is null, exits with error if so.
@@ -71,24 +90,197 @@ private:
     }
     buffer[bytesRead] = '\0';
     fclose(file);
+    *length = (size_t)bytesRead;
     return buffer;
   }
 
+  /**
+   * @brief Maps a source file into memory read-only, so it compiles straight
+   * out of the page cache without a copy.
+   *
+   * Files that can't be mapped, such as pipes and empty files, are read into
+   * a buffer instead.
+   *
+   * @param path The path to the file to be read.
+   * @param length Set to the number of characters in the file.
+   * @param mapped Set to whether the file was mapped, for `closeSource`.
+   * @return A pointer to the contents of the file, which aren't
+   * null-terminated if the file was mapped.
+   */
+  const char* openSource(const char* path, size_t* length, bool* mapped)
+  {
+    *mapped = false;
+#ifdef SOURCE_MMAP
+    auto fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd >= 0 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode)
+        && info.st_size > 0)
+    {
+      auto data =
+          mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        close(fd);
+        madvise(data, (size_t)info.st_size, MADV_SEQUENTIAL);
+        *length = (size_t)info.st_size;
+        *mapped = true;
+        return (const char*)data;
+      }
+    }
+    if (fd >= 0)
+      close(fd);
+#endif
+    return this->readFile(path, length);
+  }
+
+  /**
+   * @brief Releases a source file opened by `openSource`.
+   *
+   * @param source The contents of the file.
+   * @param length The number of characters in the file.
+   * @param mapped Whether the file was mapped.
+   */
+  void closeSource(const char* source, size_t length, bool mapped)
+  {
+#ifdef SOURCE_MMAP
+    if (mapped) {
+      munmap((void*)source, length);
+      return;
+    }
+#endif
+    delete[] source;
+  }
+
+  /**
+   * @brief Prints how to run the interpreter and exits
+   */
+  void usage()
+  {
+    fprintf(stderr,
+            "Usage: clox [--compile-only | --profile] [--gc-stats] [path]\n");
+    exit(64);
+  }
+
+  /**
+   * @brief Returns the path of the bytecode cache kept next to a script,
+   * `script.lox` caching to `script.loxc`.
+   *
+   * @param path The source file
+   */
+  std::string cachePath(const char* path)
+  {
+    return std::string(path) + "c";
+  }
+
+  /**
+   * @brief Reads the size and modification time of a script, which its
+   * bytecode cache records
+   *
+   * @param path The source file
+   * @param stamp Set to the stamp of the file
+   * @return `false` if the file can't be found
+   */
+  bool stampSource(const char* path, SourceStamp* stamp)
+  {
+    struct stat info;
+    if (stat(path, &info) != 0)
+      return false;
+    stamp->size = (int64_t)info.st_size;
+#if defined(__APPLE__)
+    stamp->modified = (int64_t)info.st_mtimespec.tv_sec * 1000000000
+        + info.st_mtimespec.tv_nsec;
+#elif defined(__unix__)
+    stamp->modified =
+        (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+#else
+    stamp->modified = (int64_t)info.st_mtime * 1000000000;
+#endif
+    return true;
+  }
+
+  /**
+   * @brief Loads the bytecode cache of a script if it was compiled from the
+   * script as it is now
+   *
+   * @param path The source file
+   * @return The compiled script, or NULL if it has to be compiled again.
+   */
+  ObjFunction* loadCache(const char* path)
+  {
+    SourceStamp stamp;
+    if (!this->stampSource(path, &stamp))
+      return NULL;
+    return readBytecode(this->cachePath(path).c_str(), stamp);
+  }
+
   /**
    * @brief Run the file passed as parameter through CppLox VM
    *
+   * Runs the script's bytecode cache instead when there is an up to date one.
+   *
    * @param path The source file
+   * @return The result of running the file
    */
-  void runFile(const char* path)
+  InterpretResult runFile(const char* path)
   {
     auto vm = VM::getVM();
-    auto source = this->readFile(path);
-    InterpretResult result = vm->interpret(source);
-    delete[] source;
-    if (result == INTERPRET_COMPILE_ERROR)
+    InterpretResult result;
+    auto function = this->loadCache(path);
+    if (function != NULL) {
+      result = vm->interpret(function);
+    } else {
+      size_t length;
+      bool mapped;
+      auto source = this->openSource(path, &length, &mapped);
+      result = vm->interpret(source, length);
+      this->closeSource(source, length, mapped);
+    }
+    return result;
+  }
+
+  /**
+   * @brief Prints the profile of a run to stderr and writes its samples to
+   * `script.lox.folded`, for flame graphs
+   *
+   * @param profile The profile the run filled in
+   * @param path The source file
+   */
+  void reportProfile(Profile* profile, const char* path)
+  {
+    flushOutput();
+    profile->report(stderr);
+    auto stacks = std::string(path) + ".folded";
+    if (!profile->writeStacks(stacks.c_str()))
+      fprintf(stderr, "Could not write file \"%s\".\n", stacks.c_str());
+  }
+
+  /**
+   * @brief Compile the file passed as parameter into its bytecode cache
+   * without running it
+   *
+   * @param path The source file
+   */
+  void compileFile(const char* path)
+  {
+    // Stamped before reading, so an edit made while compiling leaves a stamp
+    // that no longer matches rather than a cache of the old source.
+    SourceStamp stamp;
+    if (!this->stampSource(path, &stamp)) {
+      fprintf(stderr, "Could not open file \"%s\".\n", path);
+      exit(74);
+    }
+    size_t length;
+    bool mapped;
+    auto source = this->openSource(path, &length, &mapped);
+    auto function = compile(source, length);
+    this->closeSource(source, length, mapped);
+    if (function == NULL)
       exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR)
-      exit(70);
+
+    auto cached = this->cachePath(path);
+    if (!writeBytecode(cached.c_str(), function, stamp)) {
+      fprintf(stderr, "Could not write file \"%s\".\n", cached.c_str());
+      exit(74);
+    }
   }
 
 public:
@@ -102,23 +294,64 @@ public:
   int execute(int argc, const char* argv[])
   {
     Chunk chunk;
-    auto vm = VM::getVM();
+    auto vm = new VM();
+    VM::setVM(vm);
     vm->initVM();
 
-    switch (argc) {
-      case 1:
-        repl();
-        break;
-      case 2:
-        runFile(argv[1]);
-        break;
-      default:
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
-        break;
+    const char* path = NULL;
+    auto compileOnly = false;
+    auto profiling = false;
+    auto gcStats = false;
+    for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], "--compile-only") == 0) {
+        compileOnly = true;
+      } else if (strcmp(argv[i], "--profile") == 0) {
+        profiling = true;
+      } else if (strcmp(argv[i], "--gc-stats") == 0) {
+        gcStats = true;
+      } else if (path == NULL && argv[i][0] != '-') {
+        path = argv[i];
+      } else {
+        this->usage();
+      }
+    }
+
+    if ((path == NULL && (compileOnly || profiling || gcStats))
+        || (compileOnly && (profiling || gcStats)))
+    {
+      this->usage();
+    } else if (path == NULL) {
+      repl();
+      shutdownIsolates();
+    } else if (compileOnly) {
+      compileFile(path);
+    } else {
+      Profile* profile = NULL;
+      if (profiling) {
+        profile = new Profile();
+        vm->profile = profile;
+      }
+      auto result = runFile(path);
+      shutdownIsolates();
+      if (profile != NULL) {
+        this->reportProfile(profile, path);
+        vm->profile = NULL;
+        delete profile;
+      }
+      if (gcStats) {
+        flushOutput();
+        reportGCStats(stderr);
+      }
+      if (result == INTERPRET_COMPILE_ERROR)
+        exit(65);
+      if (result == INTERPRET_RUNTIME_ERROR)
+        exit(70);
     }
 
     vm->freeVM();
+    VM::setVM(NULL);
+    delete vm;
+    freeInput();
     return 0;
   }
 };
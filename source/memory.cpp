@@ -1,17 +1,138 @@
 #include "memory.hpp"
 
+#include <chrono>
+#include <utility>
+
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "compiler.hpp"
 #include "vm.hpp"
 
 #ifdef DEBUG_LOG_GC
-#  include <stdio.h>
-
 #  include "debug.hpp"
 #endif
 
-constexpr int GC_HEAP_GROW_FACTOR = 2;
+#ifdef ENABLE_MP
+#  include <omp.h>
+#endif
+
+/**
+ * @brief Bytes allocated since the last collection that trigger a minor one.
+ */
+constexpr size_t NURSERY_SIZE = 256 * 1024;
+
+/**
+ * @brief Bytes allocated between two steps of an incremental collection.
+ */
+constexpr size_t GC_STEP_SIZE = 32 * 1024;
+
+/**
+ * @brief Objects an incremental step blackens or sweeps between two looks at
+ * the clock.
+ */
+constexpr int GC_STEP_WORK = 64;
+
+using GCClock = std::chrono::steady_clock;
+
+static void startGarbageCollection();
+static void stepGarbageCollection();
+static void markNursery();
+
+#ifdef ENABLE_MP
+/**
+ * @brief Set on the background sweeper's thread, whose frees are accounted for
+ * when it is joined.
+ */
+static thread_local bool onSweeperThread = false;
+
+static void joinSweeper();
+#endif
+
+/**
+ * @brief Whether old objects are still being swept, one way or another.
+ *
+ * @return `true` until the last full collection is completely done.
+ */
+static bool isSweeping()
+{
+  auto vm = VM::getVM();
+#ifdef ENABLE_MP
+  if (vm->sweeper.active)
+    return true;
+#endif
+  return vm->sweeping.count > 0;
+}
+
+/**
+ * @brief Records a change in allocated memory and collects garbage if needed.
+ *
+ * A full collection starts once the heap outgrows `nextGC`, otherwise a minor
+ * one runs once the nursery has seen `NURSERY_SIZE` bytes of new allocations.
+ * While an incremental collection is in progress, every `GC_STEP_SIZE` bytes
+ * run one step of it instead.
+ *
+ * @param oldSize The previous size of the block in bytes.
+ * @param newSize The new size of the block in bytes.
+ */
+static void trackAllocation(size_t oldSize, size_t newSize)
+{
+  auto vm = VM::getVM();
+#ifdef ENABLE_MP
+  if (onSweeperThread) {
+    vm->sweeper.freedBytes += oldSize - newSize;
+    return;
+  }
+#endif
+  vm->bytesAllocated += newSize - oldSize;
+  if (newSize > oldSize) {
+    vm->gcStats.allocatedBytes += newSize - oldSize;
+    if (vm->bytesAllocated > vm->gcStats.peakHeap)
+      vm->gcStats.peakHeap = vm->bytesAllocated;
+    vm->nurseryBytes += newSize - oldSize;
+    vm->gcStepBytes += newSize - oldSize;
+#ifdef ENABLE_MP
+    if (vm->sweeper.active && vm->sweeper.done.load(std::memory_order_acquire))
+      joinSweeper();
+#endif
+#ifdef DEBUG_STRESS_GC
+    // Alternate so both kinds of collection run on every allocation path.
+    static thread_local bool major = false;
+    major = !major;
+    if (vm->gcMarking || vm->sweeping.count > 0)
+      stepGarbageCollection();
+    else if (major)
+      startGarbageCollection();
+    else
+      collectNursery();
+#endif
+    if (vm->gcMarking || vm->sweeping.count > 0) {
+      if (vm->gcStepBytes > GC_STEP_SIZE)
+        stepGarbageCollection();
+    } else if (vm->bytesAllocated > vm->nextGC && !isSweeping()) {
+      startGarbageCollection();
+    } else if (vm->nurseryBytes > NURSERY_SIZE) {
+      collectNursery();
+    }
+  }
+}
+
+/**
+ * @brief Adds a pause of the mutator to the collector's statistics.
+ *
+ * @param start When the pause began.
+ */
+static void recordPause(GCClock::time_point start)
+{
+  auto stats = &VM::getVM()->gcStats;
+  auto pause =
+      std::chrono::duration<double, std::micro>(GCClock::now() - start)
+          .count();
+  stats->totalPause += pause;
+  if (pause > stats->maxPause)
+    stats->maxPause = pause;
+}
 
 /**
  * @brief Reallocates a block of memory.
@@ -32,16 +153,7 @@ constexpr int GC_HEAP_GROW_FACTOR = 2;
  */
 void* reallocate(void* pointer, size_t oldSize, size_t newSize)
 {
-  auto vm = VM::getVM();
-  vm->bytesAllocated += newSize - oldSize;
-  if (newSize > oldSize) {
-#ifdef DEBUG_STRESS_GC
-    collectGarbage();
-#endif
-    if (vm->bytesAllocated > vm->nextGC) {
-      collectGarbage();
-    }
-  }
+  trackAllocation(oldSize, newSize);
   if (newSize == 0) {
     free(pointer);
     return NULL;
@@ -53,6 +165,219 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize)
   return result;
 }
 
+/**
+ * @brief Initialises an empty pool.
+ */
+void ObjectPool::initPool()
+{
+  for (int i = 0; i < POOL_SIZE_CLASSES; i++) {
+    this->freeLists[i] = NULL;
+  }
+  this->slabs = NULL;
+}
+
+/**
+ * @brief Returns every slab to the system.
+ */
+void ObjectPool::freePool()
+{
+  while (this->slabs != NULL) {
+    auto next = *(void**)this->slabs;
+    free(this->slabs);
+    this->slabs = next;
+  }
+  this->initPool();
+}
+
+/**
+ * @brief Takes a block from the pool.
+ *
+ * Pops the free list of the block's size class, carving a fresh slab into
+ * blocks of that class first if the list is empty.
+ *
+ * @param size The size of the block, at most `POOL_SIZE_CLASSES` granules.
+ * @return A pointer to the block.
+ */
+void* ObjectPool::allocate(size_t size)
+{
+  auto sizeClass = (size + POOL_GRANULE - 1) / POOL_GRANULE - 1;
+  if (this->freeLists[sizeClass] == NULL) {
+    auto slab = (char*)malloc(POOL_SLAB_SIZE);
+    if (slab == NULL)
+      exit(1);
+    *(void**)slab = this->slabs;
+    this->slabs = slab;
+
+    // The slab link takes the first granules, padded to keep blocks aligned.
+    auto blockSize = (sizeClass + 1) * POOL_GRANULE;
+    auto block = slab + alignof(max_align_t);
+    while (block + blockSize <= slab + POOL_SLAB_SIZE) {
+      *(void**)block = this->freeLists[sizeClass];
+      this->freeLists[sizeClass] = block;
+      block += blockSize;
+    }
+  }
+
+  auto block = this->freeLists[sizeClass];
+  this->freeLists[sizeClass] = *(void**)block;
+  return block;
+}
+
+/**
+ * @brief Puts a block back on the free list of its size class.
+ *
+ * @param pointer The block to release.
+ * @param size The size the block was allocated with.
+ */
+void ObjectPool::release(void* pointer, size_t size)
+{
+  auto sizeClass = (size + POOL_GRANULE - 1) / POOL_GRANULE - 1;
+  *(void**)pointer = this->freeLists[sizeClass];
+  this->freeLists[sizeClass] = pointer;
+}
+
+/**
+ * @brief Initialises an empty array.
+ */
+void ObjectArray::initObjectArray()
+{
+  this->count = 0;
+  this->capacity = 0;
+  this->objects = NULL;
+}
+
+/**
+ * @brief Appends an object, growing the array with `realloc` when it is full.
+ *
+ * @param object The object to append.
+ */
+void ObjectArray::writeObjectArray(Obj* object)
+{
+  if (this->capacity < this->count + 1) {
+    this->capacity = GROW_CAPACITY(this->capacity);
+    this->objects =
+        (Obj**)realloc(this->objects, sizeof(Obj*) * this->capacity);
+    if (this->objects == NULL)
+      exit(1);
+  }
+  this->objects[this->count++] = object;
+}
+
+/**
+ * @brief Frees the array, but not the objects in it.
+ */
+void ObjectArray::freeObjectArray()
+{
+  free(this->objects);
+  this->initObjectArray();
+}
+
+/**
+ * @brief Allocates the memory of a heap object.
+ *
+ * Objects small enough for a size class come from the VM's pool when the pool
+ * allocator is enabled, everything else from `reallocate`. The size is
+ * accounted for exactly like `reallocate`, so garbage collection is paced the
+ * same either way.
+ *
+ * @param size The size of the object in bytes.
+ * @return A pointer to the allocated memory.
+ */
+void* allocateObjectMemory(size_t size)
+{
+#ifdef ENABLE_POOL_ALLOCATOR
+  if (size <= POOL_GRANULE * POOL_SIZE_CLASSES) {
+    trackAllocation(0, size);
+    return VM::getVM()->pool.allocate(size);
+  }
+#endif
+  return reallocate(NULL, 0, size);
+}
+
+/**
+ * @brief Frees the memory of a heap object.
+ *
+ * @param pointer The object to free.
+ * @param size The size the object was allocated with.
+ */
+void freeObjectMemory(void* pointer, size_t size)
+{
+#ifdef ENABLE_POOL_ALLOCATOR
+  if (size <= POOL_GRANULE * POOL_SIZE_CLASSES) {
+    trackAllocation(size, 0);
+#  ifdef ENABLE_MP
+    // The pool belongs to the program's thread, the sweeper keeps its own
+    // list until it is joined.
+    if (onSweeperThread) {
+      auto sweeper = &VM::getVM()->sweeper;
+      auto sizeClass = (size + POOL_GRANULE - 1) / POOL_GRANULE - 1;
+      if (sweeper->blocks[sizeClass] == NULL)
+        sweeper->blockTails[sizeClass] = pointer;
+      *(void**)pointer = sweeper->blocks[sizeClass];
+      sweeper->blocks[sizeClass] = pointer;
+      return;
+    }
+#  endif
+    VM::getVM()->pool.release(pointer, size);
+    return;
+  }
+#endif
+  reallocate(pointer, size, 0);
+}
+
+/**
+ * @brief Pushes an object onto a gray stack, growing it if needed.
+ *
+ * Gray stacks are allocated outside of `reallocate` so growing them can't
+ * start a collection.
+ *
+ * @param stack The objects of the stack.
+ * @param count The number of objects on the stack.
+ * @param capacity The capacity of the stack.
+ * @param object The object to push.
+ */
+static void pushGray(Obj*** stack, int* count, int* capacity, Obj* object)
+{
+  if (*capacity < *count + 1) {
+    *capacity = GROW_CAPACITY(*capacity);
+    *stack = (Obj**)realloc(*stack, sizeof(Obj*) * *capacity);
+    if (*stack == NULL)
+      exit(1);
+  }
+
+  (*stack)[(*count)++] = object;
+}
+
+#ifdef ENABLE_MP
+/**
+ * @brief The gray objects of one thread of a parallel trace.
+ *
+ * The thread pushes and pops its local objects without synchronisation. When
+ * it has plenty, it moves some to its shared objects, where idle threads can
+ * steal them from.
+ */
+class MarkWorker
+{
+public:
+  Obj** local;
+  int localCount;
+  int localCapacity;
+
+  /**
+   * @brief Guards the shared objects.
+   */
+  omp_lock_t lock;
+  Obj** shared;
+  std::atomic<int> sharedCount;
+  int sharedCapacity;
+};
+
+/**
+ * @brief The worker of the current thread during a parallel trace, or NULL.
+ */
+static thread_local MarkWorker* markWorker = NULL;
+#endif
+
 /**
  * @brief Marks an object as reachable for garbage collection.
  *
@@ -69,24 +394,110 @@ void markObject(Obj* object)
 {
   if (object == NULL)
     return;
-  if (object->isMarked)
+  if (object->isMarked.load(std::memory_order_relaxed))
+    return;
+  auto vm = VM::getVM();
+  if (vm->collectingNursery && object->isOld)
     return;
 #ifdef DEBUG_LOG_GC
   printf("%p mark ", (void*)object);
   printValue(OBJ_VAL(object));
   printf("\n");
 #endif
-  object->isMarked = true;
+#ifdef ENABLE_MP
+  if (markWorker != NULL) {
+    // Another thread may have reached the object since the check above.
+    if (object->isMarked.exchange(true, std::memory_order_relaxed))
+      return;
+    pushGray(&markWorker->local,
+             &markWorker->localCount,
+             &markWorker->localCapacity,
+             object);
+    return;
+  }
+#endif
+  object->isMarked.store(true, std::memory_order_relaxed);
+  pushGray(&vm->grayStack, &vm->grayCount, &vm->grayCapacity, object);
+  if (vm->grayCount > vm->gcStats.grayPeak)
+    vm->gcStats.grayPeak = vm->grayCount;
+}
+
+/**
+ * @brief Marks an object, scanning it again if it was already marked.
+ *
+ * Clearing the mark while an incremental collection is marking makes
+ * `markObject` put the object back on the gray stack. Other collections scan
+ * every root only once, so a plain mark is enough for them.
+ *
+ * @param object The object to be marked.
+ */
+void rescanObject(Obj* object)
+{
+  if (VM::getVM()->gcMarking)
+    object->isMarked.store(false, std::memory_order_relaxed);
+  markObject(object);
+}
+
+/**
+ * @brief Marks an object stored into an already marked one while an
+ * incremental collection is marking.
+ *
+ * Objects stay marked until they are swept, so stores between marking and
+ * sweeping land here too and are ignored.
+ *
+ * @param object The object being stored.
+ */
+void shadeObject(Obj* object)
+{
+  if (VM::getVM()->gcMarking)
+    markObject(object);
+}
+
+/**
+ * @brief Adds an old object to the remembered set.
+ *
+ * Young objects and objects already in the set are ignored. Like the gray
+ * stack, the set is allocated outside of `reallocate` so adding to it can't
+ * start a collection.
+ *
+ * @param object The object that may refer to young objects.
+ */
+void rememberObject(Obj* object)
+{
+  if (!object->isOld || object->isRemembered)
+    return;
+  object->isRemembered = true;
+  if (object->type == OBJ_LIST) {
+    auto list = (ObjList*)object;
+    list->dirtyStart = 0;
+    list->dirtyEnd = list->count;
+  }
   auto vm = VM::getVM();
-  if (vm->grayCapacity < vm->grayCount + 1) {
-    vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
-    vm->grayStack =
-        (Obj**)realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
-    if (vm->grayStack == NULL)
+  if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+    vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+    vm->remembered = (Obj**)realloc(vm->remembered,
+                                    sizeof(Obj*) * vm->rememberedCapacity);
+    if (vm->remembered == NULL)
       exit(1);
   }
 
-  vm->grayStack[vm->grayCount++] = object;
+  vm->remembered[vm->rememberedCount++] = object;
+}
+
+/**
+ * @brief Checks whether the collection in progress found an object
+ * unreachable.
+ *
+ * Minor collections never mark old objects, so those count as reachable.
+ *
+ * @param object The object to check.
+ * @return `true` if the object is about to be freed, `false` otherwise.
+ */
+bool isUnreachable(Obj* object)
+{
+  if (object->isMarked.load(std::memory_order_relaxed))
+    return false;
+  return !(VM::getVM()->collectingNursery && object->isOld);
 }
 
 /**
@@ -147,20 +558,32 @@ static void blackenObject(Obj* object)
     case OBJ_CLASS: {
       auto klass = (ObjClass*)object;
       markObject((Obj*)klass->name);
+      markObject((Obj*)klass->shape);
       klass->methods.markTable();
       break;
     }
     case OBJ_INSTANCE: {
       auto instance = (ObjInstance*)object;
       markObject((Obj*)instance->klass);
-      instance->fields.markTable();
+      markObject((Obj*)instance->shape);
+      for (int i = 0; i < instance->shape->fieldCount; i++) {
+        markValue(instance->fields[i]);
+      }
+      break;
+    }
+    case OBJ_SHAPE: {
+      auto shape = (ObjShape*)object;
+      markObject((Obj*)shape->parent);
+      markObject((Obj*)shape->name);
+      shape->slots.markTable();
+      shape->transitions.markTable();
       break;
     }
     case OBJ_CLOSURE: {
       auto closure = (ObjClosure*)object;
       markObject((Obj*)closure->function);
       for (int i = 0; i < closure->upvalueCount; i++) {
-        markObject((Obj*)closure->upvalues[i]);
+        markValue(closure->upvalues[i]);
       }
       break;
     }
@@ -180,12 +603,98 @@ static void blackenObject(Obj* object)
       }
       break;
     }
+    case OBJ_ROPE: {
+      auto rope = (ObjRope*)object;
+      markObject(rope->left);
+      markObject(rope->right);
+      markObject((Obj*)rope->flat);
+      break;
+    }
     case OBJ_NATIVE:
     case OBJ_STRING:
+    case OBJ_NUM_ARRAY:
       break;
   }
 }
 
+/**
+ * @brief Marks the young objects a remembered object refers to.
+ *
+ * Lists only have their dirty items scanned, everything else is blackened as
+ * a whole.
+ *
+ * @param object The remembered object.
+ */
+static void blackenRemembered(Obj* object)
+{
+  if (object->type != OBJ_LIST) {
+    blackenObject(object);
+    return;
+  }
+
+  auto list = (ObjList*)object;
+  auto end = list->dirtyEnd < list->count ? list->dirtyEnd : list->count;
+  for (int i = list->dirtyStart; i < end; i++) {
+    markValue(list->items[i]);
+  }
+}
+
+/**
+ * @brief Returns the size an object was allocated with, not counting the
+ * arrays it owns.
+ */
+static size_t objectSize(Obj* object)
+{
+  switch (object->type) {
+    case OBJ_BOUND_METHOD:
+      return sizeof(ObjBoundMethod);
+    case OBJ_CLASS:
+      return sizeof(ObjClass);
+    case OBJ_CLOSURE:
+      return sizeof(ObjClosure)
+          + sizeof(Value) * ((ObjClosure*)object)->upvalueCount;
+    case OBJ_INSTANCE:
+      return sizeof(ObjInstance);
+    case OBJ_FUNCTION:
+      return sizeof(ObjFunction);
+    case OBJ_NATIVE:
+      return sizeof(ObjNative);
+    case OBJ_STRING: {
+      auto string = (ObjString*)object;
+      if (string->length <= SMALL_STRING_LENGTH)
+        return sizeof(ObjString) + string->length + 1;
+      return sizeof(ObjString);
+    }
+    case OBJ_UPVALUE:
+      return sizeof(ObjUpvalue);
+    case OBJ_LIST:
+      return sizeof(ObjList);
+    case OBJ_SHAPE:
+      return sizeof(ObjShape);
+    case OBJ_ROPE:
+      return sizeof(ObjRope);
+    case OBJ_NUM_ARRAY:
+      return sizeof(ObjNumArray);
+  }
+  return 0;
+}
+
+/**
+ * @brief Adds an object about to be freed to the statistics of its type.
+ *
+ * The background sweeper keeps its own counts, added in when it is joined.
+ */
+static void countFreed(Obj* object)
+{
+  auto vm = VM::getVM();
+  auto freed = vm->gcStats.freedByType;
+#ifdef ENABLE_MP
+  if (onSweeperThread)
+    freed = vm->sweeper.freedByType;
+#endif
+  freed[object->type] += objectSize(object);
+}
+
 /**
  * @brief Frees the memory allocated for an object.
  *
@@ -200,6 +709,7 @@ static void freeObject(Obj* object)
 #ifdef DEBUG_LOG_GC
   printf("%p free type %d\n", (void*)object, object->type);
 #endif
+  countFreed(object);
   switch (object->type) {
     case OBJ_BOUND_METHOD:
       FREE<ObjBoundMethod>(object);
@@ -212,14 +722,21 @@ static void freeObject(Obj* object)
     }
     case OBJ_INSTANCE: {
       auto instance = (ObjInstance*)object;
-      instance->fields.freeTable();
+      FREE_ARRAY<Value>(instance->fields, instance->fieldCapacity);
       FREE<ObjInstance>(object);
       break;
     }
+    case OBJ_SHAPE: {
+      auto shape = (ObjShape*)object;
+      shape->slots.freeTable();
+      shape->transitions.freeTable();
+      FREE<ObjShape>(object);
+      break;
+    }
     case OBJ_CLOSURE: {
       auto closure = (ObjClosure*)object;
-      FREE_ARRAY<ObjUpvalue*>(closure->upvalues, closure->upvalueCount);
-      FREE<ObjClosure>(object);
+      freeObjectMemory(
+          object, sizeof(ObjClosure) + sizeof(Value) * closure->upvalueCount);
       break;
     }
     case OBJ_FUNCTION: {
@@ -231,8 +748,22 @@ static void freeObject(Obj* object)
     case OBJ_NATIVE:
       FREE<ObjNative>(object);
       break;
+    case OBJ_ROPE:
+      FREE<ObjRope>(object);
+      break;
+    case OBJ_NUM_ARRAY: {
+      auto array = (ObjNumArray*)object;
+      FREE_ARRAY<double>(array->items, array->capacity);
+      FREE<ObjNumArray>(object);
+      break;
+    }
     case OBJ_STRING: {
       auto string = (ObjString*)object;
+      if (string->length <= SMALL_STRING_LENGTH) {
+        // The characters are part of the object.
+        freeObjectMemory(object, sizeof(ObjString) + string->length + 1);
+        break;
+      }
       FREE_ARRAY<char>(string->chars, string->length + 1);
       FREE<ObjString>(object);
       break;
@@ -252,20 +783,27 @@ static void freeObject(Obj* object)
 /**
  * @brief Frees all allocated objects in the virtual machine.
  *
- * This function iterates through the linked list of objects, freeing each
- * object's memory using the `freeObject` function. Finally, it deallocates the
- * gray stack used for garbage collection.
+ * This function goes through the arrays of old, young and unswept objects,
+ * freeing each object's memory using the `freeObject` function. Finally, it
+ * deallocates the arrays and the gray stack used for garbage collection.
  */
 void freeObjects()
 {
   auto vm = VM::getVM();
-  auto object = vm->objects;
-  while (object != NULL) {
-    auto next = object->next;
-    freeObject(object);
-    object = next;
+#ifdef ENABLE_MP
+  joinSweeper();
+#endif
+  for (auto array : {&vm->objects, &vm->nursery, &vm->sweeping}) {
+    for (int i = 0; i < array->count; i++) {
+      freeObject(array->objects[i]);
+    }
+    array->freeObjectArray();
   }
+#ifdef ENABLE_MP
+  vm->sweeper.objects.freeObjectArray();
+#endif
   free(vm->grayStack);
+  free(vm->remembered);
 }
 
 /**
@@ -290,8 +828,15 @@ static void markRoots()
     markObject((Obj*)upvalue);
   }
   vm->globals.markTable();
+  for (int i = 0; i < vm->globalValues.count; i++) {
+    markValue(vm->globalValues.values[i]);
+    markValue(vm->globalNames.values[i]);
+  }
   markCompilerRoots();
   markObject((Obj*)vm->initString);
+  for (int i = 0; i < UINT8_COUNT; i++) {
+    markObject((Obj*)vm->charStrings[i]);
+  }
 }
 
 /**
@@ -312,38 +857,386 @@ static void traceReferences()
 }
 
 /**
- * @brief Sweeps the object list and frees unreachable objects.
+ * @brief Traces object references until the gray stack is empty or time is
+ * up.
  *
- * This function iterates through the list of objects, removing and freeing
- * those that are not marked as reachable. Reachable objects have their
- * `isMarked` flag reset for the next garbage collection cycle.
+ * Lists longer than `GC_STEP_WORK` items are scanned `GC_STEP_WORK` items at a
+ * time, so that a single big list can't make a step overrun its deadline.
  *
- * The object list is maintained as a linked list, and this function updates the
- * head of the list if necessary.
+ * @param deadline When to stop tracing.
+ * @return `true` if the gray stack was emptied, `false` otherwise.
  */
-static void sweep()
+static bool traceReferences(GCClock::time_point deadline)
 {
   auto vm = VM::getVM();
-  Obj* previous = NULL;
-  auto object = vm->objects;
-  while (object != NULL) {
-    if (object->isMarked) {
-      object->isMarked = false;
-      previous = object;
-      object = object->next;
+  for (int work = 1;; work++) {
+    if (work % GC_STEP_WORK == 0 && GCClock::now() >= deadline)
+      return false;
+
+    auto list = vm->grayList;
+    if (list != NULL) {
+      auto end = vm->grayListIndex + GC_STEP_WORK;
+      if (end >= list->count) {
+        end = list->count;
+        vm->grayList = NULL;
+      }
+      for (int i = vm->grayListIndex; i < end; i++) {
+        markValue(list->items[i]);
+      }
+      vm->grayListIndex = end;
+      continue;
+    }
+
+    if (vm->grayCount == 0)
+      return true;
+    auto object = vm->grayStack[--vm->grayCount];
+    if (object->type == OBJ_LIST && ((ObjList*)object)->count > GC_STEP_WORK) {
+      vm->grayList = (ObjList*)object;
+      vm->grayListIndex = 0;
     } else {
-      auto unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
-      } else {
-        vm->objects = object;
+      blackenObject(object);
+    }
+  }
+}
+
+#ifdef ENABLE_MP
+/**
+ * @brief Makes half of a worker's local objects available to other threads.
+ *
+ * @param worker The worker of the current thread.
+ */
+static void shareWork(MarkWorker* worker)
+{
+  omp_set_lock(&worker->lock);
+  auto count = worker->sharedCount.load(std::memory_order_relaxed);
+  for (int i = worker->localCount / 2; i < worker->localCount; i++) {
+    pushGray(
+        &worker->shared, &count, &worker->sharedCapacity, worker->local[i]);
+  }
+  worker->localCount /= 2;
+  worker->sharedCount.store(count);
+  omp_unset_lock(&worker->lock);
+}
+
+/**
+ * @brief Moves shared objects into a worker's local ones.
+ *
+ * @param worker The worker of the current thread.
+ * @param victim The worker to take the objects from.
+ * @param all Whether to take all the objects or only half of them.
+ * @return `true` if any object was taken, `false` otherwise.
+ */
+static bool takeWork(MarkWorker* worker, MarkWorker* victim, bool all)
+{
+  if (victim->sharedCount.load() == 0)
+    return false;
+  omp_set_lock(&victim->lock);
+  auto count = victim->sharedCount.load(std::memory_order_relaxed);
+  auto keep = all ? 0 : count / 2;
+  for (int i = keep; i < count; i++) {
+    pushGray(&worker->local,
+             &worker->localCount,
+             &worker->localCapacity,
+             victim->shared[i]);
+  }
+  victim->sharedCount.store(keep);
+  omp_unset_lock(&victim->lock);
+  return count > keep;
+}
+
+/**
+ * @brief Traces object references on every thread until the gray stack is
+ * empty.
+ *
+ * The gray objects are dealt out to one worker per thread. A worker that runs
+ * out of objects steals from the others, and all of them stop once every
+ * worker is idle with nothing left to steal.
+ */
+static void traceReferencesInParallel()
+{
+  auto vm = VM::getVM();
+  // Marks are already set, so scanning the list from the start again only
+  // costs time.
+  if (vm->grayList != NULL) {
+    pushGray(&vm->grayStack,
+             &vm->grayCount,
+             &vm->grayCapacity,
+             (Obj*)vm->grayList);
+    vm->grayList = NULL;
+  }
+
+  auto threads = omp_get_max_threads();
+  if (threads < 2) {
+    traceReferences();
+    return;
+  }
+  auto workers = (MarkWorker*)calloc(threads, sizeof(MarkWorker));
+  if (workers == NULL)
+    exit(1);
+  for (int i = 0; i < threads; i++) {
+    omp_init_lock(&workers[i].lock);
+  }
+  std::atomic<int> idle(0);
+
+#  pragma omp parallel num_threads(threads)
+  {
+    auto team = omp_get_num_threads();
+    auto id = omp_get_thread_num();
+    auto worker = &workers[id];
+    // Pool threads may have run another VM's collection last.
+    VM::setVM(vm);
+    markWorker = worker;
+    for (int i = id; i < vm->grayCount; i += team) {
+      pushGray(&worker->local,
+               &worker->localCount,
+               &worker->localCapacity,
+               vm->grayStack[i]);
+    }
+
+    for (;;) {
+      while (worker->localCount > 0) {
+        blackenObject(worker->local[--worker->localCount]);
+        if (worker->localCount > 2 * GC_STEP_WORK
+            && worker->sharedCount.load(std::memory_order_relaxed) == 0)
+          shareWork(worker);
+      }
+      if (takeWork(worker, worker, true))
+        continue;
+      auto stolen = false;
+      for (int i = 1; i < team && !stolen; i++) {
+        stolen = takeWork(worker, &workers[(id + i) % team], false);
+      }
+      if (stolen)
+        continue;
+
+      // Only an idle worker that sees shared objects can stop being idle, so
+      // once all of them are idle there is nothing left anywhere.
+      idle++;
+      auto found = false;
+      while (!found && idle.load() < team) {
+        for (int i = 0; i < team && !found; i++) {
+          found = workers[i].sharedCount.load() > 0;
+        }
+        if (!found)
+          std::this_thread::yield();
       }
+      if (!found)
+        break;
+      idle--;
+    }
+    markWorker = NULL;
+  }
+
+  vm->grayCount = 0;
+  for (int i = 0; i < threads; i++) {
+    omp_destroy_lock(&workers[i].lock);
+    free(workers[i].local);
+    free(workers[i].shared);
+  }
+  free(workers);
+}
+#endif
+
+/**
+ * @brief Sweeps the old objects left by the collection in progress.
+ *
+ * Unreachable objects are freed. Reachable ones have their `isMarked` flag
+ * reset for the next collection and go back to the old generation.
+ *
+ * @param deadline When to stop sweeping.
+ * @return `true` if every object was swept, `false` otherwise.
+ */
+static bool sweep(GCClock::time_point deadline)
+{
+  auto vm = VM::getVM();
+  for (int work = 1; vm->sweeping.count > 0; work++) {
+    if (work % GC_STEP_WORK == 0 && GCClock::now() >= deadline)
+      return false;
+    auto object = vm->sweeping.objects[--vm->sweeping.count];
+    if (object->isMarked.load(std::memory_order_relaxed)) {
+      object->isMarked.store(false, std::memory_order_relaxed);
+      vm->objects.writeObjectArray(object);
+    } else {
+      freeObject(object);
+    }
+  }
+  return true;
+}
+
+#ifdef ENABLE_MP
+/**
+ * @brief The body of the background sweeper's thread.
+ *
+ * Frees the unreachable objects of the sweeper's array, and packs the others
+ * at its start for the VM to take back with their marks cleared.
+ *
+ * @param vm The VM whose objects are swept, which the thread makes current.
+ */
+static void sweepInBackground(VM* vm)
+{
+  VM::setVM(vm);
+  onSweeperThread = true;
+  auto sweeper = &vm->sweeper;
+  auto objects = &sweeper->objects;
+  auto survivors = 0;
+  for (int i = 0; i < objects->count; i++) {
+    auto object = objects->objects[i];
+    if (object->isMarked.load(std::memory_order_relaxed)) {
+      object->isMarked.store(false, std::memory_order_relaxed);
+      objects->objects[survivors++] = object;
+    } else {
+      freeObject(object);
+    }
+  }
+  objects->count = survivors;
+  sweeper->done.store(true, std::memory_order_release);
+}
+
+/**
+ * @brief Hands the old objects left by a full collection to a background
+ * thread.
+ */
+static void startSweeper()
+{
+  auto vm = VM::getVM();
+  auto sweeper = &vm->sweeper;
+  std::swap(sweeper->objects, vm->sweeping);
+  sweeper->freedBytes = 0;
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    sweeper->freedByType[i] = 0;
+  }
+  for (int i = 0; i < POOL_SIZE_CLASSES; i++) {
+    sweeper->blocks[i] = NULL;
+  }
+  sweeper->done.store(false, std::memory_order_relaxed);
+  sweeper->active = true;
+  sweeper->thread = std::thread(sweepInBackground, vm);
+}
+#endif
+
+/**
+ * @brief Sweeps the nursery, freeing unreachable objects and promoting the
+ * rest.
+ *
+ * Survivors are moved to the old generation, so the nursery is empty
+ * afterwards.
+ */
+static void sweepNursery()
+{
+  auto vm = VM::getVM();
+  for (int i = 0; i < vm->nursery.count; i++) {
+    auto object = vm->nursery.objects[i];
+    if (object->isMarked.load(std::memory_order_relaxed)) {
+      object->isMarked.store(false, std::memory_order_relaxed);
+      object->isOld = true;
+      vm->objects.writeObjectArray(object);
+    } else {
+      freeObject(object);
+    }
+  }
+  vm->nursery.count = 0;
+  vm->nurseryBytes = 0;
+}
+
+/**
+ * @brief Empties the remembered set.
+ *
+ * Called after every collection, since no young objects are left for old
+ * objects to refer to.
+ */
+static void forgetRemembered()
+{
+  auto vm = VM::getVM();
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    vm->remembered[i]->isRemembered = false;
+  }
+  vm->rememberedCount = 0;
+}
+
+/**
+ * @brief Starts marking the whole heap.
+ */
+static void beginMarking()
+{
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+#endif
+  VM::getVM()->gcMarking = true;
+  markRoots();
+}
+
+/**
+ * @brief Finishes marking the whole heap and starts sweeping it.
+ *
+ * Roots are written to without barriers, so they are marked again and
+ * everything newly reachable from them is traced without interruption. The
+ * nursery is swept right away, the old generation by `sweep`.
+ */
+static void finishMarking()
+{
+  auto vm = VM::getVM();
+  markRoots();
+#ifdef ENABLE_MP
+  traceReferencesInParallel();
+#else
+  traceReferences(GCClock::time_point::max());
+#endif
+  vm->gcMarking = false;
+  vm->strings.tableRemoveWhite();
+  // Remembered objects may be about to be freed.
+  forgetRemembered();
+  std::swap(vm->sweeping, vm->objects);
+  sweepNursery();
+#ifdef ENABLE_MP
+  startSweeper();
+#endif
+}
+
+/**
+ * @brief Wraps up a full collection once everything was swept.
+ */
+static void finishSweeping()
+{
+  auto vm = VM::getVM();
+  vm->nextGC = (size_t)((double)vm->bytesAllocated * vm->gcGrowFactor);
+  vm->gcStats.collections++;
 
-      freeObject(unreached);
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end\n");
+  printf("   heap is %zu bytes, next at %zu\n", vm->bytesAllocated, vm->nextGC);
+#endif
+}
+
+#ifdef ENABLE_MP
+/**
+ * @brief Waits for the background sweeper, then takes back what it swept.
+ */
+static void joinSweeper()
+{
+  auto vm = VM::getVM();
+  auto sweeper = &vm->sweeper;
+  if (!sweeper->active)
+    return;
+  sweeper->thread.join();
+  sweeper->active = false;
+
+  for (int i = 0; i < sweeper->objects.count; i++) {
+    vm->objects.writeObjectArray(sweeper->objects.objects[i]);
+  }
+  sweeper->objects.count = 0;
+  vm->bytesAllocated -= sweeper->freedBytes;
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    vm->gcStats.freedByType[i] += sweeper->freedByType[i];
+  }
+  for (int i = 0; i < POOL_SIZE_CLASSES; i++) {
+    if (sweeper->blocks[i] != NULL) {
+      *(void**)sweeper->blockTails[i] = vm->pool.freeLists[i];
+      vm->pool.freeLists[i] = sweeper->blocks[i];
     }
   }
+  finishSweeping();
 }
+#endif
 
 /**
  * @brief Performs garbage collection on the virtual machine.
@@ -353,28 +1246,180 @@ static void sweep()
  * tracing references, removing white objects from the string table, and
  * sweeping the object list to free unreachable objects.
  *
+ * An incremental collection in progress is finished first, so that what it
+ * didn't sweep yet isn't marked again.
+ *
  * The function also calculates and updates the next garbage collection
  * threshold based on the current memory usage.
  */
 void collectGarbage()
+{
+  auto vm = VM::getVM();
+  auto start = GCClock::now();
+  auto never = GCClock::time_point::max();
+#ifdef ENABLE_MP
+  joinSweeper();
+#endif
+  if (vm->sweeping.count > 0) {
+    sweep(never);
+    finishSweeping();
+  }
+  if (!vm->gcMarking)
+    beginMarking();
+  finishMarking();
+  // Unless a background thread took over the sweeping.
+  if (vm->sweeping.count > 0) {
+    sweep(never);
+    finishSweeping();
+  }
+  recordPause(start);
+}
+
+/**
+ * @brief Starts a full collection.
+ *
+ * Runs it to completion at once, unless `VM::gcMaxPause` allows splitting it
+ * into incremental steps, in which case only the roots are marked now.
+ */
+static void startGarbageCollection()
+{
+  auto vm = VM::getVM();
+  if (vm->gcMaxPause <= 0) {
+    collectGarbage();
+    return;
+  }
+
+  auto start = GCClock::now();
+#ifdef ENABLE_MP
+  joinSweeper();
+#endif
+  beginMarking();
+  vm->gcStepBytes = 0;
+  vm->gcStats.steps++;
+  recordPause(start);
+}
+
+/**
+ * @brief Runs one step of the incremental collection in progress.
+ *
+ * While marking, traces gray objects for at most `VM::gcMaxPause`
+ * microseconds. The nursery isn't collected in the meantime: its objects are
+ * swept with the rest when marking is done. While sweeping, frees unreachable
+ * old objects for the same amount of time, and collects the nursery once it is
+ * full.
+ *
+ * If the program allocates faster than the steps keep up with, the
+ * collection is finished at once rather than letting the heap grow without
+ * bound.
+ */
+static void stepGarbageCollection()
+{
+  auto vm = VM::getVM();
+  auto start = GCClock::now();
+  auto deadline = start
+      + std::chrono::duration_cast<GCClock::duration>(
+                      std::chrono::duration<double, std::micro>(
+                          vm->gcMaxPause));
+  if (vm->gcMaxPause <= 0
+      || (double)vm->bytesAllocated
+          > (double)vm->nextGC * vm->gcGrowFactor)
+    deadline = GCClock::time_point::max();
+
+  if (vm->gcMarking) {
+    if (traceReferences(deadline))
+      finishMarking();
+  } else {
+    if (sweep(deadline))
+      finishSweeping();
+    if (vm->nurseryBytes > NURSERY_SIZE)
+      markNursery();
+  }
+  vm->gcStepBytes = 0;
+  vm->gcStats.steps++;
+  recordPause(start);
+}
+
+/**
+ * @brief Marks the young objects reachable from the roots or from the
+ * remembered set, then sweeps the nursery.
+ */
+static void markNursery()
 {
   auto vm = VM::getVM();
 #ifdef DEBUG_LOG_GC
-  printf("-- gc begin\n");
+  printf("-- minor gc begin\n");
   size_t before = vm->bytesAllocated;
 #endif
+  vm->collectingNursery = true;
   markRoots();
+  // Marking the roots may remember more objects, so re-read the count.
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    blackenRemembered(vm->remembered[i]);
+  }
   traceReferences();
   vm->strings.tableRemoveWhite();
-  sweep();
-  vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+  sweepNursery();
+  forgetRemembered();
+  vm->collectingNursery = false;
+  vm->gcStats.minorCollections++;
 
 #ifdef DEBUG_LOG_GC
-  printf("-- gc end\n");
-  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+  printf("-- minor gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu)\n",
          before - vm->bytesAllocated,
          before,
-         vm->bytesAllocated,
-         vm->nextGC);
+         vm->bytesAllocated);
 #endif
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Performs a minor garbage collection.
+ *
+ * Marks the young objects reachable from the roots or from the remembered
+ * set, frees the rest of the nursery and promotes the survivors. Old objects
+ * are neither marked nor swept, so the cost depends on the size of the
+ * nursery and not on the size of the heap.
+ */
+void collectNursery()
+{
+  auto start = GCClock::now();
+  markNursery();
+  recordPause(start);
+}
+
+/**
+ * @brief Prints the collector's statistics, one counter per line, for
+ * `--gc-stats`.
+ *
+ * @param out Where to print them.
+ */
+void reportGCStats(FILE* out)
+{
+  auto vm = VM::getVM();
+  auto stats = &vm->gcStats;
+  fprintf(out, "-- gc stats\n");
+  fprintf(out, "allocations       %zu\n", stats->allocations);
+  fprintf(out, "allocated bytes   %zu\n", stats->allocatedBytes);
+  fprintf(out,
+          "freed bytes       %zu\n",
+          stats->allocatedBytes - vm->bytesAllocated);
+  fprintf(out, "heap bytes        %zu\n", vm->bytesAllocated);
+  fprintf(out, "peak heap bytes   %zu\n", stats->peakHeap);
+  fprintf(out, "next gc bytes     %zu\n", vm->nextGC);
+  fprintf(out, "collections       %d\n", stats->collections);
+  fprintf(out, "minor collections %d\n", stats->minorCollections);
+  fprintf(out, "steps             %d\n", stats->steps);
+  fprintf(out, "total pause us    %.1f\n", stats->totalPause);
+  fprintf(out, "max pause us      %.1f\n", stats->maxPause);
+  fprintf(out, "gray stack peak   %d\n", stats->grayPeak);
+  fprintf(out, "-- bytes by type  allocated freed\n");
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    if (stats->allocatedByType[i] == 0)
+      continue;
+    fprintf(out,
+            "%-17s %zu %zu\n",
+            objTypeName((ObjType)i),
+            stats->allocatedByType[i],
+            stats->freedByType[i]);
+  }
+}
@@ -1,9 +1,28 @@
 #ifndef clox_memory_h
 #define clox_memory_h
 
+#include <stdio.h>
+
 #include "common.hpp"
 #include "object.hpp"
 
+/**
+ * @brief How many times its size the heap may grow to after a full
+ * collection before the next one starts, unless a script sets otherwise with
+ * `gc_tune`.
+ */
+constexpr double GC_HEAP_GROW_FACTOR = 2;
+
+/**
+ * @brief The heap size that starts the first full collection.
+ */
+constexpr size_t GC_INITIAL_HEAP = 1024 * 1024;
+
+#ifdef ENABLE_MP
+#  include <atomic>
+#  include <thread>
+#endif
+
 /**
  * @brief Reallocates a block of memory.
  *
@@ -17,6 +36,231 @@
  */
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 
+/**
+ * @brief Granularity of the object pool's size classes, in bytes.
+ */
+constexpr size_t POOL_GRANULE = 8;
+
+/**
+ * @brief Number of size classes; larger blocks bypass the pool.
+ */
+constexpr int POOL_SIZE_CLASSES = 16;
+
+/**
+ * @brief Bytes requested from the system whenever a size class runs dry.
+ */
+constexpr size_t POOL_SLAB_SIZE = 16 * 1024;
+
+/**
+ * @brief Segregated free lists for the fixed-size heap objects.
+ *
+ * Blocks are carved out of slabs of `POOL_SLAB_SIZE` bytes and never returned
+ * to the system before `freePool`. Freed blocks go back onto the free list of
+ * their size class, so sweeping and reallocating objects of the same type
+ * doesn't go through malloc.
+ */
+class ObjectPool
+{
+public:
+  /**
+   * @brief Free blocks of each size class, linked through their first word.
+   */
+  void* freeLists[POOL_SIZE_CLASSES];
+
+  /**
+   * @brief All slabs obtained from the system, linked through their first
+   * word.
+   */
+  void* slabs;
+
+  /**
+   * @brief Initialises an empty pool.
+   */
+  void initPool();
+
+  /**
+   * @brief Returns every slab to the system.
+   */
+  void freePool();
+
+  /**
+   * @brief Takes a block from the pool.
+   *
+   * @param size The size of the block, at most `POOL_SIZE_CLASSES` granules.
+   * @return A pointer to the block.
+   */
+  void* allocate(size_t size);
+
+  /**
+   * @brief Puts a block back on the free list of its size class.
+   *
+   * @param pointer The block to release.
+   * @param size The size the block was allocated with.
+   */
+  void release(void* pointer, size_t size);
+};
+
+/**
+ * @brief A list of heap objects the collector keeps outside of them.
+ *
+ * Objects don't link to each other to be found by the collector, which walks
+ * these arrays instead. Like the gray stack, they are allocated outside of
+ * `reallocate`, so adding an object can't start a collection before the
+ * object is even initialised.
+ */
+class ObjectArray
+{
+public:
+  int count;
+  int capacity;
+  Obj** objects;
+
+  /**
+   * @brief Initialises an empty array.
+   */
+  void initObjectArray();
+
+  /**
+   * @brief Appends an object to the array.
+   *
+   * @param object The object to append.
+   */
+  void writeObjectArray(Obj* object);
+
+  /**
+   * @brief Frees the array, but not the objects in it.
+   */
+  void freeObjectArray();
+};
+
+/**
+ * @brief Counters describing the work done by the garbage collector.
+ *
+ * Pauses are measured in microseconds, from the moment the mutator stops to
+ * the moment it resumes.
+ */
+class GCStats
+{
+public:
+  /**
+   * @brief Full collections completed, including incremental ones.
+   */
+  int collections;
+
+  /**
+   * @brief Minor collections completed.
+   */
+  int minorCollections;
+
+  /**
+   * @brief Slices of incremental marking or sweeping run.
+   */
+  int steps;
+
+  /**
+   * @brief The time spent in the collector altogether.
+   */
+  double totalPause;
+
+  /**
+   * @brief The longest single pause.
+   */
+  double maxPause;
+
+  /**
+   * @brief Objects allocated altogether.
+   */
+  size_t allocations;
+
+  /**
+   * @brief Bytes allocated altogether, whether or not they were freed since.
+   */
+  size_t allocatedBytes;
+
+  /**
+   * @brief The largest the heap has been, in bytes.
+   */
+  size_t peakHeap;
+
+  /**
+   * @brief The most objects on the gray stack at once.
+   */
+  int grayPeak;
+
+  /**
+   * @brief Bytes of objects allocated and freed, per type.
+   *
+   * Only the objects themselves are counted, not the arrays of items or
+   * fields they own.
+   */
+  size_t allocatedByType[OBJ_TYPE_COUNT];
+  size_t freedByType[OBJ_TYPE_COUNT];
+};
+
+#ifdef ENABLE_MP
+/**
+ * @brief A thread freeing the unreachable old objects of a full collection.
+ *
+ * The thread only touches the list it was handed, so the program and minor
+ * collections carry on meanwhile. What it frees is accounted for and returned
+ * to the pool when the VM joins it.
+ */
+class Sweeper
+{
+public:
+  std::thread thread;
+
+  /**
+   * @brief Whether a sweep was started and not joined yet.
+   */
+  bool active;
+
+  /**
+   * @brief Set by the thread once it swept every object.
+   */
+  std::atomic<bool> done;
+
+  /**
+   * @brief The objects to sweep, which the thread leaves holding only the
+   * reachable ones.
+   */
+  ObjectArray objects;
+
+  /**
+   * @brief Bytes freed by the thread, and the part of them that were
+   * objects of each type.
+   */
+  size_t freedBytes;
+  size_t freedByType[OBJ_TYPE_COUNT];
+
+  /**
+   * @brief Pool blocks freed by the thread, per size class, and the last
+   * block of each list.
+   */
+  void* blocks[POOL_SIZE_CLASSES];
+  void* blockTails[POOL_SIZE_CLASSES];
+};
+#endif
+
+/**
+ * @brief Allocates the memory of a heap object.
+ *
+ * Accounts for the size exactly like `reallocate`, so garbage collection is
+ * paced the same whether or not the pool allocator is enabled.
+ *
+ * @param size The size of the object in bytes.
+ * @return A pointer to the allocated memory.
+ */
+void* allocateObjectMemory(size_t size);
+
+/**
+ * @brief Frees the memory of a heap object.
+ *
+ * @param pointer The object to free.
+ * @param size The size the object was allocated with.
+ */
+void freeObjectMemory(void* pointer, size_t size);
+
 /**
  * @brief Marks an object as reachable for garbage collection.
  *
@@ -36,13 +280,122 @@ void markObject(Obj* object);
  */
 void markValue(Value value);
 
+/**
+ * @brief Marks an object, scanning it again if it was already marked.
+ *
+ * Used for roots that are written to without write barriers, so that an
+ * incremental collection sees what was stored into them since they were
+ * first scanned.
+ *
+ * @param object The object to be marked.
+ */
+void rescanObject(Obj* object);
+
+/**
+ * @brief Marks an object stored into an already marked one while an
+ * incremental collection is marking.
+ *
+ * @param object The object being stored.
+ */
+void shadeObject(Obj* object);
+
 /**
  * @brief Performs garbage collection.
  *
- * This function reclaims memory occupied by unreachable objects.
+ * This function reclaims memory occupied by unreachable objects. An
+ * incremental collection in progress is finished first.
  */
 void collectGarbage();
 
+/**
+ * @brief Performs a minor garbage collection.
+ *
+ * Only frees unreachable objects in the nursery. Old objects are treated as
+ * live, and only the roots and the remembered set are scanned for references
+ * into the nursery.
+ */
+void collectNursery();
+
+/**
+ * @brief Prints the collector's statistics, one counter per line, for
+ * `--gc-stats`.
+ *
+ * @param out Where to print them.
+ */
+void reportGCStats(FILE* out);
+
+/**
+ * @brief Adds an old object to the remembered set.
+ *
+ * The next minor collection scans the object for references into the nursery.
+ *
+ * @param object The object that may refer to young objects.
+ */
+void rememberObject(Obj* object);
+
+/**
+ * @brief Checks whether the collection in progress found an object
+ * unreachable.
+ *
+ * @param object The object to check.
+ * @return `true` if the object is about to be freed, `false` otherwise.
+ */
+bool isUnreachable(Obj* object);
+
+/**
+ * @brief Records a store of a value into an object.
+ *
+ * Must follow every store into an object that may have survived a collection
+ * since it was allocated, so that minor collections see references from old
+ * objects to young ones, and so that an incremental collection never leaves an
+ * object unmarked after storing it into one it has already scanned.
+ *
+ * @param owner The object being written to.
+ * @param value The value stored into it.
+ */
+inline void writeBarrier(Obj* owner, Value value)
+{
+  if (!IS_OBJ(value))
+    return;
+  auto object = AS_OBJ(value);
+  // Marks only outlive a collection while an incremental one is in progress.
+  if (owner->isMarked.load(std::memory_order_relaxed)
+      && !object->isMarked.load(std::memory_order_relaxed))
+    shadeObject(object);
+  if (owner->isOld && !owner->isRemembered && !object->isOld)
+    rememberObject(owner);
+}
+
+/**
+ * @brief Records a store of a value into a list item.
+ *
+ * Like `writeBarrier`, but also tracks which items were written so a minor
+ * collection doesn't rescan every item of a big list that keeps growing.
+ *
+ * @param list The list being written to.
+ * @param index The index of the item that was stored.
+ * @param value The value stored into it.
+ */
+inline void writeListBarrier(ObjList* list, int index, Value value)
+{
+  if (!IS_OBJ(value))
+    return;
+  if (list->isMarked.load(std::memory_order_relaxed)
+      && !AS_OBJ(value)->isMarked.load(std::memory_order_relaxed))
+    shadeObject(AS_OBJ(value));
+  if (!list->isOld || AS_OBJ(value)->isOld)
+    return;
+  if (!list->isRemembered) {
+    rememberObject((Obj*)list);
+    list->dirtyStart = index;
+    list->dirtyEnd = index + 1;
+  } else if (index < list->dirtyStart) {
+    list->dirtyStart = index;
+  } else if (index >= list->dirtyEnd) {
+    list->dirtyEnd = index + 1;
+  }
+}
+
 /**
  * @brief Frees all allocated objects.
  *
@@ -139,7 +492,8 @@ inline void* FREE_ARRAY(void* pointer, int oldCount)
 template<typename T>
 inline void* FREE(void* pointer)
 {
-  return reallocate(pointer, sizeof(T), 0);
+  freeObjectMemory(pointer, sizeof(T));
+  return NULL;
 }
 
 #endif
\ No newline at end of file
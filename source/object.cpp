@@ -3,17 +3,27 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <vector>
+
 #include "memory.hpp"
+#include "output.hpp"
 #include "table.hpp"
 #include "value.hpp"
 #include "vm.hpp"
 
+#if defined(__SSE2__) || defined(_M_X64) \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define NUM_ARRAY_SSE2
+#endif
+
 /**
  * @brief Calculates a hash value for a given string.
  *
- * This function computes a 32-bit hash value for the specified string using a
- * simple hash function. The hash function is based on XORing each character
- * with the current hash value and multiplying by a prime number.
+ * Strings shorter than a word use FNV-1a, XORing each character with the
+ * current hash value and multiplying by a prime number. Longer strings are
+ * mixed in a 64-bit word at a time, then the result is finalized so every bit
+ * of the returned hash depends on the whole string.
  *
  * @param key The string to hash.
  * @param length The length of the string.
@@ -21,21 +31,35 @@
  */
 static uint32_t hashString(const char* key, int length)
 {
-#ifdef ENABLE_MP
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
+  if (length < (int)sizeof(uint64_t)) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+      hash ^= (uint8_t)key[i];
+      hash *= 16777619;
+    }
+    return hash;
   }
-  return hash;
-#else
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
+
+  constexpr uint64_t multiplier = 0xFF51AFD7ED558CCDull;
+  uint64_t hash = 0x9E3779B97F4A7C15ull ^ (uint64_t)length;
+  uint64_t word;
+  int i = 0;
+  for (; i + (int)sizeof(word) <= length; i += sizeof(word)) {
+    memcpy(&word, key + i, sizeof(word));
+    hash = (hash ^ word) * multiplier;
+    hash ^= hash >> 32;
   }
-  return hash;
-#endif
+  if (i < length) {
+    // The last word overlaps the previous one instead of being padded.
+    memcpy(&word, key + length - sizeof(word), sizeof(word));
+    hash = (hash ^ word) * multiplier;
+    hash ^= hash >> 32;
+  }
+
+  hash ^= hash >> 33;
+  hash *= 0xC4CEB9FE1A85EC53ull;
+  hash ^= hash >> 33;
+  return (uint32_t)hash;
 }
 
 /**
@@ -50,18 +74,19 @@ static uint32_t hashString(const char* key, int length)
 static void printFunction(ObjFunction* function)
 {
   if (function->name == NULL) {
-    printf("<script>");
+    writeOutput("<script>");
     return;
   }
-  printf("<fn %s>", function->name->chars);
+  writeOutput("<fn ");
+  writeOutput(function->name->chars, function->name->length);
+  writeOutput(">");
 }
 
 /**
  * @brief Allocates memory for a new object.
  *
  * This function allocates memory for a new object of the specified size and
- * type. The allocated object is added to the beginning of the object list
- * managed by the VM.
+ * type. The allocated object is added to the VM's nursery.
  *
  * @param size The size of the object in bytes.
  * @param type The type of the object.
@@ -70,11 +95,14 @@ static void printFunction(ObjFunction* function)
 static Obj* allocateObject(size_t size, ObjType type)
 {
   auto vm = VM::getVM();
-  auto object = (Obj*)reallocate(NULL, 0, size);
+  auto object = (Obj*)allocateObjectMemory(size);
   object->type = type;
-  object->isMarked = false;
-  object->next = vm->objects;
-  vm->objects = object;
+  object->isMarked.store(false, std::memory_order_relaxed);
+  object->isOld = false;
+  object->isRemembered = false;
+  vm->nursery.writeObjectArray(object);
+  vm->gcStats.allocations++;
+  vm->gcStats.allocatedByType[type] += size;
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -99,6 +127,130 @@ T* ALLOCATE_OBJ(ObjType x)
   return (T*)allocateObject(sizeof(T), x);
 }
 
+/**
+ * @brief Creates a new shape object.
+ *
+ * The shape starts with the slots of its parent plus, if a name is given, one
+ * more slot for that field. Transitions out of the new shape are recorded
+ * lazily by `transitionShape`.
+ *
+ * @param parent The shape being extended, or NULL for a root shape.
+ * @param name The field added on top of the parent, or NULL for a root shape.
+ * @return A pointer to the newly created shape object.
+ */
+static ObjShape* newShape(ObjShape* parent, ObjString* name)
+{
+  auto vm = VM::getVM();
+  auto shape = ALLOCATE_OBJ<ObjShape>(OBJ_SHAPE);
+  shape->parent = parent;
+  shape->name = name;
+  shape->id = ++vm->shapeCount;
+  shape->fieldCount = 0;
+  shape->slots.initTable();
+  shape->slots.owner = (Obj*)shape;
+  shape->transitions.initTable();
+  shape->transitions.owner = (Obj*)shape;
+
+  if (parent != NULL) {
+    vm->push(OBJ_VAL(shape));
+    tableAddAll(&parent->slots, &shape->slots);
+    shape->fieldCount = parent->fieldCount + 1;
+    shape->slots.tableSet(name, NUMBER_VAL((double)parent->fieldCount));
+    vm->pop();
+  }
+  return shape;
+}
+
+/**
+ * @brief Looks up the slot of a field in a shape.
+ *
+ * @param shape The shape to search.
+ * @param name The name of the field.
+ * @return The slot of the field, or -1 if the shape doesn't have it.
+ */
+int findShapeSlot(ObjShape* shape, ObjString* name)
+{
+  Value slot;
+  if (!shape->slots.tableGet(name, &slot))
+    return -1;
+  return (int)AS_NUMBER(slot);
+}
+
+/**
+ * @brief Returns the shape reached by adding a field to a shape.
+ *
+ * Reuses an existing transition when one was taken before, otherwise creates
+ * the child shape and records the transition in the parent.
+ *
+ * @param shape The shape to extend.
+ * @param name The name of the new field.
+ * @return The child shape, whose last slot holds the new field.
+ */
+ObjShape* transitionShape(ObjShape* shape, ObjString* name)
+{
+  Value child;
+  if (shape->transitions.tableGet(name, &child))
+    return (ObjShape*)AS_OBJ(child);
+
+  auto vm = VM::getVM();
+  auto next = newShape(shape, name);
+  vm->push(OBJ_VAL(next));
+  shape->transitions.tableSet(name, OBJ_VAL(next));
+  vm->pop();
+  return next;
+}
+
+/**
+ * @brief Moves an instance to a shape with more fields.
+ *
+ * Grows the field array when the new shape needs more slots than are
+ * allocated, and remembers the size on the class so later instances allocate
+ * enough slots up front. New slots are initialised to nil.
+ *
+ * @param instance The instance to update.
+ * @param shape The shape reached through `transitionShape`.
+ */
+void setInstanceShape(ObjInstance* instance, ObjShape* shape)
+{
+  if (instance->fieldCapacity < shape->fieldCount) {
+    int oldCapacity = instance->fieldCapacity;
+    int capacity = GROW_CAPACITY(oldCapacity);
+    if (capacity < shape->fieldCount)
+      capacity = shape->fieldCount;
+    instance->fields =
+        GROW_ARRAY<Value>(instance->fields, oldCapacity, capacity);
+    instance->fieldCapacity = capacity;
+    for (int i = oldCapacity; i < capacity; i++) {
+      instance->fields[i] = NIL_VAL;
+    }
+  }
+
+  instance->shape = shape;
+  writeBarrier((Obj*)instance, OBJ_VAL(shape));
+  if (instance->klass->fieldHint < shape->fieldCount)
+    instance->klass->fieldHint = shape->fieldCount;
+}
+
+/**
+ * @brief Sets a field of an instance, adding it to the instance's shape if
+ * the shape doesn't have it yet.
+ *
+ * @param instance The instance to update.
+ * @param name The name of the field.
+ * @param value The new value of the field.
+ */
+void setInstanceField(ObjInstance* instance, ObjString* name, Value value)
+{
+  auto slot = findShapeSlot(instance->shape, name);
+  if (slot == -1) {
+    auto shape = transitionShape(instance->shape, name);
+    setInstanceShape(instance, shape);
+    slot = shape->fieldCount - 1;
+  }
+  writeBarrier((Obj*)instance, value);
+  instance->fields[slot] = value;
+}
+
 /**
  * @brief Creates a new bound method object.
  *
@@ -129,9 +281,19 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method)
  */
 ObjClass* newClass(ObjString* name)
 {
+  auto vm = VM::getVM();
   auto klass = ALLOCATE_OBJ<ObjClass>(OBJ_CLASS);
   klass->name = name;
   klass->methods.initTable();
+  klass->methods.owner = (Obj*)klass;
+  klass->version = ++vm->classVersion;
+  klass->shape = NULL;
+  klass->fieldHint = 0;
+
+  vm->push(OBJ_VAL(klass));
+  klass->shape = newShape(NULL, NULL);
+  writeBarrier((Obj*)klass, OBJ_VAL(klass->shape));
+  vm->pop();
   return klass;
 }
 
@@ -148,6 +310,7 @@ ObjFunction* newFunction()
   auto function = ALLOCATE_OBJ<ObjFunction>(OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->maxSlots = 0;
   function->name = NULL;
   function->chunk.initChunk();
   return function;
@@ -194,6 +357,35 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash)
   return string;
 }
 
+/**
+ * @brief Allocates a new string object holding its characters inline.
+ *
+ * Like `allocateString`, but copies the characters into the same allocation as
+ * the object, so the string needs no separate character array.
+ *
+ * @param chars The characters of the string, at most `SMALL_STRING_LENGTH`.
+ * @param length The length of the string.
+ * @param hash The pre-calculated hash value of the string.
+ * @return A pointer to the newly created string object.
+ */
+static ObjString* allocateSmallString(const char* chars,
+                                      int length,
+                                      uint32_t hash)
+{
+  auto vm = VM::getVM();
+  auto string =
+      (ObjString*)allocateObject(sizeof(ObjString) + length + 1, OBJ_STRING);
+  string->length = length;
+  string->chars = (char*)(string + 1);
+  memcpy(string->chars, chars, length);
+  string->chars[length] = '\0';
+  string->hash = hash;
+  vm->push(OBJ_VAL(string));
+  vm->strings.tableSet(string, NIL_VAL);
+  vm->pop();
+  return string;
+}
+
 /**
  * @brief Creates a new string object, interning it if possible.
  *
@@ -208,11 +400,16 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash)
  */
 ObjString* copyString(const char* chars, int length)
 {
-  uint32_t hash = hashString(chars, length);
   auto vm = VM::getVM();
+  // One-character strings are interned once for the lifetime of the VM.
+  if (length == 1 && vm->charStrings[(uint8_t)chars[0]] != NULL)
+    return vm->charStrings[(uint8_t)chars[0]];
+  uint32_t hash = hashString(chars, length);
   auto interned = vm->strings.tableFindString(chars, length, hash);
   if (interned != NULL)
     return interned;
+  if (length <= SMALL_STRING_LENGTH)
+    return allocateSmallString(chars, length, hash);
   auto heapChars = ALLOCATE<char>(length + 1);
   memcpy(heapChars, chars, length);
   heapChars[length] = '\0';
@@ -238,9 +435,143 @@ ObjString* copyString(const char* chars, int length)
 ObjString* takeString(char* chars, int length)
 {
   auto hash = hashString(chars, length);
+  auto interned = VM::getVM()->strings.tableFindString(chars, length, hash);
+  if (interned != NULL) {
+    FREE_ARRAY<char>(chars, length + 1);
+    return interned;
+  }
+  if (length <= SMALL_STRING_LENGTH) {
+    auto string = allocateSmallString(chars, length, hash);
+    FREE_ARRAY<char>(chars, length + 1);
+    return string;
+  }
   return allocateString(chars, length, hash);
 }
 
+/**
+ * @brief Creates a new rope concatenating two strings or ropes.
+ *
+ * @param left The left side, which must be a string or a rope.
+ * @param right The right side, which must be a string or a rope.
+ * @param length The length of the concatenation.
+ * @return A pointer to the newly created rope object.
+ */
+ObjRope* newRope(Obj* left, Obj* right, int length)
+{
+  auto rope = ALLOCATE_OBJ<ObjRope>(OBJ_ROPE);
+  rope->length = length;
+  rope->left = left;
+  rope->right = right;
+  rope->flat = NULL;
+  return rope;
+}
+
+/**
+ * @brief Returns the string a piece of a rope stands for, if it has one.
+ *
+ * @param piece A string or a rope.
+ * @return The string itself, the string a rope flattened to, or NULL for a
+ * rope that hasn't been flattened.
+ */
+static ObjString* pieceString(Obj* piece)
+{
+  if (piece->type == OBJ_STRING)
+    return (ObjString*)piece;
+  return ((ObjRope*)piece)->flat;
+}
+
+/**
+ * @brief Returns the interned string a rope stands for.
+ *
+ * The pieces are copied from the end, so the left leaning ropes that building
+ * a string in a loop makes only keep one rope waiting at a time.
+ *
+ * @param rope The rope to flatten.
+ * @return The string with the characters of the rope.
+ */
+ObjString* flattenRope(ObjRope* rope)
+{
+  if (rope->flat != NULL)
+    return rope->flat;
+
+  auto chars = ALLOCATE<char>(rope->length + 1);
+  auto end = rope->length;
+  std::vector<Obj*> pending = {(Obj*)rope};
+  while (!pending.empty()) {
+    auto piece = pending.back();
+    pending.pop_back();
+    auto string = pieceString(piece);
+    if (string == NULL) {
+      pending.push_back(((ObjRope*)piece)->left);
+      pending.push_back(((ObjRope*)piece)->right);
+      continue;
+    }
+    end -= string->length;
+    memcpy(chars + end, string->chars, string->length);
+  }
+  chars[rope->length] = '\0';
+
+  auto string = takeString(chars, rope->length);
+  rope->flat = string;
+  writeBarrier((Obj*)rope, OBJ_VAL(string));
+  rope->left = NULL;
+  rope->right = NULL;
+  return string;
+}
+
+/**
+ * @brief Prints the characters of a rope without flattening it.
+ *
+ * @param rope The rope to print.
+ */
+static void printRope(ObjRope* rope)
+{
+  std::vector<Obj*> pending = {(Obj*)rope};
+  while (!pending.empty()) {
+    auto piece = pending.back();
+    pending.pop_back();
+    auto string = pieceString(piece);
+    if (string == NULL) {
+      pending.push_back(((ObjRope*)piece)->right);
+      pending.push_back(((ObjRope*)piece)->left);
+      continue;
+    }
+    writeOutput(string->chars, string->length);
+  }
+}
+
+/**
+ * @brief The names of the object types, in the order of `ObjType`.
+ */
+static const char* const objTypeNames[] = {
+    "bound_method",
+    "class",
+    "closure",
+    "instance",
+    "function",
+    "native",
+    "string",
+    "upvalue",
+    "list",
+    "shape",
+    "rope",
+    "num_array",
+};
+
+static_assert(sizeof(objTypeNames) / sizeof(objTypeNames[0]) == OBJ_TYPE_COUNT,
+              "Every object type needs a name.");
+
+/**
+ * @brief Returns the name of an object type, for statistics.
+ *
+ * @param type The object type.
+ * @return The name of the type, in lower case.
+ */
+const char* objTypeName(ObjType type)
+{
+  return objTypeNames[type];
+}
+
 /**
  * @brief Prints a human-readable representation of a value.
  *
@@ -258,7 +589,8 @@ void printObject(Value value)
       printFunction(AS_BOUND_METHOD(value)->method->function);
       break;
     case OBJ_CLASS:
-      printf("%s", AS_CLASS(value)->name->chars);
+      writeOutput(AS_CLASS(value)->name->chars,
+                  AS_CLASS(value)->name->length);
       break;
     case OBJ_CLOSURE:
       printFunction(AS_CLOSURE(value)->function);
@@ -267,26 +599,44 @@ void printObject(Value value)
       printFunction(AS_FUNCTION(value));
       break;
     case OBJ_STRING:
-      printf("%s", AS_CSTRING(value));
+      writeOutput(AS_CSTRING(value), AS_STRING(value)->length);
       break;
     case OBJ_NATIVE:
-      printf("<native fn>");
+      writeOutput("<native fn>");
       break;
     case OBJ_UPVALUE:
-      printf("upvalue");
+      writeOutput("upvalue");
       break;
     case OBJ_INSTANCE:
-      printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+      writeOutput(AS_INSTANCE(value)->klass->name->chars,
+                  AS_INSTANCE(value)->klass->name->length);
+      writeOutput(" instance");
+      break;
+    case OBJ_SHAPE:
+      writeOutput("shape");
+      break;
+    case OBJ_ROPE:
+      printRope(AS_ROPE(value));
+      break;
+    case OBJ_NUM_ARRAY:
+      writeOutput("[");
+      for (int i = 0; i < AS_NUM_ARRAY(value)->count; i++) {
+        printValue(NUMBER_VAL(AS_NUM_ARRAY(value)->items[i]));
+        if (i != AS_NUM_ARRAY(value)->count - 1) {
+          writeOutput(",");
+        }
+      }
+      writeOutput("]");
       break;
     case OBJ_LIST:
-      printf("[");
+      writeOutput("[");
       for (int i = 0; i < AS_LIST(value)->count; i++) {
         printValue(AS_LIST(value)->items[i]);
         if (i != AS_LIST(value)->count - 1) {
-          printf(",");
+          writeOutput(",");
         }
       }
-      printf("]");
+      writeOutput("]");
       break;
   }
 }
@@ -313,40 +663,50 @@ ObjUpvalue* newUpvalue(Value* slot)
 /**
  * @brief Creates a new closure object.
  *
- * This function allocates a new `ObjClosure` object, initializes its `function`
- * and `upvalues` fields, and returns a pointer to the newly created closure.
+ * This function allocates a new `ObjClosure` object with room for its
+ * upvalues in the same allocation, initializes its `function` and `upvalues`
+ * fields, and returns a pointer to the newly created closure.
  *
  * @param function The function associated with the closure.
  * @return A pointer to the newly created closure object.
  */
 ObjClosure* newClosure(ObjFunction* function)
 {
-  auto upvalues = ALLOCATE<ObjUpvalue*>(function->upvalueCount);
-  for (int i = 0; i < function->upvalueCount; i++) {
-    upvalues[i] = NULL;
-  }
-
-  auto closure = ALLOCATE_OBJ<ObjClosure>(OBJ_CLOSURE);
+  auto closure = (ObjClosure*)allocateObject(
+      sizeof(ObjClosure) + sizeof(Value) * function->upvalueCount,
+      OBJ_CLOSURE);
   closure->function = function;
-  closure->upvalues = upvalues;
+  closure->upvalues = (Value*)(closure + 1);
   closure->upvalueCount = function->upvalueCount;
+  for (int i = 0; i < closure->upvalueCount; i++) {
+    closure->upvalues[i] = NIL_VAL;
+  }
   return closure;
 }
 
 /**
  * @brief Creates a new instance of a class.
  *
- * This function allocates a new `ObjInstance` object, initializes its `klass`
- * field, and creates an empty field table for the instance.
+ * This function allocates a new `ObjInstance` object in the root shape of its
+ * class. As many field slots as earlier instances of the class ended up with
+ * are reserved right away.
  *
  * @param klass The class to create an instance of.
  * @return A pointer to the newly created instance object.
  */
 ObjInstance* newInstance(ObjClass* klass)
 {
+  auto capacity = klass->fieldHint;
+  auto fields = ALLOCATE<Value>(capacity);
+  for (int i = 0; i < capacity; i++) {
+    fields[i] = NIL_VAL;
+  }
+
   auto instance = ALLOCATE_OBJ<ObjInstance>(OBJ_INSTANCE);
   instance->klass = klass;
-  instance->fields.initTable();
+  instance->shape = klass->shape;
+  instance->fields = fields;
+  instance->fieldCapacity = capacity;
   return instance;
 }
 
@@ -356,6 +716,8 @@ ObjList* newList()
   list->items = NULL;
   list->count = 0;
   list->capacity = 0;
+  list->dirtyStart = 0;
+  list->dirtyEnd = 0;
   return list;
 }
 
@@ -368,12 +730,14 @@ void appendToList(ObjList* list, Value value)
   }
   list->items[list->count] = value;
   list->count++;
+  writeListBarrier(list, list->count - 1, value);
   return;
 }
 
 void storeToList(ObjList* list, int index, Value value)
 {
   list->items[index] = value;
+  writeListBarrier(list, index, value);
 }
 //
 Value indexFromList(ObjList* list, int index)
@@ -383,11 +747,66 @@ Value indexFromList(ObjList* list, int index)
 
 void deleteFromList(ObjList* list, int index)
 {
-  for (int i = index; i < list->count - 1; i++) {
-    list->items[i] = list->items[i + 1];
+  deleteRangeFromList(list, index, index + 1);
+}
+
+void reserveList(ObjList* list, int capacity)
+{
+  if (list->capacity >= capacity)
+    return;
+  list->items = GROW_ARRAY<Value>(list->items, list->capacity, capacity);
+  list->capacity = capacity;
+}
+
+void extendList(ObjList* list, ObjList* from, int start, int end)
+{
+  // An empty list has no items to copy into, or from.
+  if (start == end)
+    return;
+  auto count = list->count + end - start;
+  if (list->capacity < count) {
+    auto capacity = GROW_CAPACITY(list->capacity);
+    reserveList(list, capacity < count ? count : capacity);
+  }
+  // Reserving may have moved the items if both lists are the same one.
+  if (!list->isOld && !list->isMarked.load(std::memory_order_relaxed)) {
+    // Nothing to record for a young list the collector hasn't reached.
+    memcpy(&list->items[list->count],
+           &from->items[start],
+           (end - start) * sizeof(Value));
+    list->count = count;
+    return;
+  }
+  for (int i = start; i < end; i++) {
+    auto value = from->items[i];
+    list->items[list->count] = value;
+    writeListBarrier(list, list->count, value);
+    list->count++;
   }
-  list->items[list->count - 1] = NIL_VAL;
-  list->count--;
+}
+
+void deleteRangeFromList(ObjList* list, int start, int end)
+{
+  auto removed = end - start;
+  if (removed <= 0)
+    return;
+  // Young items after the range shift down, possibly out of the dirty range.
+  if (list->isRemembered && start < list->dirtyStart)
+    list->dirtyStart = start;
+  // Or out of the part the incremental collection still has to scan.
+  auto vm = VM::getVM();
+  if (list == vm->grayList && start < vm->grayListIndex) {
+    vm->grayListIndex = vm->grayListIndex - removed > start
+        ? vm->grayListIndex - removed
+        : start;
+  }
+  memmove(&list->items[start],
+          &list->items[end],
+          (list->count - end) * sizeof(Value));
+  for (int i = list->count - removed; i < list->count; i++) {
+    list->items[i] = NIL_VAL;
+  }
+  list->count -= removed;
 }
 
 bool isValidListIndex(ObjList* list, int index)
@@ -398,6 +817,198 @@ bool isValidListIndex(ObjList* list, int index)
   return true;
 }
 
+ObjNumArray* newNumArray(int count, double fill)
+{
+  auto items = ALLOCATE<double>(count);
+  fillNumbers(items, count, fill);
+  auto array = ALLOCATE_OBJ<ObjNumArray>(OBJ_NUM_ARRAY);
+  array->count = count;
+  array->capacity = count;
+  array->items = items;
+  return array;
+}
+
+void appendToNumArray(ObjNumArray* array, double value)
+{
+  if (array->capacity < array->count + 1) {
+    int oldCapacity = array->capacity;
+    array->capacity = GROW_CAPACITY(oldCapacity);
+    array->items =
+        GROW_ARRAY<double>(array->items, oldCapacity, array->capacity);
+  }
+  array->items[array->count] = value;
+  array->count++;
+}
+
+bool isValidNumArrayIndex(ObjNumArray* array, int index)
+{
+  return index >= 0 && index < array->count;
+}
+
+/**
+ * @brief Sets `count` numbers to a value.
+ *
+ * Simple enough for the compiler to vectorize on its own.
+ *
+ * @param items The numbers to set.
+ * @param count The number of numbers.
+ * @param value The value to set them to.
+ */
+void fillNumbers(double* items, int count, double value)
+{
+  for (int i = 0; i < count; i++) {
+    items[i] = value;
+  }
+}
+
+/**
+ * @brief Returns the sum of `count` numbers, added in no particular order.
+ *
+ * Adds four numbers at a time into two vector accumulators, which rounds
+ * differently from adding the numbers one by one.
+ *
+ * @param items The numbers to add.
+ * @param count The number of numbers.
+ * @return Their sum.
+ */
+double sumNumbers(const double* items, int count)
+{
+  double sum = 0;
+  int i = 0;
+#ifdef NUM_ARRAY_SSE2
+  auto low = _mm_setzero_pd();
+  auto high = _mm_setzero_pd();
+  for (; i + 4 <= count; i += 4) {
+    low = _mm_add_pd(low, _mm_loadu_pd(items + i));
+    high = _mm_add_pd(high, _mm_loadu_pd(items + i + 2));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(low, high));
+  sum = lanes[0] + lanes[1];
+#endif
+  for (; i < count; i++) {
+    sum += items[i];
+  }
+  return sum;
+}
+
+/**
+ * @brief Returns the smallest of `count` numbers.
+ *
+ * @param items The numbers, of which there is at least one.
+ * @param count The number of numbers.
+ * @return The smallest one.
+ */
+double minNumber(const double* items, int count)
+{
+  auto result = items[0];
+  int i = 0;
+#ifdef NUM_ARRAY_SSE2
+  if (count >= 4) {
+    auto low = _mm_loadu_pd(items);
+    auto high = _mm_loadu_pd(items + 2);
+    for (i = 4; i + 4 <= count; i += 4) {
+      low = _mm_min_pd(low, _mm_loadu_pd(items + i));
+      high = _mm_min_pd(high, _mm_loadu_pd(items + i + 2));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_min_pd(low, high));
+    result = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+  }
+#endif
+  for (; i < count; i++) {
+    if (items[i] < result)
+      result = items[i];
+  }
+  return result;
+}
+
+/**
+ * @brief Returns the largest of `count` numbers.
+ *
+ * @param items The numbers, of which there is at least one.
+ * @param count The number of numbers.
+ * @return The largest one.
+ */
+double maxNumber(const double* items, int count)
+{
+  auto result = items[0];
+  int i = 0;
+#ifdef NUM_ARRAY_SSE2
+  if (count >= 4) {
+    auto low = _mm_loadu_pd(items);
+    auto high = _mm_loadu_pd(items + 2);
+    for (i = 4; i + 4 <= count; i += 4) {
+      low = _mm_max_pd(low, _mm_loadu_pd(items + i));
+      high = _mm_max_pd(high, _mm_loadu_pd(items + i + 2));
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, _mm_max_pd(low, high));
+    result = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+  }
+#endif
+  for (; i < count; i++) {
+    if (items[i] > result)
+      result = items[i];
+  }
+  return result;
+}
+
+/**
+ * @brief Returns the dot product of two runs of `count` numbers.
+ *
+ * Like `sumNumbers`, the products are added in no particular order.
+ *
+ * @param a The first numbers.
+ * @param b The second numbers.
+ * @param count The number of numbers in each.
+ * @return The sum of the products of the numbers in `a` and `b`.
+ */
+double dotNumbers(const double* a, const double* b, int count)
+{
+  double sum = 0;
+  int i = 0;
+#ifdef NUM_ARRAY_SSE2
+  auto low = _mm_setzero_pd();
+  auto high = _mm_setzero_pd();
+  for (; i + 4 <= count; i += 4) {
+    low = _mm_add_pd(low,
+                     _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    high = _mm_add_pd(
+        high, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(low, high));
+  sum = lanes[0] + lanes[1];
+#endif
+  for (; i < count; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+/**
+ * @brief Adds two runs of `count` numbers into a third one.
+ *
+ * @param result Where to store the sums, which may be `a` or `b`.
+ * @param a The first numbers.
+ * @param b The second numbers.
+ * @param count The number of numbers in each.
+ */
+void addNumbers(double* result, const double* a, const double* b, int count)
+{
+  int i = 0;
+#ifdef NUM_ARRAY_SSE2
+  for (; i + 2 <= count; i += 2) {
+    _mm_storeu_pd(result + i,
+                  _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+  }
+#endif
+  for (; i < count; i++) {
+    result[i] = a[i] + b[i];
+  }
+}
+
 // TODO: String Operator
 
 void appendToString(ObjString* string, Value value) {}
@@ -410,7 +1021,7 @@ void storeToString(ObjString* string, int index, ObjString* item)
 Value indexFromString(ObjString* string, int index)
 {
   auto val = string->chars[index];
-  return OBJ_VAL(copyString(&val, 1));
+  return OBJ_VAL(VM::getVM()->charStrings[(uint8_t)val]);
 }
 
 void deleteFromString(ObjString* string, int index) {}
@@ -1,6 +1,8 @@
 #ifndef clox_object_h
 #define clox_object_h
 
+#include <atomic>
+
 #include "chunk.hpp"
 #include "common.hpp"
 #include "table.hpp"
@@ -15,6 +17,9 @@
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
 #define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define IS_NUM_ARRAY(value) isObjType(value, OBJ_NUM_ARRAY)
+#define IS_UPVALUE(value) isObjType(value, OBJ_UPVALUE)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
@@ -25,6 +30,9 @@
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
 #define AS_LIST(value) ((ObjList*)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
+#define AS_NUM_ARRAY(value) ((ObjNumArray*)AS_OBJ(value))
+#define AS_UPVALUE(value) ((ObjUpvalue*)AS_OBJ(value))
 
 /**
  * @brief Enumeration representing object types in the virtual machine.
@@ -41,8 +49,12 @@
  * @value OBJ_NATIVE Represents a native function object.
  * @value OBJ_STRING Represents a string object.
  * @value OBJ_UPVALUE Represents an upvalue object.
+ * @value OBJ_LIST Represents a list object.
+ * @value OBJ_SHAPE Represents the field layout shared by instances.
+ * @value OBJ_ROPE Represents a concatenation of strings not yet copied.
+ * @value OBJ_NUM_ARRAY Represents an array of unboxed numbers.
  */
-typedef enum
+typedef enum : uint8_t
 {
   OBJ_BOUND_METHOD,
   OBJ_CLASS,
@@ -52,9 +64,17 @@ typedef enum
   OBJ_NATIVE,
   OBJ_STRING,
   OBJ_UPVALUE,
-  OBJ_LIST
+  OBJ_LIST,
+  OBJ_SHAPE,
+  OBJ_ROPE,
+  OBJ_NUM_ARRAY
 } ObjType;
 
+/**
+ * @brief The number of object types, for tables indexed by type.
+ */
+constexpr int OBJ_TYPE_COUNT = OBJ_NUM_ARRAY + 1;
+
 /**
  * @brief Base class for all objects in the virtual machine.
  *
@@ -66,17 +86,31 @@ class Obj
 public:
   /**
    * @brief The type of the object.
+   *
+   * The type and the collector's flags share the object's first word, and
+   * the collector keeps its lists of objects in arrays of its own, so that
+   * every object is one pointer smaller and subclasses start packing their
+   * fields right after these bytes.
    */
   ObjType type;
   /**
    * @brief A flag indicating whether the object is marked for garbage
    * collection.
+   *
+   * Atomic because collector threads may mark or sweep it while other threads
+   * read it. Relaxed accesses are enough, and compile to plain loads and
+   * stores. It has a byte of its own so that marking never races with
+   * writes to the other flags.
+   */
+  std::atomic<bool> isMarked;
+  /**
+   * @brief Whether the object survived a collection and left the nursery.
    */
-  bool isMarked;
+  bool isOld;
   /**
-   * @brief A pointer to the next object in the object list.
+   * @brief Whether the object is in the remembered set.
    */
-  Obj* next;
+  bool isRemembered;
 };
 
 /**
@@ -111,6 +145,12 @@ public:
   ObjUpvalue* next;
 };
 
+/**
+ * @brief The longest string whose characters are stored inline, right after
+ * its `ObjString`, instead of in a block of their own.
+ */
+constexpr int SMALL_STRING_LENGTH = 15;
+
 /**
  * @brief Represents a string object.
  *
@@ -126,6 +166,9 @@ public:
 
   /**
    * @brief A pointer to the characters of the string.
+   *
+   * Strings of up to `SMALL_STRING_LENGTH` characters point just past the
+   * object itself.
    */
   char* chars;
 
@@ -135,12 +178,80 @@ public:
   uint32_t hash;
 };
 
+/**
+ * @brief The longest concatenation that is copied right away. Longer ones
+ * build an `ObjRope`.
+ */
+constexpr int ROPE_MIN_LENGTH = 64;
+
+/**
+ * @brief Represents the concatenation of two strings that hasn't been copied
+ * yet.
+ *
+ * Both sides are strings or ropes, so building a string one piece at a time
+ * makes a tree instead of copying everything built so far. The rope is
+ * flattened into an interned string the first time its characters are needed,
+ * and stands for that string from then on.
+ */
+class ObjRope : public Obj
+{
+public:
+  /**
+   * @brief The length of the string in characters.
+   */
+  int length;
+
+  /**
+   * @brief The left side of the concatenation, or NULL once flattened.
+   */
+  Obj* left;
+
+  /**
+   * @brief The right side of the concatenation, or NULL once flattened.
+   */
+  Obj* right;
+
+  /**
+   * @brief The string the rope was flattened to, or NULL until it is.
+   */
+  ObjString* flat;
+};
+
 class ObjList : public Obj
 {
 public:
   int count;
   int capacity;
   Value* items;
+  // Items stored while the list was remembered, the only ones a minor
+  // collection has to scan.
+  int dirtyStart;
+  int dirtyEnd;
+};
+
+/**
+ * @brief Represents an array that only holds numbers.
+ *
+ * The numbers are stored as plain doubles, so the collector never has to scan
+ * them, and loops over them don't unbox every item.
+ */
+class ObjNumArray : public Obj
+{
+public:
+  /**
+   * @brief The number of items in the array.
+   */
+  int count;
+
+  /**
+   * @brief The number of items `items` has room for.
+   */
+  int capacity;
+
+  /**
+   * @brief The items of the array.
+   */
+  double* items;
 };
 
 /**
@@ -162,6 +273,12 @@ public:
    */
   int upvalueCount;
 
+  /**
+   * @brief The most stack slots a call to the function uses, counted from its
+   * callee slot, so that a call can make room for all of them first.
+   */
+  int maxSlots;
+
   /**
    * @brief The compiled bytecode for the function.
    */
@@ -187,9 +304,15 @@ public:
   ObjFunction* function;
 
   /**
-   * @brief An array of upvalues captured by the closure.
+   * @brief The variables captured by the closure, stored just past the
+   * object itself.
+   *
+   * A variable something assigns is shared through an `ObjUpvalue`. One that
+   * is only ever read is copied here by value, as it can't change after the
+   * closure is created. Scripts can't get hold of upvalues, so a value that
+   * is an upvalue is always a shared variable.
    */
-  ObjUpvalue** upvalues;
+  Value* upvalues;
 
   /**
    * @brief The number of upvalues in the closure.
@@ -197,6 +320,48 @@ public:
   int upvalueCount;
 };
 
+/**
+ * @brief Represents the field layout of a set of instances (a hidden class).
+ *
+ * Every class owns a root shape with no fields. Adding a field to an instance
+ * moves it along a transition to a child shape that has one more slot, so
+ * instances that receive the same fields in the same order share one shape
+ * and address their fields by slot index.
+ */
+class ObjShape : public Obj
+{
+public:
+  /**
+   * @brief The shape this one was derived from, NULL for a root shape.
+   */
+  ObjShape* parent;
+
+  /**
+   * @brief The field added by the transition from the parent.
+   */
+  ObjString* name;
+
+  /**
+   * @brief Unique id of the shape, used to key inline caches.
+   */
+  uint32_t id;
+
+  /**
+   * @brief The number of fields an instance of this shape has.
+   */
+  int fieldCount;
+
+  /**
+   * @brief Maps every field name of the shape to its slot number.
+   */
+  Table slots;
+
+  /**
+   * @brief Maps a field name to the child shape that adds it.
+   */
+  Table transitions;
+};
+
 /**
  * @brief Represents a class.
  *
@@ -214,12 +379,33 @@ public:
    * @brief A table of methods defined for the class.
    */
   Table methods;
+
+  /**
+   * @brief Identifies the current method table for inline caches.
+   *
+   * Every class gets a version no other class has used, and a fresh one each
+   * time its methods change, so cache entries recorded earlier stop matching.
+   */
+  uint32_t version;
+
+  /**
+   * @brief The field-less shape new instances start with.
+   */
+  ObjShape* shape;
+
+  /**
+   * @brief The most fields any instance of the class has had.
+   *
+   * New instances reserve this many slots up front.
+   */
+  int fieldHint;
 };
 
 /**
  * @brief Represents an instance of a class.
  *
- * Stores a reference to the class and a table of instance fields.
+ * Stores a reference to the class, the shape describing which fields the
+ * instance has, and the field values in slot order.
  */
 class ObjInstance : public Obj
 {
@@ -230,9 +416,19 @@ public:
   ObjClass* klass;
 
   /**
-   * @brief A table of instance fields.
+   * @brief The shape naming the slots in use.
+   */
+  ObjShape* shape;
+
+  /**
+   * @brief The field values, indexed by the slot numbers of the shape.
+   */
+  Value* fields;
+
+  /**
+   * @brief The number of slots allocated in `fields`.
    */
-  Table fields;
+  int fieldCapacity;
 };
 
 /**
@@ -342,6 +538,27 @@ ObjNative* newNative(NativeFn function);
 
 ObjList* newList();
 
+/**
+ * @brief Creates a new rope concatenating two strings or ropes.
+ *
+ * @param left The left side, which must be a string or a rope.
+ * @param right The right side, which must be a string or a rope.
+ * @param length The length of the concatenation.
+ * @return A pointer to the newly created rope object.
+ */
+ObjRope* newRope(Obj* left, Obj* right, int length);
+
+/**
+ * @brief Returns the interned string a rope stands for.
+ *
+ * Copies the pieces of the rope into one string the first time it is called
+ * and remembers the result. This can collect, so the rope must be reachable.
+ *
+ * @param rope The rope to flatten.
+ * @return The string with the characters of the rope.
+ */
+ObjString* flattenRope(ObjRope* rope);
+
 /**
  * @brief Creates a new closure object.
  *
@@ -372,6 +589,51 @@ ObjUpvalue* newUpvalue(Value* slot);
  */
 ObjInstance* newInstance(ObjClass* klass);
 
+/**
+ * @brief Looks up the slot of a field in a shape.
+ *
+ * @param shape The shape to search.
+ * @param name The name of the field.
+ * @return The slot of the field, or -1 if the shape doesn't have it.
+ */
+int findShapeSlot(ObjShape* shape, ObjString* name);
+
+/**
+ * @brief Returns the shape reached by adding a field to a shape.
+ *
+ * Reuses an existing transition when one was taken before, otherwise creates
+ * the child shape and records the transition.
+ *
+ * @param shape The shape to extend.
+ * @param name The name of the new field.
+ * @return The child shape, whose last slot holds the new field.
+ */
+ObjShape* transitionShape(ObjShape* shape, ObjString* name);
+
+/**
+ * @brief Moves an instance to a shape with more fields.
+ *
+ * Grows the field array when the new shape needs more slots than are
+ * allocated. New slots are initialised to nil.
+ *
+ * @param instance The instance to update.
+ * @param shape The shape reached through `transitionShape`.
+ */
+void setInstanceShape(ObjInstance* instance, ObjShape* shape);
+
+/**
+ * @brief Sets a field of an instance, adding it to the instance's shape if
+ * the shape doesn't have it yet.
+ *
+ * This can collect, so the instance, the name and the value must be
+ * reachable.
+ *
+ * @param instance The instance to update.
+ * @param name The name of the field.
+ * @param value The new value of the field.
+ */
+void setInstanceField(ObjInstance* instance, ObjString* name, Value value);
+
 /**
  * @brief Creates a new bound method object.
  *
@@ -393,6 +655,14 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
  */
 void printObject(Value value);
 
+/**
+ * @brief Returns the name of an object type, for statistics.
+ *
+ * @param type The object type.
+ * @return The name of the type, in lower case.
+ */
+const char* objTypeName(ObjType type);
+
 // List functionality
 void appendToList(ObjList* list, Value value);
 
@@ -402,8 +672,76 @@ Value indexFromList(ObjList* list, int index);
 
 void deleteFromList(ObjList* list, int index);
 
+/**
+ * @brief Makes room for at least `capacity` items in a list.
+ *
+ * This can collect, so the list must be reachable.
+ */
+void reserveList(ObjList* list, int capacity);
+
+/**
+ * @brief Appends the items `start` to `end` of a list to another, or the same,
+ * list.
+ *
+ * This can collect, so both lists must be reachable.
+ */
+void extendList(ObjList* list, ObjList* from, int start, int end);
+
+/**
+ * @brief Deletes the items `start` to `end` of a list, shifting the ones after
+ * them down at once.
+ */
+void deleteRangeFromList(ObjList* list, int start, int end);
+
 bool isValidListIndex(ObjList* list, int index);
 
+// Number array functionality
+
+/**
+ * @brief Creates a new number array.
+ *
+ * @param count The number of items in the array.
+ * @param fill The value of every item.
+ * @return A pointer to the newly created number array.
+ */
+ObjNumArray* newNumArray(int count, double fill);
+
+void appendToNumArray(ObjNumArray* array, double value);
+
+bool isValidNumArrayIndex(ObjNumArray* array, int index);
+
+/**
+ * @brief Sets `count` numbers to a value.
+ */
+void fillNumbers(double* items, int count, double value);
+
+/**
+ * @brief Returns the sum of `count` numbers, added in no particular order.
+ */
+double sumNumbers(const double* items, int count);
+
+/**
+ * @brief Returns the smallest of `count` numbers, of which there is at least
+ * one.
+ */
+double minNumber(const double* items, int count);
+
+/**
+ * @brief Returns the largest of `count` numbers, of which there is at least
+ * one.
+ */
+double maxNumber(const double* items, int count);
+
+/**
+ * @brief Returns the dot product of two runs of `count` numbers.
+ */
+double dotNumbers(const double* a, const double* b, int count);
+
+/**
+ * @brief Adds two runs of `count` numbers into a third one.
+ */
+void addNumbers(double* result, const double* a, const double* b, int count);
+
 // String functionality
 void appendToString(ObjString* string, Value value);
 
@@ -0,0 +1,143 @@
+#include "output.hpp"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <mutex>
+
+#include "common.hpp"
+
+#if OUTPUT_BUFFER_SIZE > 0
+/**
+ * @brief The buffer stdout writes through.
+ *
+ * Static so that it outlives the VM, as stdout is flushed after `main`
+ * returns.
+ */
+static char outputBuffer[OUTPUT_BUFFER_SIZE];
+#endif
+
+void initOutput()
+{
+#if OUTPUT_BUFFER_SIZE > 0
+  // Every VM initialises it, possibly on several threads at once.
+  static std::once_flag buffered;
+  std::call_once(buffered,
+                 []() {
+                   setvbuf(stdout, outputBuffer, _IOFBF, OUTPUT_BUFFER_SIZE);
+                 });
+#endif
+}
+
+void writeOutput(const char* chars, size_t length)
+{
+  fwrite(chars, 1, length, stdout);
+}
+
+void writeOutput(const char* chars)
+{
+  fputs(chars, stdout);
+}
+
+/**
+ * @brief Writes the digits of `value` to the end of `buffer`.
+ *
+ * @return The number of digits written.
+ */
+static int formatDigits(uint64_t value, char* buffer)
+{
+  char digits[20];
+  auto count = 0;
+  do {
+    digits[count++] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+  for (int i = 0; i < count; i++)
+    buffer[i] = digits[count - 1 - i];
+  return count;
+}
+
+/**
+ * @brief Formats a number the way `%g` does.
+ *
+ * Integers below a million and numbers with six significant digits that don't
+ * need an exponent are formatted directly. Everything else, and numbers too
+ * close to halfway between two roundings to round safely in a double, goes
+ * through `snprintf`.
+ *
+ * @param number The number to format.
+ * @param buffer Where to write it, with room for at least 32 characters.
+ * @return The number of characters written.
+ */
+static int formatNumber(double number, char* buffer)
+{
+  static const double powers[] = {
+      1e-4, 1e-3, 1e-2, 1e-1, 1e0, 1e1, 1e2, 1e3, 1e4, 1e5};
+  auto magnitude = fabs(number);
+  auto length = 0;
+
+  // Truncating never rounds a positive number up, so one that isn't above its
+  // truncation is whole. Comparing that way keeps -Wfloat-equal quiet.
+  if (magnitude < 1e6 && !(magnitude > trunc(magnitude))) {
+    if (signbit(number))
+      buffer[length++] = '-';
+    return length + formatDigits((uint64_t)magnitude, buffer + length);
+  }
+
+  if (magnitude >= 1e-4 && magnitude < 1e6) {
+    auto exponent = 5;
+    while (magnitude < powers[exponent + 4])
+      exponent--;
+
+    // Scaling by an exact power of ten is off by far less than 1e-7.
+    static const double scales[] = {
+        1e9, 1e8, 1e7, 1e6, 1e5, 1e4, 1e3, 1e2, 1e1, 1e0};
+    auto scaled = magnitude * scales[exponent + 4];
+    auto fraction = scaled - floor(scaled);
+    auto rounded = nearbyint(scaled);
+    if (fabs(fraction - 0.5) > 1e-7 && rounded >= 1e5 && rounded < 1e6) {
+      char digits[6];
+      formatDigits((uint64_t)rounded, digits);
+      auto significant = 6;
+      while (digits[significant - 1] == '0')
+        significant--;
+
+      if (signbit(number))
+        buffer[length++] = '-';
+      if (exponent < 0) {
+        buffer[length++] = '0';
+        buffer[length++] = '.';
+        for (int i = -1; i > exponent; i--)
+          buffer[length++] = '0';
+        memcpy(buffer + length, digits, significant);
+        return length + significant;
+      }
+      memcpy(buffer + length, digits, exponent + 1);
+      length += exponent + 1;
+      if (significant > exponent + 1) {
+        buffer[length++] = '.';
+        memcpy(buffer + length,
+               digits + exponent + 1,
+               significant - exponent - 1);
+        length += significant - exponent - 1;
+      }
+      return length;
+    }
+  }
+
+  return snprintf(buffer, 32, "%g", number);
+}
+
+void writeNumber(double number)
+{
+  char buffer[32];
+  auto length = formatNumber(number, buffer);
+  fwrite(buffer, 1, length, stdout);
+}
+
+void flushOutput()
+{
+  fflush(stdout);
+}
@@ -0,0 +1,42 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include <stddef.h>
+
+/**
+ * @brief Gives stdout a buffer of `OUTPUT_BUFFER_SIZE` bytes.
+ *
+ * Stdout is then fully buffered even on a terminal, so it has to be flushed
+ * before anything waits on the user. Does nothing after the first call, or
+ * when `OUTPUT_BUFFER_SIZE` is 0.
+ */
+void initOutput();
+
+/**
+ * @brief Writes characters to stdout as they are, without a format string.
+ *
+ * @param chars The characters to write.
+ * @param length The number of characters.
+ */
+void writeOutput(const char* chars, size_t length);
+
+/**
+ * @brief Writes a null-terminated string to stdout.
+ *
+ * @param chars The string to write.
+ */
+void writeOutput(const char* chars);
+
+/**
+ * @brief Writes a number to stdout the way `printf("%g")` does.
+ *
+ * @param number The number to write.
+ */
+void writeNumber(double number);
+
+/**
+ * @brief Writes everything buffered for stdout.
+ */
+void flushOutput();
+
+#endif
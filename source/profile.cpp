@@ -0,0 +1,155 @@
+#include "profile.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "debug.hpp"
+#include "object.hpp"
+#include "vm.hpp"
+
+#ifdef PROFILE_RDTSC
+static const char* const CLOCK_UNIT = "cycles";
+#else
+static const char* const CLOCK_UNIT = "ns";
+#endif
+
+/**
+ * @brief The most functions and lines the report lists.
+ */
+constexpr size_t REPORT_ROWS = 20;
+
+Profile::Profile()
+{
+  for (int i = 0; i < OP_COUNT; i++) {
+    this->counts[i] = 0;
+    this->ticks[i] = 0;
+  }
+  this->sampleCount = 0;
+  this->lastInstruction = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  auto startTicks = profileClock();
+  while (std::chrono::steady_clock::now() - start
+         < std::chrono::milliseconds(1))
+  {
+  }
+  this->last = profileClock();
+  this->sampleTicks = std::max<uint64_t>(this->last - startTicks, 1);
+  this->nextSample = this->last + this->sampleTicks;
+}
+
+void Profile::sample(VM* vm, const uint8_t* ip)
+{
+  this->nextSample = this->last + this->sampleTicks;
+  this->sampleCount++;
+
+  std::string stack;
+  std::string function;
+  std::string frameName;
+  for (int i = 0; i < vm->frameCount; i++) {
+    auto frame = &vm->frames[i];
+    auto chunk = &frame->closure->function->chunk;
+    auto name = frame->closure->function->name;
+    // Outer frames are stopped just after the call they are making.
+    auto offset = i == vm->frameCount - 1 ? ip - chunk->code
+                                          : frame->ip - chunk->code - 1;
+
+    function = name == NULL ? std::string("<script>")
+                            : std::string(name->chars, name->length);
+    frameName = function + ":" + std::to_string(chunk->getLine((int)offset));
+    if (i > 0)
+      stack += ';';
+    stack += frameName;
+  }
+  this->stacks[stack]++;
+  this->functions[function]++;
+  this->lines[frameName]++;
+}
+
+/**
+ * @brief Prints the entries with the most samples, most first.
+ */
+static void reportSamples(FILE* out,
+                          const char* title,
+                          const std::map<std::string, uint64_t>& samples,
+                          uint64_t total)
+{
+  std::vector<std::pair<std::string, uint64_t>> rows(samples.begin(),
+                                                     samples.end());
+  std::stable_sort(rows.begin(),
+                   rows.end(),
+                   [](const std::pair<std::string, uint64_t>& a,
+                      const std::pair<std::string, uint64_t>& b)
+                   { return a.second > b.second; });
+
+  fprintf(out, "\n%10s %7s  %s\n", "samples", "share", title);
+  for (size_t i = 0; i < rows.size() && i < REPORT_ROWS; i++) {
+    fprintf(out,
+            "%10llu %6.2f%%  %s\n",
+            (unsigned long long)rows[i].second,
+            100.0 * (double)rows[i].second / (double)total,
+            rows[i].first.c_str());
+  }
+}
+
+void Profile::report(FILE* out)
+{
+  std::vector<int> opcodes;
+  uint64_t totalCount = 0;
+  uint64_t totalTicks = 0;
+  for (int i = 0; i < OP_COUNT; i++) {
+    if (this->counts[i] == 0)
+      continue;
+    opcodes.push_back(i);
+    totalCount += this->counts[i];
+    totalTicks += this->ticks[i];
+  }
+  std::stable_sort(opcodes.begin(),
+                   opcodes.end(),
+                   [this](int a, int b)
+                   { return this->ticks[a] > this->ticks[b]; });
+
+  fprintf(out,
+          "%-22s %14s %16s %10s %7s\n",
+          "opcode",
+          "count",
+          CLOCK_UNIT,
+          "per op",
+          "share");
+  for (auto opcode : opcodes) {
+    fprintf(out,
+            "%-22s %14llu %16llu %10.1f %6.2f%%\n",
+            opcodeName(opcode),
+            (unsigned long long)this->counts[opcode],
+            (unsigned long long)this->ticks[opcode],
+            (double)this->ticks[opcode] / (double)this->counts[opcode],
+            totalTicks == 0
+                ? 0.0
+                : 100.0 * (double)this->ticks[opcode] / (double)totalTicks);
+  }
+  fprintf(out,
+          "%-22s %14llu %16llu\n",
+          "total",
+          (unsigned long long)totalCount,
+          (unsigned long long)totalTicks);
+
+  if (this->sampleCount == 0)
+    return;
+  reportSamples(out, "function", this->functions, this->sampleCount);
+  reportSamples(out, "line", this->lines, this->sampleCount);
+}
+
+bool Profile::writeStacks(const char* path)
+{
+  auto file = fopen(path, "w");
+  if (file == NULL)
+    return false;
+  for (auto& stack : this->stacks) {
+    fprintf(file,
+            "%s %llu\n",
+            stack.first.c_str(),
+            (unsigned long long)stack.second);
+  }
+  return fclose(file) == 0;
+}
@@ -0,0 +1,149 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <string>
+
+#include "chunk.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#  define PROFILE_RDTSC
+#elif defined(_M_X64) || defined(_M_IX86)
+#  include <intrin.h>
+#  define PROFILE_RDTSC
+#else
+#  include <chrono>
+#endif
+
+class VM;
+
+/**
+ * @brief Reads the clock instructions are timed with: the time stamp counter
+ * on x86, nanoseconds elsewhere.
+ */
+inline uint64_t profileClock()
+{
+#ifdef PROFILE_RDTSC
+  return __rdtsc();
+#else
+  auto now = std::chrono::steady_clock::now().time_since_epoch();
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now)
+      .count();
+#endif
+}
+
+/**
+ * @brief What `--profile` records while a script runs.
+ *
+ * The VM only calls into the profile from the instantiation of its dispatch
+ * loop made for profiling, so a run without `--profile` doesn't pay for it.
+ */
+class Profile
+{
+public:
+  /**
+   * @brief How many times each opcode was dispatched.
+   */
+  uint64_t counts[OP_COUNT];
+
+  /**
+   * @brief The clock ticks from dispatching each opcode to dispatching the
+   * next instruction, natives and collections included.
+   */
+  uint64_t ticks[OP_COUNT];
+
+  /**
+   * @brief The clock reading at the last dispatch.
+   */
+  uint64_t last;
+
+  /**
+   * @brief The opcode dispatched last.
+   */
+  int lastInstruction;
+
+  /**
+   * @brief The clock reading after which the next dispatch takes a sample.
+   */
+  uint64_t nextSample;
+
+  /**
+   * @brief The clock ticks between samples, about a millisecond.
+   */
+  uint64_t sampleTicks;
+
+  /**
+   * @brief The samples taken.
+   */
+  uint64_t sampleCount;
+
+  /**
+   * @brief Samples per call stack, as `outer:line;inner:line`.
+   */
+  std::map<std::string, uint64_t> stacks;
+
+  /**
+   * @brief Samples per innermost function.
+   */
+  std::map<std::string, uint64_t> functions;
+
+  /**
+   * @brief Samples per innermost function and line, as `function:line`.
+   */
+  std::map<std::string, uint64_t> lines;
+
+  /**
+   * @brief Starts an empty profile, timing the clock for a millisecond to
+   * find the sample interval.
+   */
+  Profile();
+
+  /**
+   * @brief Counts an instruction about to be dispatched and charges the time
+   * since the last dispatch to the previous one.
+   *
+   * @param instruction The opcode about to run.
+   * @return `true` if it is time to take a sample.
+   */
+  inline bool countInstruction(uint8_t instruction)
+  {
+    auto now = profileClock();
+    this->ticks[this->lastInstruction] += now - this->last;
+    this->counts[instruction]++;
+    this->last = now;
+    this->lastInstruction = instruction;
+    return now >= this->nextSample;
+  }
+
+  /**
+   * @brief Records the VM's call stack.
+   *
+   * @param vm The VM, with every frame but the innermost one stored.
+   * @param ip The innermost frame's instruction pointer, which the dispatch
+   * loop keeps to itself.
+   */
+  void sample(VM* vm, const uint8_t* ip);
+
+  /**
+   * @brief Prints the opcode histogram and the functions and lines the
+   * samples landed in.
+   *
+   * @param out Where to print the report.
+   */
+  void report(FILE* out);
+
+  /**
+   * @brief Writes the samples in collapsed stack format, one stack and its
+   * count per line, as flame graph tools read.
+   *
+   * @param path The file to write.
+   * @return `true` if the file was written, `false` otherwise.
+   */
+  bool writeStacks(const char* path);
+};
+
+#endif
@@ -1,5 +1,6 @@
 #include "scanner.hpp"
 
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -12,25 +13,27 @@
  * positions of the source code, as well as the initial line number.
  *
  * @param source The source code to be scanned.
+ * @param length The number of characters in the source code.
  */
-void Scanner::initScanner(const char* source)
+void Scanner::initScanner(const char* source, size_t length)
 {
   this->start = source;
   this->current = source;
+  this->end = source + length;
   this->line = 1;
 }
 
 /**
- * @brief Retrieves the singleton scanner instance.
+ * @brief Retrieves the calling thread's scanner.
  *
- * This static method returns a reference to the globally accessible scanner
- * object.
+ * Each thread has its own, so that threads can compile at the same time.
  *
  * @return A pointer to the scanner instance.
  */
 Scanner* Scanner::getScanner()
 {
-  return Scanner::scanner;
+  static thread_local Scanner scanner;
+  return &scanner;
 }
 
 /**
@@ -157,14 +160,14 @@ TokenType Scanner::identifierType()
 /**
  * @brief  Checks if the scanner has reached the end of the input.
  *
- * Determines whether the current character pointer has reached the null
- * terminator of the source code.
+ * Determines whether the current character pointer has reached the end of the
+ * source code.
  *
  * @return `true` if the end of the input has been reached, `false` otherwise.
  */
 bool Scanner::isAtEnd()
 {
-  return *(this->current) == '\0';
+  return this->current >= this->end;
 }
 
 /**
@@ -191,7 +194,7 @@ char Scanner::advance()
  */
 char Scanner::peekNext()
 {
-  if (isAtEnd())
+  if (this->end - this->current < 2)
     return '\0';
   return this->current[1];
 }
@@ -242,10 +245,13 @@ bool Scanner::match(char expected)
 /**
  * @brief Returns the current character without advancing the scanner.
  *
- * @return The current character.
+ * @return The current character, or the null character at the end of the
+ * input.
  */
 char Scanner::peek()
 {
+  if (isAtEnd())
+    return '\0';
   return *this->current;
 }
 
@@ -429,6 +435,4 @@ Token Scanner::errorToken(const char* message)
   token.length = (int)strlen(message);
   token.line = this->line;
   return token;
-}
-
-Scanner* Scanner::scanner = new Scanner;
\ No newline at end of file
+}
\ No newline at end of file
@@ -1,6 +1,8 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include <stddef.h>
+
 /**
  * @brief Enumeration representing token types used by the scanner.
  *
@@ -91,13 +93,9 @@ class Scanner
   /**
    * @brief Default constructor (private to prevent direct instantiation).
    */
-  Scanner() {}
+  Scanner() = default;
 
 public:
-  /**
-   * @brief The singleton scanner instance.
-   */
-  static Scanner* scanner;
 
   /**
    * @brief Pointer to the beginning of the current token.
@@ -109,6 +107,11 @@ public:
    */
   const char* current;
 
+  /**
+   * @brief Pointer just past the last character of the source code.
+   */
+  const char* end;
+
   /**
    * @brief Current line number.
    */
@@ -117,9 +120,13 @@ public:
   /**
    * @brief Initializes the scanner with the given source code.
    *
+   * The source doesn't need to be null-terminated, so it can be scanned
+   * straight out of a mapped file.
+   *
    * @param source The source code to be scanned.
+   * @param length The number of characters in the source code.
    */
-  void initScanner(const char* source);
+  void initScanner(const char* source, size_t length);
 
   /**
    * Scans the next token from the input stream.
@@ -133,7 +140,7 @@ public:
   Token scanToken();
 
   /**
-   * @brief Gets the singleton scanner instance.
+   * @brief Gets the calling thread's scanner.
    *
    * @return A pointer to the scanner instance.
    */
@@ -142,8 +149,8 @@ public:
   /**
    * @brief Checks if the scanner has reached the end of the input.
    *
-   * Determines whether the current character pointer has reached the null
-   * terminator of the source code.
+   * Determines whether the current character pointer has reached the end of
+   * the source code.
    *
    * @return `true` if the end of the input has been reached, `false` otherwise.
    */
@@ -203,7 +210,8 @@ public:
   /**
    * @brief Returns the current character without advancing the scanner.
    *
-   * @return The current character.
+   * @return The current character, or the null character at the end of the
+   * input.
    */
   char peek();
 
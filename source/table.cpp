@@ -7,9 +7,13 @@
 #include "object.hpp"
 #include "value.hpp"
 
-#ifdef ENABLE_MP
-#  include <omp.h>
-#  include <stdlib.h>
+#if defined(__SSE2__) || defined(_M_X64) \
+    || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define TABLE_SSE2
+#elif defined(__ARM_NEON)
+#  include <arm_neon.h>
+#  define TABLE_NEON
 #endif
 
 /**
@@ -24,89 +28,185 @@
 constexpr double TABLE_MAX_LOAD = 0.75;
 
 /**
- * @brief Initializes an empty table.
+ * @brief Number of control bytes a probe compares at once.
+ */
+constexpr int TABLE_GROUP_SIZE = 16;
+
+/**
+ * @brief Control byte of an entry that never held a key.
+ */
+constexpr uint8_t CONTROL_EMPTY = 0x80;
+
+/**
+ * @brief Control byte of a deleted entry, a tombstone.
+ */
+constexpr uint8_t CONTROL_DELETED = 0xFE;
+
+/**
+ * @brief Control byte padding tables smaller than a group, never matched.
+ */
+constexpr uint8_t CONTROL_SENTINEL = 0xFF;
+
+/**
+ * @brief Bits per control byte in the masks returned by `matchGroup`.
+ */
+#ifdef TABLE_NEON
+constexpr int MATCH_STRIDE = 4;
+#else
+constexpr int MATCH_STRIDE = 1;
+#endif
+
+/**
+ * @brief Returns the number of control bytes of a table.
  *
- * Resets the table's internal state, setting the count and capacity to zero and
- * the entries array to null.
+ * @param capacity The capacity of the table.
+ * @return The capacity, rounded up to a whole group.
  */
-void Table::initTable()
+static int controlSize(int capacity)
 {
-  this->count = 0;
-  this->capacity = 0;
-  this->entries = NULL;
+  if (capacity == 0)
+    return 0;
+  return capacity < TABLE_GROUP_SIZE ? TABLE_GROUP_SIZE : capacity;
 }
 
 /**
- * @brief Finds an entry in a hash table.
- *
- * Searches for an entry with the given key within the specified hash table.
- * Handles collisions using linear probing. Returns a pointer to the found
- * entry, or a suitable empty or tombstone entry if not found.
+ * @brief Returns the control byte of a key.
  *
- * @param entries The array of hash table entries.
- * @param capacity The capacity of the hash table.
- * @param key The key to search for.
- * @return A pointer to the found entry, or an empty or tombstone entry if not
- * found.
+ * @param hash The hash of the key.
+ * @return The low 7 bits of the hash.
  */
+static uint8_t hashFragment(uint32_t hash)
+{
+  return hash & 0x7F;
+}
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key)
+/**
+ * @brief Finds the control bytes of a group that are equal to a byte.
+ *
+ * @param group The first control byte of the group.
+ * @param byte The byte to look for.
+ * @return A mask with one bit set, every `MATCH_STRIDE` bits, for each control
+ * byte that matched.
+ */
+static uint64_t matchGroup(const uint8_t* group, uint8_t byte)
 {
-  uint32_t index = key->hash & (capacity - 1);
-  Entry* tombstone = NULL;
-  Entry* res = NULL;
-#ifdef ENABLE_MP
-
-#  pragma omp parallel num_threads(4) default(none) firstprivate(index) \
-      shared(tombstone, res, entries, capacity, key)
-  for (int thread_id = omp_get_thread_num();;
-       index = (index + 4) & (capacity - 1))
-  {
-    auto search_id = (index + thread_id) & (capacity - 1);
-    Entry* entry = &entries[search_id];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        // Empty entry.
-        if (tombstone != NULL) {
-          res = tombstone;
-        } else {
-          res = entry;
-        }
-#  pragma omp cancel parallel
-      } else {
-        // We found a tombstone
-        if (tombstone == NULL)
-          tombstone = entry;
-      }
-    } else if (entry->key == key) {
-      // We found the key.
-      res = entry;
-#  pragma omp cancel parallel
-    }
-#  pragma omp cancellation point parallel
+#if defined(TABLE_SSE2)
+  auto controls = _mm_loadu_si128((const __m128i*)group);
+  auto equal = _mm_cmpeq_epi8(controls, _mm_set1_epi8((char)byte));
+  return (uint32_t)_mm_movemask_epi8(equal);
+#elif defined(TABLE_NEON)
+  // NEON has no movemask, so narrow every byte of the comparison to a nibble.
+  auto equal = vceqq_u8(vld1q_u8(group), vdupq_n_u8(byte));
+  auto nibbles = vshrn_n_u16(vreinterpretq_u16_u8(equal), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & 0x8888888888888888;
+#else
+  uint64_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+    if (group[i] == byte)
+      mask |= (uint64_t)1 << i;
   }
-  return res;
+  return mask;
+#endif
+}
+
+/**
+ * @brief Returns the index in its group of the first control byte of a mask.
+ *
+ * @param mask A non-zero mask returned by `matchGroup`.
+ * @return The index of the lowest matching control byte.
+ */
+static int firstMatch(uint64_t mask)
+{
+#ifdef __GNUC__
+  return __builtin_ctzll(mask) / MATCH_STRIDE;
 #else
-  for (;;) {
-    Entry* entry = &entries[index];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        // Empty entry.
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        // We found a tombstone.
-        if (tombstone == NULL)
-          tombstone = entry;
-      }
-    } else if (entry->key == key) {
-      // We found the key.
-      return entry;
-    }
-    index = (index + 1) & (capacity - 1);
+  int index = 0;
+  while ((mask & 1) == 0) {
+    mask >>= 1;
+    index++;
   }
+  return index / MATCH_STRIDE;
 #endif
 }
 
+/**
+ * @brief Finds a key in a table.
+ *
+ * Groups are probed in triangular order until the key's control byte matches
+ * an entry holding the key, or the group has an empty entry.
+ *
+ * @param table The table to search.
+ * @param key The key to search for.
+ * @return The index of the key's entry, or -1 if the key isn't in the table.
+ */
+static int findSlot(const Table* table, ObjString* key)
+{
+  uint32_t groupMask = (table->capacity - 1) / TABLE_GROUP_SIZE;
+  uint32_t group = (key->hash >> 7) & groupMask;
+  auto fragment = hashFragment(key->hash);
+  for (uint32_t step = 1;; step++) {
+    auto controls = &table->control[group * TABLE_GROUP_SIZE];
+    for (auto match = matchGroup(controls, fragment); match != 0;
+         match &= match - 1) {
+      auto slot = group * TABLE_GROUP_SIZE + firstMatch(match);
+      if (table->entries[slot].key == key)
+        return slot;
+    }
+    if (matchGroup(controls, CONTROL_EMPTY) != 0)
+      return -1;
+    group = (group + step) & groupMask;
+  }
+}
+
+/**
+ * @brief Finds where to insert a key that isn't in a table.
+ *
+ * @param control The control bytes of the table.
+ * @param capacity The capacity of the table.
+ * @param hash The hash of the key.
+ * @return The index of the first empty or deleted entry on the key's probe
+ * sequence.
+ */
+static int findInsertSlot(const uint8_t* control, int capacity, uint32_t hash)
+{
+  uint32_t groupMask = (capacity - 1) / TABLE_GROUP_SIZE;
+  uint32_t group = (hash >> 7) & groupMask;
+  for (uint32_t step = 1;; step++) {
+    auto controls = &control[group * TABLE_GROUP_SIZE];
+    auto free = matchGroup(controls, CONTROL_EMPTY)
+        | matchGroup(controls, CONTROL_DELETED);
+    if (free != 0)
+      return group * TABLE_GROUP_SIZE + firstMatch(free);
+    group = (group + step) & groupMask;
+  }
+}
+
+/**
+ * @brief Checks whether an entry holds a key.
+ *
+ * @param control The control byte of the entry.
+ * @return `true` for a full entry, `false` for an empty or deleted one.
+ */
+static bool isFull(uint8_t control)
+{
+  return control < CONTROL_EMPTY;
+}
+
+/**
+ * @brief Initializes an empty table.
+ *
+ * Resets the table's internal state, setting the count and capacity to zero and
+ * the entries array to null.
+ */
+void Table::initTable()
+{
+  this->count = 0;
+  this->capacity = 0;
+  this->entries = NULL;
+  this->control = NULL;
+  this->owner = NULL;
+}
+
 /**
  * @brief Resizes the hash table to the specified capacity.
  *
@@ -119,26 +219,49 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key)
 void Table::adjustCapacity(int capacity)
 {
   Entry* entries = ALLOCATE<Entry>(capacity);
-  for (int i = 0; i < capacity; i++) {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
-  }
+  auto control = ALLOCATE<uint8_t>(controlSize(capacity));
+  memset(control, CONTROL_SENTINEL, controlSize(capacity));
+  memset(control, CONTROL_EMPTY, capacity);
   this->count = 0;
   for (int i = 0; i < this->capacity; i++) {
-    Entry* entry = &this->entries[i];
-    if (entry->key == NULL)
+    if (!isFull(this->control[i]))
       continue;
 
-    Entry* dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
+    Entry* entry = &this->entries[i];
+    auto slot = findInsertSlot(control, capacity, entry->key->hash);
+    control[slot] = this->control[i];
+    entries[slot] = *entry;
     this->count++;
   }
   FREE_ARRAY<Entry>(this->entries, this->capacity);
+  FREE_ARRAY<uint8_t>(this->control, controlSize(this->capacity));
   this->entries = entries;
+  this->control = control;
   this->capacity = capacity;
 }
 
+/**
+ * @brief Deletes the entry at an index.
+ *
+ * The entry becomes empty again if its group has an empty entry, since no
+ * probe ever went past that group then. Otherwise it becomes a tombstone.
+ *
+ * @param table The table to delete from.
+ * @param slot The index of a full entry.
+ */
+static void deleteSlot(Table* table, int slot)
+{
+  auto group = &table->control[slot - slot % TABLE_GROUP_SIZE];
+  if (matchGroup(group, CONTROL_EMPTY) != 0) {
+    table->control[slot] = CONTROL_EMPTY;
+    table->count--;
+  } else {
+    table->control[slot] = CONTROL_DELETED;
+  }
+  table->entries[slot].key = NULL;
+  table->entries[slot].value = NIL_VAL;
+}
+
 /**
  * @brief Frees the memory allocated for the hash table.
  *
@@ -148,6 +271,7 @@ void Table::adjustCapacity(int capacity)
 void Table::freeTable()
 {
   FREE_ARRAY<Entry>(this->entries, this->capacity);
+  FREE_ARRAY<uint8_t>(this->control, controlSize(this->capacity));
   this->initTable();
 }
 
@@ -168,15 +292,23 @@ bool Table::tableSet(ObjString* key, Value value)
     int capacity = GROW_CAPACITY(this->capacity);
     adjustCapacity(capacity);
   }
-  Entry* entry = findEntry(this->entries, this->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  if (isNewKey && IS_NIL(entry->value))
-    this->count++;
-  if (isNewKey)
-    this->count++;
+  auto slot = findSlot(this, key);
+  bool isNewKey = slot < 0;
+  if (isNewKey) {
+    slot = findInsertSlot(this->control, this->capacity, key->hash);
+    // Reusing a tombstone doesn't change the count.
+    if (this->control[slot] == CONTROL_EMPTY)
+      this->count++;
+    this->control[slot] = hashFragment(key->hash);
+  }
 
+  Entry* entry = &this->entries[slot];
   entry->key = key;
   entry->value = value;
+  if (this->owner != NULL) {
+    writeBarrier(this->owner, OBJ_VAL(key));
+    writeBarrier(this->owner, value);
+  }
   return isNewKey;
 }
 
@@ -197,11 +329,11 @@ bool Table::tableGet(ObjString* key, Value* value)
   if (this->count == 0)
     return false;
 
-  Entry* entry = findEntry(this->entries, this->capacity, key);
-  if (entry->key == NULL)
+  auto slot = findSlot(this, key);
+  if (slot < 0)
     return false;
 
-  *value = entry->value;
+  *value = this->entries[slot].value;
   return true;
 }
 
@@ -221,13 +353,11 @@ bool Table::tableDelete(ObjString* key)
     return false;
 
   // Find the entry.
-  Entry* entry = findEntry(this->entries, this->capacity, key);
-  if (entry->key == NULL)
+  auto slot = findSlot(this, key);
+  if (slot < 0)
     return false;
 
-  // Place a tombstone in the entry.
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  deleteSlot(this, slot);
   return true;
 }
 
@@ -235,7 +365,7 @@ bool Table::tableDelete(ObjString* key)
  * @brief Finds a string in the hash table.
  *
  * Searches the hash table for a string with the given characters, length, and
- * hash value. Uses linear probing to handle collisions.
+ * hash value, probing the same groups as a lookup of the string would.
  *
  * @param chars The characters of the string to find.
  * @param length The length of the string.
@@ -247,21 +377,23 @@ ObjString* Table::tableFindString(const char* chars, int length, uint32_t hash)
   if (this->count == 0)
     return NULL;
 
-  uint32_t index = hash & (this->capacity - 1);
-  for (;;) {
-    Entry* entry = &this->entries[index];
-    if (entry->key == NULL) {
-      // Stop if we find an empty non-tombstone entry.
-      if (IS_NIL(entry->value))
-        return NULL;
-    } else if (entry->key->length == length && entry->key->hash == hash
-               && memcmp(entry->key->chars, chars, length) == 0)
-    {
-      // We found it.
-      return entry->key;
+  uint32_t groupMask = (this->capacity - 1) / TABLE_GROUP_SIZE;
+  uint32_t group = (hash >> 7) & groupMask;
+  auto fragment = hashFragment(hash);
+  for (uint32_t step = 1;; step++) {
+    auto controls = &this->control[group * TABLE_GROUP_SIZE];
+    for (auto match = matchGroup(controls, fragment); match != 0;
+         match &= match - 1) {
+      auto slot = group * TABLE_GROUP_SIZE + firstMatch(match);
+      auto key = this->entries[slot].key;
+      if (key->hash == hash && key->length == length
+          && memcmp(key->chars, chars, length) == 0)
+        return key;
     }
-
-    index = (index + 1) & (this->capacity - 1);
+    // Stop at the first group with an empty entry.
+    if (matchGroup(controls, CONTROL_EMPTY) != 0)
+      return NULL;
+    group = (group + step) & groupMask;
   }
 }
 
@@ -274,6 +406,8 @@ ObjString* Table::tableFindString(const char* chars, int length, uint32_t hash)
 void Table::markTable()
 {
   for (int i = 0; i < this->capacity; i++) {
+    if (!isFull(this->control[i]))
+      continue;
     Entry* entry = &this->entries[i];
     markObject((Obj*)entry->key);
     markValue(entry->value);
@@ -289,13 +423,24 @@ void Table::markTable()
 void Table::tableRemoveWhite()
 {
   for (int i = 0; i < this->capacity; i++) {
-    Entry* entry = &this->entries[i];
-    if (entry->key != NULL && !entry->key->isMarked) {
-      this->tableDelete(entry->key);
+    if (isFull(this->control[i])
+        && isUnreachable((Obj*)this->entries[i].key)) {
+      deleteSlot(this, i);
     }
   }
 }
 
+/**
+ * @brief Checks whether the entry at an index holds a key.
+ *
+ * @param index An index below `capacity`.
+ * @return `true` for a full entry, `false` for an empty or deleted one.
+ */
+bool Table::hasEntry(int index)
+{
+  return isFull(this->control[index]);
+}
+
 /**
  * @brief Copies all entries from one table to another.
  *
@@ -309,8 +454,8 @@ void Table::tableRemoveWhite()
 void tableAddAll(Table* from, Table* to)
 {
   for (int i = 0; i < from->capacity; i++) {
-    Entry* entry = &from->entries[i];
-    if (entry->key != NULL) {
+    if (isFull(from->control[i])) {
+      Entry* entry = &from->entries[i];
       to->tableSet(entry->key, entry->value);
     }
   }
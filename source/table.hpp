@@ -30,6 +30,11 @@ public:
  * Provides methods for inserting, retrieving, deleting, and managing entries in
  * the hash table. Implements resizing, rehashing, and garbage collection
  * support.
+ *
+ * Every entry has a control byte, kept apart from the entries, that tells
+ * whether it is empty, a tombstone, or holds a key with the given low 7 bits
+ * of hash. Lookups compare a whole group of control bytes at once and only
+ * look at the entries whose byte matched.
  */
 class Table
 {
@@ -60,6 +65,18 @@ public:
    */
   Entry* entries;
 
+  /**
+   * @brief The control byte of each entry, padded to a whole group.
+   */
+  uint8_t* control;
+
+  /**
+   * @brief The object the table belongs to, or NULL for the VM's own tables.
+   *
+   * Stores into an owned table go through the write barrier of its owner.
+   */
+  Obj* owner;
+
   /**
    * @brief Initializes an empty hash table.
    */
@@ -122,6 +139,15 @@ public:
    */
   ObjString* tableFindString(const char* chars, int length, uint32_t hash);
 
+  /**
+   * @brief Checks whether the entry at an index holds a key, for walking
+   * every entry of the table.
+   *
+   * @param index An index below `capacity`.
+   * @return `true` for a full entry, `false` for an empty or deleted one.
+   */
+  bool hasEntry(int index);
+
   /**
    * @brief Marks all objects in the table as reachable.
    *
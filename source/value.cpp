@@ -5,6 +5,7 @@
 
 #include "memory.hpp"
 #include "object.hpp"
+#include "output.hpp"
 
 /**
  * @brief Constructs a new, empty ValueArray.
@@ -71,37 +72,56 @@ void printValue(Value value)
 {
 #ifdef NAN_BOXING
   if (IS_BOOL(value)) {
-    printf(AS_BOOL(value) ? "true" : "false");
+    writeOutput(AS_BOOL(value) ? "true" : "false");
   } else if (IS_NIL(value)) {
-    printf("nil");
+    writeOutput("nil");
   } else if (IS_NUMBER(value)) {
-    printf("%g", AS_NUMBER(value));
+    writeNumber(AS_NUMBER(value));
   } else if (IS_OBJ(value)) {
     printObject(value);
   }
 #else
   switch (value.type) {
     case VAL_BOOL:
-      printf(AS_BOOL(value) ? "true" : "false");
+      writeOutput(AS_BOOL(value) ? "true" : "false");
       break;
     case VAL_NIL:
-      printf("nil");
+      writeOutput("nil");
       break;
     case VAL_NUMBER:
-      printf("%g", AS_NUMBER(value));
+      writeNumber(AS_NUMBER(value));
       break;
     case VAL_OBJ:
       printObject(value);
       break;
+    case VAL_UNDEFINED:
+      break;  // Unreachable.
   }
 #endif
 }
 
+/**
+ * @brief Compares two numbers the way `==` on doubles does.
+ *
+ * NaN equals nothing and the two zeros equal each other, written without the
+ * float equality the build treats as an error.
+ *
+ * @param a The first number to compare.
+ * @param b The second number to compare.
+ * @return `true` if the numbers are equal, `false` otherwise.
+ */
+static bool numbersEqual(double a, double b)
+{
+  return a <= b && a >= b;
+}
+
 /**
  * @brief Compares two values for equality.
  *
  * Determines if two values are equal based on their types and values.
  * Handles different value types, including numbers, booleans, nil, and objects.
+ * Ropes are flattened first, which can collect, so both values must be
+ * reachable.
  *
  * @param a The first value to compare.
  * @param b The second value to compare.
@@ -109,9 +129,14 @@ void printValue(Value value)
  */
 bool valuesEqual(Value a, Value b)
 {
+  // A rope is equal to what the string it flattens to is equal to.
+  if (IS_ROPE(a))
+    a = OBJ_VAL(flattenRope(AS_ROPE(a)));
+  if (IS_ROPE(b))
+    b = OBJ_VAL(flattenRope(AS_ROPE(b)));
 #ifdef NAN_BOXING
   if (IS_NUMBER(a) && IS_NUMBER(b)) {
-    return AS_NUMBER(a) == AS_NUMBER(b);
+    return numbersEqual(AS_NUMBER(a), AS_NUMBER(b));
   }
   return a == b;
 #else
@@ -121,9 +146,10 @@ bool valuesEqual(Value a, Value b)
     case VAL_BOOL:
       return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL:
+    case VAL_UNDEFINED:
       return true;
     case VAL_NUMBER:
-      return AS_NUMBER(a) == AS_NUMBER(b);
+      return numbersEqual(AS_NUMBER(a), AS_NUMBER(b));
     case VAL_OBJ: {
       return AS_OBJ(a) == AS_OBJ(b);
     }
@@ -16,11 +16,13 @@ class ObjString;
 #  define TAG_NIL 1  // 01.
 #  define TAG_FALSE 2  // 10.
 #  define TAG_TRUE 3  // 11.
+#  define TAG_UNDEFINED 4  // 100.
 
 typedef uint64_t Value;
 
 #  define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
 #  define IS_NIL(value) ((value) == NIL_VAL)
+#  define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 #  define IS_NUMBER(value) (((value)&QNAN) != QNAN)
 #  define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
@@ -32,6 +34,7 @@ typedef uint64_t Value;
 #  define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #  define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #  define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#  define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #  define NUMBER_VAL(num) numToValue(num)
 #  define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
@@ -61,13 +64,16 @@ static inline double valueToNum(Value value)
  * @value VAL_NIL Represents a null or nil value.
  * @value VAL_NUMBER Represents a numeric value.
  * @value VAL_OBJ Represents an object value.
+ * @value VAL_UNDEFINED Marks a global slot that hasn't been defined yet. Never
+ * visible to scripts.
  */
 typedef enum
 {
   VAL_BOOL,
   VAL_NIL,
   VAL_NUMBER,
-  VAL_OBJ
+  VAL_OBJ,
+  VAL_UNDEFINED
 } ValueType;
 
 /**
@@ -97,6 +103,7 @@ public:
 
 #  define IS_BOOL(value) ((value).type == VAL_BOOL)
 #  define IS_NIL(value) ((value).type == VAL_NIL)
+#  define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #  define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #  define IS_OBJ(value) ((value).type == VAL_OBJ)
 
@@ -106,6 +113,7 @@ public:
 
 #  define BOOL_VAL(value) ((Value) {VAL_BOOL, {.boolean = value}})
 #  define NIL_VAL ((Value) {VAL_NIL, {.number = 0}})
+#  define UNDEFINED_VAL ((Value) {VAL_UNDEFINED, {.number = 0}})
 #  define NUMBER_VAL(value) ((Value) {VAL_NUMBER, {.number = value}})
 #  define OBJ_VAL(object) ((Value) {VAL_OBJ, {.obj = (Obj*)object}})
 
@@ -176,6 +184,8 @@ void printValue(Value value);
  *
  * Determines if two values are equal based on their types and values.
  * Handles different value types, including numbers, booleans, nil, and objects.
+ * Ropes are flattened first, which can collect, so both values must be
+ * reachable.
  *
  * @param a The first value to compare.
  * @param b The second value to compare.
@@ -1,25 +1,73 @@
-#include <iostream>
 #include <random>
 
 #include "vm.hpp"
 
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include <thread>
+
 #include "common.hpp"
 #include "compiler.hpp"
 #include "debug.hpp"
+#include "input.hpp"
+#include "isolate.hpp"
+#include "output.hpp"
+#include "profile.hpp"
 #include "memory.hpp"
 #include "object.hpp"
 
+#if defined(ENABLE_COMPUTED_GOTO) && defined(__GNUC__)
+// Labels-as-values are a GNU extension, so the dispatch table is only built
+// on compilers that provide it. Everything else uses the switch loop.
+#  define COMPUTED_GOTO
+#  pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+/**
+ * @brief Makes the call of the running native raise a runtime error.
+ *
+ * @param message The message of the error, which must outlive the call.
+ * @return nil, for the native to return.
+ */
+static Value nativeError(const char* message)
+{
+  VM::getVM()->nativeError = message;
+  return NIL_VAL;
+}
+
+/**
+ * @brief Returns whether a native's argument can be used as a count: a whole
+ * number from 0 to `INT32_MAX`.
+ *
+ * Casting anything else to int, NaN included, is undefined.
+ */
+static bool isCount(Value value)
+{
+  if (!IS_NUMBER(value))
+    return false;
+  auto number = AS_NUMBER(value);
+  return number >= 0 && number <= INT32_MAX && !(number > trunc(number));
+}
+
 static Value appendNative(int argCount, Value* args)
 {
   // Append a value to the end of a list increasing the list's length by 1
   if (argCount != 2 || !IS_LIST(args[0])) {
     // Handle error
   }
+  if (argCount == 2 && IS_NUM_ARRAY(args[0])) {
+    if (!IS_NUMBER(args[1])) {
+      // Handle error
+      return NIL_VAL;
+    }
+    appendToNumArray(AS_NUM_ARRAY(args[0]), AS_NUMBER(args[1]));
+    return NIL_VAL;
+  }
   ObjList* list = AS_LIST(args[0]);
   Value item = args[1];
 
@@ -29,6 +77,23 @@ static Value appendNative(int argCount, Value* args)
 
 static Value deleteNative(int argCount, Value* args)
 {
+  // Delete the items from a start index up to an end index at once.
+  if (argCount == 3) {
+    if (!IS_LIST(args[0]) || !isCount(args[1]) || !isCount(args[2])) {
+      // Handle error
+      return NIL_VAL;
+    }
+    auto list = AS_LIST(args[0]);
+    int start = AS_NUMBER(args[1]);
+    int end = AS_NUMBER(args[2]);
+    if (start < 0 || end > list->count || start > end) {
+      // Handle error
+      return NIL_VAL;
+    }
+    deleteRangeFromList(list, start, end);
+    return NIL_VAL;
+  }
+
   // Delete an item from a list at the given index.
   if (argCount != 2 || !IS_LIST(args[0]) || !IS_NUMBER(args[1])) {
     // Handle error
@@ -52,16 +117,20 @@ static Value strInput(int argCount, Value* args)
     // Handle error
     exit(0);
   }
+  if (argCount == 1 && IS_ROPE(args[0]))
+    args[0] = OBJ_VAL(flattenRope(AS_ROPE(args[0])));
   if (argCount == 1 && !IS_STRING(args[0])) {
     // Handle error
     exit(0);
   }
   if (argCount == 1 && IS_STRING(args[0])) {
-    printf("%s", AS_CSTRING(args[0]));
+    writeOutput(AS_CSTRING(args[0]), AS_STRING(args[0])->length);
   }
-  std::string s;
-  std::cin >> s;
-  return OBJ_VAL(copyString(s.c_str(), s.size()));
+  auto lock = lockInput();
+  const char* chars;
+  size_t length;
+  readInputWord(&chars, &length);
+  return OBJ_VAL(copyString(chars, (int)length));
 }
 
 static Value charInput(int argCount, Value* args)
@@ -71,17 +140,20 @@ static Value charInput(int argCount, Value* args)
     // Handle error
     exit(0);
   }
+  if (argCount == 1 && IS_ROPE(args[0]))
+    args[0] = OBJ_VAL(flattenRope(AS_ROPE(args[0])));
   if (argCount == 1 && !IS_STRING(args[0])) {
     // Handle error
     exit(0);
   }
   if (argCount == 1 && IS_STRING(args[0])) {
-    printf("%s", AS_CSTRING(args[0]));
+    writeOutput(AS_CSTRING(args[0]), AS_STRING(args[0])->length);
   }
-  char s[1];
-  scanf("%c", &s[0]);
-
-  return OBJ_VAL(copyString(s, 1));
+  auto lock = lockInput();
+  auto c = readInputChar();
+  if (c < 0)
+    return OBJ_VAL(copyString("", 0));
+  return OBJ_VAL(VM::getVM()->charStrings[c]);
 }
 
 static Value intInput(int argCount, Value* args)
@@ -90,25 +162,126 @@ static Value intInput(int argCount, Value* args)
     // Handle error
     exit(0);
   }
+  if (argCount == 1 && IS_ROPE(args[0]))
+    args[0] = OBJ_VAL(flattenRope(AS_ROPE(args[0])));
   if (argCount == 1 && !IS_STRING(args[0])) {
     // Handle error
     exit(0);
   }
   if (argCount == 1 && IS_STRING(args[0])) {
-    printf("%s", AS_CSTRING(args[0]));
+    writeOutput(AS_CSTRING(args[0]), AS_STRING(args[0])->length);
   }
 
-  double x;
-  scanf("%lf", &x);
+  auto lock = lockInput();
+  double x = 0;
+  readInputNumber(&x);
   return NUMBER_VAL(x);
 }
 
+/**
+ * @brief Native function to write everything printed so far to stdout.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args Unused.
+ * @return nil.
+ */
+static Value flushNative(int argCount, Value* args)
+{
+  flushOutput();
+  return NIL_VAL;
+}
+
+/**
+ * @brief Native function to read whitespace separated numbers from stdin.
+ *
+ * The array grows as the numbers are read, so a limit far above what the
+ * input holds costs nothing.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args Optionally the most numbers to read, all of them by default.
+ * @return A number array of the numbers read before the limit, the end of the
+ * input or the first word that isn't a number, or nil if more than one
+ * argument is passed. A limit that isn't a count raises a runtime error.
+ */
+static Value readIntsNative(int argCount, Value* args)
+{
+  if (argCount > 1) {
+    // Handle error
+    return NIL_VAL;
+  }
+  if (argCount == 1 && !isCount(args[0]))
+    return nativeError("Limit must be a whole number from 0 to 2147483647.");
+
+  auto vm = VM::getVM();
+  auto limit = argCount == 1 ? (int)AS_NUMBER(args[0]) : INT32_MAX;
+  auto array = newNumArray(0, 0);
+  vm->push(OBJ_VAL(array));
+  auto lock = lockInput();
+  double number;
+  while (array->count < limit && readInputNumber(&number))
+    appendToNumArray(array, number);
+  vm->pop();
+  return OBJ_VAL(array);
+}
+
+/**
+ * @brief Native function to read the rest of stdin as lines.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args Unused.
+ * @return A list of the lines without their line endings, or nil if any
+ * arguments are passed.
+ */
+static Value readLinesNative(int argCount, Value* args)
+{
+  if (argCount != 0) {
+    // Handle error
+    return NIL_VAL;
+  }
+  auto vm = VM::getVM();
+  auto list = newList();
+  vm->push(OBJ_VAL(list));
+  auto lock = lockInput();
+  const char* chars;
+  size_t length;
+  while (readInputLine(&chars, &length)) {
+    auto line = OBJ_VAL(copyString(chars, (int)length));
+    vm->push(line);
+    appendToList(list, line);
+    vm->pop();
+  }
+  vm->pop();
+  return OBJ_VAL(list);
+}
+
+/**
+ * @brief Native function to read the rest of stdin.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args Unused.
+ * @return The input as one string, or nil if any arguments are passed.
+ */
+static Value readAllNative(int argCount, Value* args)
+{
+  if (argCount != 0) {
+    // Handle error
+    return NIL_VAL;
+  }
+  auto lock = lockInput();
+  const char* chars;
+  size_t length;
+  readInputAll(&chars, &length);
+  return OBJ_VAL(copyString(chars, (int)length));
+}
+
 static Value objLength(int argCount, Value* args)
 {
   if (argCount != 1) {
     exit(0);
   }
-  if (!IS_STRING(args[0]) && !IS_LIST(args[0])) {
+  if (!IS_STRING(args[0]) && !IS_ROPE(args[0]) && !IS_LIST(args[0])
+      && !IS_NUM_ARRAY(args[0]))
+  {
     // Handle error
     exit(0);
   }
@@ -118,12 +291,24 @@ static Value objLength(int argCount, Value* args)
     return NUMBER_VAL(len);
   }
 
+  if (IS_ROPE(args[0])) {
+    auto x = AS_ROPE(args[0]);
+    auto len = static_cast<double>(x->length);
+    return NUMBER_VAL(len);
+  }
+
   if (IS_LIST(args[0])) {
     auto x = AS_LIST(args[0]);
     auto len = static_cast<double>(x->count);
     return NUMBER_VAL(len);
   }
 
+  if (IS_NUM_ARRAY(args[0])) {
+    auto x = AS_NUM_ARRAY(args[0]);
+    auto len = static_cast<double>(x->count);
+    return NUMBER_VAL(len);
+  }
+
   return NUMBER_VAL(-1);
 }
 
@@ -161,11 +346,521 @@ static Value randNative(int argCount, Value* args)
   return NUMBER_VAL(rand_val);
 }
 
+/**
+ * @brief Native function to tune the pauses of the garbage collector.
+ *
+ * Sets the longest an incremental collection step may take, in microseconds.
+ * Zero makes every collection run to completion at once.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args The new limit, or nothing to only query it.
+ * @return The previous limit.
+ */
+static Value gcMaxPauseNative(int argCount, Value* args)
+{
+  auto vm = VM::getVM();
+  auto previous = vm->gcMaxPause;
+  if (argCount == 1 && IS_NUMBER(args[0]) && AS_NUMBER(args[0]) >= 0)
+    vm->gcMaxPause = AS_NUMBER(args[0]);
+  return NUMBER_VAL(previous);
+}
+
+/**
+ * @brief Native function to tune when the garbage collector runs.
+ *
+ * Sets the factor the heap may grow by after a full collection before the
+ * next one starts, and optionally the heap size, in bytes, at which the next
+ * full collection starts.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args The new growth factor, above 1, then optionally the size of the
+ * heap that starts the next collection. Nothing to only query the factor.
+ * @return The previous growth factor, or nil if the arguments are invalid.
+ */
+static Value gcTuneNative(int argCount, Value* args)
+{
+  auto vm = VM::getVM();
+  auto previous = vm->gcGrowFactor;
+  if (argCount == 0)
+    return NUMBER_VAL(previous);
+  if (argCount > 2 || !IS_NUMBER(args[0]) || !(AS_NUMBER(args[0]) > 1)
+      || (argCount == 2 && (!IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 0)))
+  {
+    // Handle error
+    return NIL_VAL;
+  }
+  vm->gcGrowFactor = AS_NUMBER(args[0]);
+  if (argCount == 2)
+    vm->nextGC = (size_t)AS_NUMBER(args[1]);
+  return NUMBER_VAL(previous);
+}
+
+/**
+ * @brief Sets a field of an instance built by a native, adding it to the
+ * instance's shape.
+ *
+ * The instance, and the value if it is an object, must be on the VM stack.
+ */
+static void setNativeField(ObjInstance* instance, const char* name, Value value)
+{
+  auto vm = VM::getVM();
+  auto key = copyString(name, (int)strlen(name));
+  vm->push(OBJ_VAL(key));
+  setInstanceField(instance, key, value);
+  vm->pop();
+}
+
+/**
+ * @brief Native function to read the garbage collector's statistics.
+ *
+ * The statistics are the ones `--gc-stats` prints, as the fields of an
+ * instance. `allocated_by_type` and `freed_by_type` are instances too, with
+ * the bytes of each type of object as fields.
+ *
+ * @param argCount The number of arguments passed to the function (ignored).
+ * @param args The arguments passed to the function (ignored).
+ * @return A new instance of the class `GCStats`.
+ */
+static Value gcStatsNative(int argCount, Value* args)
+{
+  auto vm = VM::getVM();
+  // Taken first, so the counters don't include the objects built below.
+  auto stats = vm->gcStats;
+  auto heap = vm->bytesAllocated;
+
+  auto name = copyString("GCStats", 7);
+  vm->push(OBJ_VAL(name));
+  auto klass = newClass(name);
+  vm->push(OBJ_VAL(klass));
+  auto result = newInstance(klass);
+  vm->push(OBJ_VAL(result));
+
+  setNativeField(result, "allocations", NUMBER_VAL((double)stats.allocations));
+  setNativeField(
+      result, "allocated_bytes", NUMBER_VAL((double)stats.allocatedBytes));
+  setNativeField(result,
+                 "freed_bytes",
+                 NUMBER_VAL((double)(stats.allocatedBytes - heap)));
+  setNativeField(result, "heap_bytes", NUMBER_VAL((double)heap));
+  setNativeField(
+      result, "peak_heap_bytes", NUMBER_VAL((double)stats.peakHeap));
+  setNativeField(result, "next_gc_bytes", NUMBER_VAL((double)vm->nextGC));
+  setNativeField(result, "collections", NUMBER_VAL((double)stats.collections));
+  setNativeField(
+      result, "minor_collections", NUMBER_VAL((double)stats.minorCollections));
+  setNativeField(result, "steps", NUMBER_VAL((double)stats.steps));
+  setNativeField(result, "total_pause_us", NUMBER_VAL(stats.totalPause));
+  setNativeField(result, "max_pause_us", NUMBER_VAL(stats.maxPause));
+  setNativeField(result, "gray_stack_peak", NUMBER_VAL((double)stats.grayPeak));
+  setNativeField(result, "grow_factor", NUMBER_VAL(vm->gcGrowFactor));
+
+  const char* tableNames[] = {"allocated_by_type", "freed_by_type"};
+  const size_t* tables[] = {stats.allocatedByType, stats.freedByType};
+  for (int i = 0; i < 2; i++) {
+    auto table = newInstance(klass);
+    vm->push(OBJ_VAL(table));
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+      setNativeField(table,
+                     objTypeName((ObjType)type),
+                     NUMBER_VAL((double)tables[i][type]));
+    }
+    setNativeField(result, tableNames[i], OBJ_VAL(table));
+    vm->pop();
+  }
+
+  vm->pop();
+  vm->pop();
+  vm->pop();
+  return OBJ_VAL(result);
+}
+
+/**
+ * @brief Native function to call a function in a new isolate.
+ *
+ * The isolate is a VM of its own on another thread, which starts with copies
+ * of the globals, the function and the arguments, and shares nothing with
+ * this one.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args The function, method or class to call, then its arguments.
+ * @return The handle to join the isolate with, or nil if the arguments are
+ * invalid.
+ */
+static Value spawnNative(int argCount, Value* args)
+{
+  if (argCount < 1) {
+    // Handle error
+    return NIL_VAL;
+  }
+  auto handle = spawnIsolate(args[0], args + 1, argCount - 1);
+  if (handle < 0) {
+    // Handle error
+    return NIL_VAL;
+  }
+  return NUMBER_VAL(handle);
+}
+
+/**
+ * @brief Native function to wait for an isolate to finish.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args The handle `spawn` returned, which can only be joined once.
+ * @return A copy of what the isolate's call returned, or nil if the handle is
+ * invalid or the call raised an error.
+ */
+static Value joinNative(int argCount, Value* args)
+{
+  Value result;
+  if (argCount != 1 || !IS_NUMBER(args[0])
+      || !joinIsolate(AS_NUMBER(args[0]), &result))
+  {
+    // Handle error
+    return NIL_VAL;
+  }
+  return result;
+}
+
+/**
+ * @brief Native function to create a channel between isolates.
+ *
+ * @param argCount The number of arguments passed to the function (ignored).
+ * @param args The arguments passed to the function (ignored).
+ * @return The handle of the channel, which can be passed to isolates.
+ */
+static Value channelNative(int argCount, Value* args)
+{
+  return NUMBER_VAL(newChannel());
+}
+
+/**
+ * @brief Native function to send a copy of a value through a channel.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args The handle of the channel, then the value.
+ * @return True, or nil if the arguments are invalid.
+ */
+static Value sendNative(int argCount, Value* args)
+{
+  if (argCount != 2 || !IS_NUMBER(args[0])
+      || !sendToChannel(AS_NUMBER(args[0]), args[1]))
+  {
+    // Handle error
+    return NIL_VAL;
+  }
+  return BOOL_VAL(true);
+}
+
+/**
+ * @brief Native function to take a value off a channel, waiting until one is
+ * sent if there is none.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args The handle of the channel.
+ * @return The value, or nil if the argument is invalid.
+ */
+static Value receiveNative(int argCount, Value* args)
+{
+  Value result;
+  if (argCount != 1 || !IS_NUMBER(args[0])
+      || !receiveFromChannel(AS_NUMBER(args[0]), &result))
+  {
+    // Handle error
+    return NIL_VAL;
+  }
+  return result;
+}
+
+/**
+ * @brief Native function to count the hardware threads, to size a group of
+ * isolates by.
+ *
+ * @param argCount The number of arguments passed to the function (ignored).
+ * @param args The arguments passed to the function (ignored).
+ * @return The number of hardware threads, at least 1.
+ */
+static Value cpuCountNative(int argCount, Value* args)
+{
+  auto count = std::thread::hardware_concurrency();
+  return NUMBER_VAL(count == 0 ? 1.0 : (double)count);
+}
+
+/**
+ * @brief Native function to create a list of a given length.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args The number of items, then optionally the value of every item,
+ * nil by default.
+ * @return The new list, or nil if the arguments are invalid. A number of
+ * items that isn't a count raises a runtime error.
+ */
+static Value listNative(int argCount, Value* args)
+{
+  if (argCount < 1 || argCount > 2) {
+    // Handle error
+    return NIL_VAL;
+  }
+  if (!isCount(args[0]))
+    return nativeError("Size must be a whole number from 0 to 2147483647.");
+  auto vm = VM::getVM();
+  int count = AS_NUMBER(args[0]);
+  auto fill = argCount == 2 ? args[1] : NIL_VAL;
+  auto list = newList();
+  vm->push(OBJ_VAL(list));
+  reserveList(list, count);
+  for (int i = 0; i < count; i++) {
+    list->items[i] = fill;
+    writeListBarrier(list, i, fill);
+  }
+  list->count = count;
+  vm->pop();
+  return OBJ_VAL(list);
+}
+
+/**
+ * @brief Native function to make room in a list for a number of items.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args The list, then the number of items it should have room for.
+ * @return nil. A number of items that isn't a count raises a runtime error.
+ */
+static Value reserveNative(int argCount, Value* args)
+{
+  if (argCount != 2 || !IS_LIST(args[0])) {
+    // Handle error
+    return NIL_VAL;
+  }
+  if (!isCount(args[1]))
+    return nativeError("Size must be a whole number from 0 to 2147483647.");
+  reserveList(AS_LIST(args[0]), (int)AS_NUMBER(args[1]));
+  return NIL_VAL;
+}
+
+/**
+ * @brief Returns a new list with some of the items of another list.
+ *
+ * @param from The list to copy from, which must be reachable.
+ * @param start The index of the first item to copy.
+ * @param end The index after the last item to copy.
+ * @return The new list.
+ */
+static Value copyListRange(ObjList* from, int start, int end)
+{
+  auto vm = VM::getVM();
+  auto list = newList();
+  vm->push(OBJ_VAL(list));
+  extendList(list, from, start, end);
+  vm->pop();
+  return OBJ_VAL(list);
+}
+
+/**
+ * @brief Native function to copy part of a list.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args The list, the index of the first item to copy, then optionally
+ * the index after the last one, the end of the list by default.
+ * @return A new list with the items, or nil if the arguments are invalid.
+ */
+static Value sliceNative(int argCount, Value* args)
+{
+  if (argCount < 2 || argCount > 3 || !IS_LIST(args[0]) || !isCount(args[1])
+      || (argCount == 3 && !isCount(args[2])))
+  {
+    // Handle error
+    return NIL_VAL;
+  }
+  auto list = AS_LIST(args[0]);
+  int start = AS_NUMBER(args[1]);
+  int end = argCount == 3 ? (int)AS_NUMBER(args[2]) : list->count;
+  if (start < 0 || end > list->count || start > end) {
+    // Handle error
+    return NIL_VAL;
+  }
+  return copyListRange(list, start, end);
+}
+
+/**
+ * @brief Native function to copy a whole list.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args The list.
+ * @return A new list with the same items, or nil if the argument is invalid.
+ */
+static Value copyNative(int argCount, Value* args)
+{
+  if (argCount != 1 || !IS_LIST(args[0])) {
+    // Handle error
+    return NIL_VAL;
+  }
+  return copyListRange(AS_LIST(args[0]), 0, AS_LIST(args[0])->count);
+}
+
+/**
+ * @brief Native function to append every item of a list to another.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args The list to append to, then the list to append.
+ * @return nil.
+ */
+static Value extendNative(int argCount, Value* args)
+{
+  if (argCount != 2 || !IS_LIST(args[0]) || !IS_LIST(args[1])) {
+    // Handle error
+    return NIL_VAL;
+  }
+  auto from = AS_LIST(args[1]);
+  extendList(AS_LIST(args[0]), from, 0, from->count);
+  return NIL_VAL;
+}
+
+/**
+ * @brief Native function to create a number array.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args The number of items, then optionally the value of every item,
+ * zero by default.
+ * @return The new array, or nil if the arguments are invalid. A number of
+ * items that isn't a count raises a runtime error.
+ */
+static Value numArrayNative(int argCount, Value* args)
+{
+  if (argCount < 1 || argCount > 2 || (argCount == 2 && !IS_NUMBER(args[1]))) {
+    // Handle error
+    return NIL_VAL;
+  }
+  if (!isCount(args[0]))
+    return nativeError("Size must be a whole number from 0 to 2147483647.");
+  auto fill = argCount == 2 ? AS_NUMBER(args[1]) : 0;
+  return OBJ_VAL(newNumArray((int)AS_NUMBER(args[0]), fill));
+}
+
+/**
+ * @brief Native function to set every item of a number array to a value.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args The array, then the value.
+ * @return nil.
+ */
+static Value numFillNative(int argCount, Value* args)
+{
+  if (argCount != 2 || !IS_NUM_ARRAY(args[0]) || !IS_NUMBER(args[1])) {
+    // Handle error
+    return NIL_VAL;
+  }
+  auto array = AS_NUM_ARRAY(args[0]);
+  fillNumbers(array->items, array->count, AS_NUMBER(args[1]));
+  return NIL_VAL;
+}
+
+/**
+ * @brief Native function to add up the items of a number array.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args The array.
+ * @return The sum of its items, or nil if the argument is invalid.
+ */
+static Value numSumNative(int argCount, Value* args)
+{
+  if (argCount != 1 || !IS_NUM_ARRAY(args[0])) {
+    // Handle error
+    return NIL_VAL;
+  }
+  auto array = AS_NUM_ARRAY(args[0]);
+  return NUMBER_VAL(sumNumbers(array->items, array->count));
+}
+
+/**
+ * @brief Native function to find the smallest item of a number array.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args The array.
+ * @return Its smallest item, or nil if it is empty or the argument is invalid.
+ */
+static Value numMinNative(int argCount, Value* args)
+{
+  if (argCount != 1 || !IS_NUM_ARRAY(args[0])
+      || AS_NUM_ARRAY(args[0])->count == 0)
+  {
+    // Handle error
+    return NIL_VAL;
+  }
+  auto array = AS_NUM_ARRAY(args[0]);
+  return NUMBER_VAL(minNumber(array->items, array->count));
+}
+
+/**
+ * @brief Native function to find the largest item of a number array.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args The array.
+ * @return Its largest item, or nil if it is empty or the argument is invalid.
+ */
+static Value numMaxNative(int argCount, Value* args)
+{
+  if (argCount != 1 || !IS_NUM_ARRAY(args[0])
+      || AS_NUM_ARRAY(args[0])->count == 0)
+  {
+    // Handle error
+    return NIL_VAL;
+  }
+  auto array = AS_NUM_ARRAY(args[0]);
+  return NUMBER_VAL(maxNumber(array->items, array->count));
+}
+
+/**
+ * @brief Checks that both arguments are number arrays of the same length.
+ */
+static bool areMatchingNumArrays(int argCount, Value* args)
+{
+  return argCount == 2 && IS_NUM_ARRAY(args[0]) && IS_NUM_ARRAY(args[1])
+      && AS_NUM_ARRAY(args[0])->count == AS_NUM_ARRAY(args[1])->count;
+}
+
+/**
+ * @brief Native function to compute the dot product of two number arrays.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args Two arrays of the same length.
+ * @return Their dot product, or nil if the arguments are invalid.
+ */
+static Value numDotNative(int argCount, Value* args)
+{
+  if (!areMatchingNumArrays(argCount, args)) {
+    // Handle error
+    return NIL_VAL;
+  }
+  auto a = AS_NUM_ARRAY(args[0]);
+  auto b = AS_NUM_ARRAY(args[1]);
+  return NUMBER_VAL(dotNumbers(a->items, b->items, a->count));
+}
+
+/**
+ * @brief Native function to add two number arrays item by item.
+ *
+ * @param argCount The number of arguments passed to the function.
+ * @param args Two arrays of the same length.
+ * @return A new array of the sums, or nil if the arguments are invalid.
+ */
+static Value numAddNative(int argCount, Value* args)
+{
+  if (!areMatchingNumArrays(argCount, args)) {
+    // Handle error
+    return NIL_VAL;
+  }
+  // The arguments are still on the stack while the result is allocated.
+  auto result = newNumArray(AS_NUM_ARRAY(args[0])->count, 0);
+  auto a = AS_NUM_ARRAY(args[0]);
+  auto b = AS_NUM_ARRAY(args[1]);
+  addNumbers(result->items, a->items, b->items, a->count);
+  return OBJ_VAL(result);
+}
+
 /**
  * @brief Captures a local variable as an upvalue.
  *
- * Creates a new upvalue object for the given local variable if it doesn't
- * already exist. Updates the open upvalues list accordingly.
+ * Returns the upvalue of the local's stack slot if it is already open,
+ * otherwise creates one and inserts it into the open upvalues list, which is
+ * sorted by stack slot, top first.
  *
  * @param local A pointer to the local variable.
  * @return The created or existing upvalue object.
@@ -174,6 +869,10 @@ static ObjUpvalue* captureUpvalue(Value* local)
 {
   // note source of failure
   auto vm = VM::getVM();
+  auto slot = local - vm->stack;
+  if (vm->slotUpvalues[slot] != NULL)
+    return vm->slotUpvalues[slot];
+
   ObjUpvalue* prevUpvalue = NULL;
   auto upvalue = vm->openUpvalues;
   while (upvalue != NULL && upvalue->location > local) {
@@ -181,10 +880,6 @@ static ObjUpvalue* captureUpvalue(Value* local)
     upvalue = upvalue->next;
   }
 
-  if (upvalue != NULL && upvalue->location == local) {
-    return upvalue;
-  }
-
   auto createdUpvalue = newUpvalue(local);
   createdUpvalue->next = upvalue;
 
@@ -193,6 +888,7 @@ static ObjUpvalue* captureUpvalue(Value* local)
   } else {
     prevUpvalue->next = createdUpvalue;
   }
+  vm->slotUpvalues[slot] = createdUpvalue;
   return createdUpvalue;
 }
 
@@ -210,17 +906,149 @@ static void closeUpvalues(Value* last)
   auto vm = VM::getVM();  // source of failure
   while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
     auto upvalue = vm->openUpvalues;
+    vm->slotUpvalues[upvalue->location - vm->stack] = NULL;
     upvalue->closed = *upvalue->location;
+    writeBarrier((Obj*)upvalue, upvalue->closed);
     upvalue->location = &upvalue->closed;
     vm->openUpvalues = upvalue->next;
   }
 }
 
 /**
- * @brief Constructs a new virtual machine instance.
+ * @brief Reads a field of an instance through an inline cache.
+ *
+ * Entries are keyed by shape id, so a hit hands back the slot directly. On a
+ * miss the slot is looked up in the instance's shape and recorded for the
+ * next lookup.
+ *
+ * @param instance The instance to read from.
+ * @param name The name of the field.
+ * @param cache The inline cache of the access site.
+ * @param value Receives the field value when found.
+ * @return `true` if the instance has the field, `false` otherwise.
+ */
+static bool getField(ObjInstance* instance,
+                     ObjString* name,
+                     InlineCache* cache,
+                     Value* value)
+{
+  auto shape = instance->shape->id;
+  for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+    auto entry = &cache->entries[i];
+    if (entry->shape == shape && entry->slot >= 0
+        && entry->transition == NULL)
+    {
+      *value = instance->fields[entry->slot];
+      return true;
+    }
+  }
+
+  auto slot = findShapeSlot(instance->shape, name);
+  if (slot == -1)
+    return false;
+
+  cache->update(shape, 0, slot, NULL, NIL_VAL);
+  *value = instance->fields[slot];
+  return true;
+}
+
+/**
+ * @brief Writes a field of an instance through an inline cache.
+ *
+ * Stores to an existing field overwrite its slot. Stores that add a field
+ * move the instance along its shape's transition, and the cache remembers the
+ * target shape so the next instance built the same way skips the lookup.
+ *
+ * @param instance The instance to write to.
+ * @param name The name of the field.
+ * @param cache The inline cache of the access site.
+ * @param value The value to store.
+ */
+static void setField(ObjInstance* instance,
+                     ObjString* name,
+                     InlineCache* cache,
+                     Value value)
+{
+  writeBarrier((Obj*)instance, value);
+  auto shape = instance->shape->id;
+  for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+    auto entry = &cache->entries[i];
+    if (entry->shape == shape && entry->slot >= 0) {
+      if (entry->transition != NULL)
+        setInstanceShape(instance, entry->transition);
+      instance->fields[entry->slot] = value;
+      return;
+    }
+  }
+
+  auto slot = findShapeSlot(instance->shape, name);
+  if (slot != -1) {
+    cache->update(shape, 0, slot, NULL, NIL_VAL);
+    instance->fields[slot] = value;
+    return;
+  }
+
+  auto next = transitionShape(instance->shape, name);
+  setInstanceShape(instance, next);
+  slot = next->fieldCount - 1;
+  cache->update(shape, 0, slot, next, NIL_VAL);
+  instance->fields[slot] = value;
+}
+
+/**
+ * @brief Looks up a method of a class through an optional inline cache.
+ *
+ * Method entries are keyed by class version, which changes whenever a method
+ * is added to the class.
+ *
+ * @param klass The class to search.
+ * @param name The name of the method.
+ * @param cache The inline cache of the access site, or NULL.
+ * @param method Receives the method when found.
+ * @return `true` if the class has the method, `false` otherwise.
+ */
+static bool findMethod(ObjClass* klass,
+                       ObjString* name,
+                       InlineCache* cache,
+                       Value* method)
+{
+  if (cache != NULL) {
+    for (int i = 0; i < INLINE_CACHE_WAYS; i++) {
+      auto entry = &cache->entries[i];
+      if (entry->version == klass->version && entry->slot == -1) {
+        *method = entry->method;
+        return true;
+      }
+    }
+  }
+
+  if (!klass->methods.tableGet(name, method))
+    return false;
+
+  if (cache != NULL)
+    cache->update(klass->shape->id, klass->version, -1, NULL, *method);
+  return true;
+}
+
+/**
+ * @brief Constructs a virtual machine, which `initVM` has to initialise before
+ * it runs anything.
  */
 VM::VM() {}
 
+/**
+ * @brief Selects the virtual machine the calling thread runs.
+ *
+ * @param vm The virtual machine, or NULL for none.
+ * @return The virtual machine that was selected before.
+ */
+VM* VM::setVM(VM* vm)
+{
+  auto previous = current;
+  current = vm;
+  return previous;
+}
+
 /**
  * @brief Initializes the virtual machine.
  *
@@ -229,19 +1057,62 @@ VM::VM() {}
  */
 void VM::initVM()
 {
+  auto previous = VM::setVM(this);
+  initOutput();
+  this->frameCapacity = FRAMES_INITIAL;
+  this->frames = (CallFrame*)malloc(sizeof(CallFrame) * this->frameCapacity);
+  this->stackCapacity = STACK_HEADROOM;
+  this->stack = (Value*)malloc(sizeof(Value) * this->stackCapacity);
+  this->slotUpvalues =
+      (ObjUpvalue**)calloc(this->stackCapacity, sizeof(ObjUpvalue*));
+  if (this->frames == NULL || this->stack == NULL
+      || this->slotUpvalues == NULL)
+    exit(1);
+  this->openUpvalues = NULL;
   this->resetStack();
-  this->objects = NULL;
+  this->objects.initObjectArray();
+  this->nursery.initObjectArray();
+  this->nurseryBytes = 0;
+  this->collectingNursery = false;
+  this->rememberedCount = 0;
+  this->rememberedCapacity = 0;
+  this->remembered = NULL;
+  this->gcMarking = false;
+  this->sweeping.initObjectArray();
+  this->gcMaxPause = GC_MAX_PAUSE;
+  this->gcGrowFactor = GC_HEAP_GROW_FACTOR;
+  this->profile = NULL;
+  this->nativeError = NULL;
+  this->gcStepBytes = 0;
+  this->gcStats = GCStats();
+  this->grayList = NULL;
+  this->grayListIndex = 0;
+#ifdef ENABLE_MP
+  this->sweeper.active = false;
+  this->sweeper.objects.initObjectArray();
+#endif
   this->bytesAllocated = 0;
-  this->nextGC = 1024 * 1024;
+  this->nextGC = GC_INITIAL_HEAP;
 
   this->grayCount = 0;
   this->grayCapacity = 0;
   this->grayStack = NULL;
+  this->pool.initPool();
+  this->classVersion = 0;
+  this->shapeCount = 0;
 
   this->strings.initTable();
   this->globals.initTable();
+  this->globalValues.initValueArray();
+  this->globalNames.initValueArray();
 
   this->initString = NULL;
+  for (int i = 0; i < UINT8_COUNT; i++)
+    this->charStrings[i] = NULL;
+  for (int i = 0; i < UINT8_COUNT; i++) {
+    auto c = (char)i;
+    this->charStrings[i] = copyString(&c, 1);
+  }
   this->initString = copyString("init", 4);
 
   defineNative("clock", clockNative);
@@ -251,7 +1122,33 @@ void VM::initVM()
   defineNative("int_input", intInput);
   defineNative("str_input", strInput);
   defineNative("char_input", charInput);
+  defineNative("read_ints", readIntsNative);
+  defineNative("read_lines", readLinesNative);
+  defineNative("read_all", readAllNative);
+  defineNative("flush", flushNative);
   defineNative("len", objLength);
+  defineNative("gc_max_pause", gcMaxPauseNative);
+  defineNative("gc_tune", gcTuneNative);
+  defineNative("gc_stats", gcStatsNative);
+  defineNative("spawn", spawnNative);
+  defineNative("join", joinNative);
+  defineNative("channel", channelNative);
+  defineNative("send", sendNative);
+  defineNative("receive", receiveNative);
+  defineNative("cpu_count", cpuCountNative);
+  defineNative("list", listNative);
+  defineNative("reserve", reserveNative);
+  defineNative("slice", sliceNative);
+  defineNative("copy", copyNative);
+  defineNative("extend", extendNative);
+  defineNative("num_array", numArrayNative);
+  defineNative("num_fill", numFillNative);
+  defineNative("num_sum", numSumNative);
+  defineNative("num_min", numMinNative);
+  defineNative("num_max", numMaxNative);
+  defineNative("num_dot", numDotNative);
+  defineNative("num_add", numAddNative);
+  VM::setVM(previous);
 }
 
 /**
@@ -262,10 +1159,23 @@ void VM::initVM()
  */
 void VM::freeVM()
 {
+  auto previous = VM::setVM(this);
   this->globals.freeTable();
+  this->globalValues.freeValueArray();
+  this->globalNames.freeValueArray();
   this->strings.freeTable();
   this->initString = NULL;
+  for (int i = 0; i < UINT8_COUNT; i++)
+    this->charStrings[i] = NULL;
   freeObjects();
+  this->pool.freePool();
+  free(this->frames);
+  free(this->stack);
+  free(this->slotUpvalues);
+  this->frames = NULL;
+  this->stack = NULL;
+  this->slotUpvalues = NULL;
+  VM::setVM(previous);
 }
 
 /**
@@ -275,21 +1185,62 @@ void VM::freeVM()
  * executes the function.
  *
  * @param source The source code to interpret.
+ * @param length The number of characters in the source code.
  * @return The interpretation result, indicating success, compile error, or
  * runtime error.
  */
-InterpretResult VM::interpret(const char* source)
+InterpretResult VM::interpret(const char* source, size_t length)
 {
-  auto function = compile(source);
-  if (function == NULL)
-    return INTERPRET_COMPILE_ERROR;
+  auto previous = VM::setVM(this);
+  auto function = compile(source, length);
+  auto result =
+      function == NULL ? INTERPRET_COMPILE_ERROR : this->interpret(function);
+  VM::setVM(previous);
+  return result;
+}
 
+/**
+ * @brief Runs a script that has already been compiled.
+ *
+ * Wraps the function in a closure and executes it.
+ *
+ * @param function The top-level function of the script.
+ * @return The interpretation result, indicating success or runtime error.
+ */
+InterpretResult VM::interpret(ObjFunction* function)
+{
+  auto previous = VM::setVM(this);
   push(OBJ_VAL(function));
   auto closure = newClosure(function);
   pop();
   push(OBJ_VAL(closure));
   call(closure, 0);
-  return run();
+  auto result = run();
+  if (result == INTERPRET_OK)
+    pop();
+  VM::setVM(previous);
+  return result;
+}
+
+/**
+ * @brief Calls the value below the top `argCount` values of the stack and
+ * runs the call to completion.
+ *
+ * @param argCount The number of arguments above the callee.
+ * @param result Set to the value the call returns, or nil on an error.
+ * @return The interpretation result, indicating success or runtime error.
+ */
+InterpretResult VM::runCall(int argCount, Value* result)
+{
+  auto previous = VM::setVM(this);
+  auto status = INTERPRET_OK;
+  if (!callValue(peek(argCount), argCount))
+    status = INTERPRET_RUNTIME_ERROR;
+  else if (this->frameCount > 0)
+    status = run();
+  *result = status == INTERPRET_OK ? pop() : NIL_VAL;
+  VM::setVM(previous);
+  return status;
 }
 
 /**
@@ -306,24 +1257,47 @@ void VM::defineMethod(ObjString* name)
   auto method = peek(0);
   auto klass = AS_CLASS(peek(1));
   klass->methods.tableSet(name, method);
+  klass->version = ++this->classVersion;
   pop();
 }
 
+/**
+ * @brief Returns the length of a string or a rope.
+ *
+ * @param object A string or a rope.
+ * @return The number of characters in it.
+ */
+static int stringLength(Obj* object)
+{
+  if (object->type == OBJ_ROPE)
+    return ((ObjRope*)object)->length;
+  return ((ObjString*)object)->length;
+}
+
 /**
  * @brief Concatenates two strings.
  *
  * Pops two string objects from the stack, concatenates them, and pushes the
- * resulting string onto the stack.
+ * resulting string onto the stack. Results longer than `ROPE_MIN_LENGTH` are
+ * pushed as a rope instead of being copied.
  *
- * This function assumes that the top two elements on the stack are string
- * objects.
+ * This function assumes that the top two elements on the stack are string or
+ * rope objects.
  */
 void VM::concatenate()
 {
+  auto length = stringLength(AS_OBJ(peek(0))) + stringLength(AS_OBJ(peek(1)));
+  if (length > ROPE_MIN_LENGTH) {
+    auto rope = newRope(AS_OBJ(peek(1)), AS_OBJ(peek(0)), length);
+    pop();
+    pop();
+    push(OBJ_VAL(rope));
+    return;
+  }
+
+  // Ropes are longer than this, so both sides are strings.
   auto b = AS_STRING(peek(0));
   auto a = AS_STRING(peek(1));
-
-  auto length = a->length + b->length;
   auto chars = ALLOCATE<char>(length + 1);
   memcpy(chars, a->chars, a->length);
   memcpy(chars + a->length, b->chars, b->length);
@@ -344,12 +1318,13 @@ void VM::concatenate()
  *
  * @param klass The class of the object.
  * @param name The name of the method to bind.
+ * @param cache The inline cache of the access site, or NULL if it has none.
  * @return `true` if the method was bound successfully, `false` otherwise.
  */
-bool VM::bindMethod(ObjClass* klass, ObjString* name)
+bool VM::bindMethod(ObjClass* klass, ObjString* name, InlineCache* cache)
 {
   Value method;
-  if (!klass->methods.tableGet(name, &method)) {
+  if (!findMethod(klass, name, cache, &method)) {
     runtimeError("Undefined property '%s'.", name->chars);
     return false;
   }
@@ -367,512 +1342,781 @@ bool VM::bindMethod(ObjClass* klass, ObjString* name)
  * until the end of the function. Handles various opcodes, stack manipulation,
  * function calls, returns, and error handling.
  *
+ * Runs the instantiation of the loop that feeds `profile` when there is one,
+ * so an unprofiled run doesn't test for it on every instruction.
+ *
  * @return The interpretation result, indicating success, compile error, or
  * runtime error.
  */
 InterpretResult VM::run()
 {
-  auto frame = &this->frames[this->frameCount - 1];
+  if (this->profile != NULL)
+    return this->runLoop<true>();
+  return this->runLoop<false>();
+}
+
+/**
+ * @brief The interpreter loop behind `run`.
+ *
+ * The instruction pointer, the current frame and the stack top are cached in
+ * locals. They are written back to the VM (STORE_FRAME) before anything that
+ * can allocate, report an error or push a new frame, and read back
+ * (LOAD_FRAME) afterwards.
+ *
+ * @tparam PROFILE Whether to count and time every instruction in `profile`.
+ * @return The interpretation result, indicating success, compile error, or
+ * runtime error.
+ */
+template<bool PROFILE>
+InterpretResult VM::runLoop()
+{
+  CallFrame* frame = &this->frames[this->frameCount - 1];
+  uint8_t* ip = frame->ip;
+  Value* sp = this->stackTop;
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() \
+  (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
+
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+
+#define STORE_FRAME() (frame->ip = ip, this->stackTop = sp)
+#define LOAD_FRAME() \
+  (frame = &this->frames[this->frameCount - 1], \
+   ip = frame->ip, \
+   sp = this->stackTop)
+
+#define RUNTIME_ERROR(...) \
+  do { \
+    STORE_FRAME(); \
+    runtimeError(__VA_ARGS__); \
+    return INTERPRET_RUNTIME_ERROR; \
+  } while (false)
+
+#define BINARY_OP(valueType, op) \
+  do { \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+      RUNTIME_ERROR("Operands must be numbers."); \
+    } \
+    double b = AS_NUMBER(PEEK(0)); \
+    double a = AS_NUMBER(PEEK(1)); \
+    PEEK(1) = valueType(a op b); \
+    sp--; \
+  } while (false)
+
+// Rewrites the executing instruction in place. Only valid while ip[-1] is
+// still the opcode byte, i.e. in handlers without operands.
+#define QUICKEN(instruction) (ip[-1] = (instruction))
+
+// Reverts a quickened instruction whose guard failed and re-runs the generic
+// form on the same operands.
+#define DEOPTIMIZE(instruction) \
+  do { \
+    ip[-1] = (instruction); \
+    ip--; \
+    DISPATCH(); \
+  } while (false)
 
-  const auto READ_BYTE = [&frame]() { return *frame->ip++; };
+#ifdef DEBUG_TRACE_EXECUTION
+#  define TRACE_INSTRUCTION() \
+    do { \
+      printf("          "); \
+      for (Value* slot = this->stack; slot < sp; slot++) { \
+        printf("[ "); \
+        printValue(*slot); \
+        printf(" ]"); \
+      } \
+      printf("\n"); \
+      disassembleInstruction( \
+          &frame->closure->function->chunk, \
+          (int)(ip - frame->closure->function->chunk.code)); \
+    } while (false)
+#else
+#  define TRACE_INSTRUCTION() \
+    do { \
+    } while (false)
+#endif
 
-  const auto READ_SHORT = [&frame]()
-  {
-    frame->ip += 2;
-    return (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]);
+#define PROFILE_INSTRUCTION() \
+  do { \
+    if constexpr (PROFILE) { \
+      if (this->profile->countInstruction(*ip)) \
+        this->profile->sample(this, ip); \
+    } \
+  } while (false)
+
+#ifdef COMPUTED_GOTO
+  static void* dispatchTable[] = {
+      [OP_CONSTANT] = &&L_OP_CONSTANT,
+      [OP_NIL] = &&L_OP_NIL,
+      [OP_TRUE] = &&L_OP_TRUE,
+      [OP_FALSE] = &&L_OP_FALSE,
+      [OP_EQUAL] = &&L_OP_EQUAL,
+      [OP_GREATER] = &&L_OP_GREATER,
+      [OP_LESS] = &&L_OP_LESS,
+      [OP_RETURN] = &&L_OP_RETURN,
+      [OP_NEGATE] = &&L_OP_NEGATE,
+      [OP_ADD] = &&L_OP_ADD,
+      [OP_SUBTRACT] = &&L_OP_SUBTRACT,
+      [OP_MULTIPLY] = &&L_OP_MULTIPLY,
+      [OP_DIVIDE] = &&L_OP_DIVIDE,
+      [OP_MODULUS] = &&L_OP_MODULUS,
+      [OP_NOT] = &&L_OP_NOT,
+      [OP_PRINT] = &&L_OP_PRINT,
+      [OP_JUMP] = &&L_OP_JUMP,
+      [OP_JUMP_IF_FALSE] = &&L_OP_JUMP_IF_FALSE,
+      [OP_LOOP] = &&L_OP_LOOP,
+      [OP_CALL] = &&L_OP_CALL,
+      [OP_TAIL_CALL] = &&L_OP_TAIL_CALL,
+      [OP_INVOKE] = &&L_OP_INVOKE,
+      [OP_SUPER_INVOKE] = &&L_OP_SUPER_INVOKE,
+      [OP_CLOSURE] = &&L_OP_CLOSURE,
+      [OP_GET_UPVALUE] = &&L_OP_GET_UPVALUE,
+      [OP_SET_UPVALUE] = &&L_OP_SET_UPVALUE,
+      [OP_GET_PROPERTY] = &&L_OP_GET_PROPERTY,
+      [OP_SET_PROPERTY] = &&L_OP_SET_PROPERTY,
+      [OP_POP] = &&L_OP_POP,
+      [OP_GET_LOCAL] = &&L_OP_GET_LOCAL,
+      [OP_SET_LOCAL] = &&L_OP_SET_LOCAL,
+      [OP_DEFINE_GLOBAL] = &&L_OP_DEFINE_GLOBAL,
+      [OP_CLOSE_UPVALUE] = &&L_OP_CLOSE_UPVALUE,
+      [OP_CLASS] = &&L_OP_CLASS,
+      [OP_INHERIT] = &&L_OP_INHERIT,
+      [OP_GET_SUPER] = &&L_OP_GET_SUPER,
+      [OP_METHOD] = &&L_OP_METHOD,
+      [OP_GET_GLOBAL] = &&L_OP_GET_GLOBAL,
+      [OP_SET_GLOBAL] = &&L_OP_SET_GLOBAL,
+      [OP_BUILD_LIST] = &&L_OP_BUILD_LIST,
+      [OP_INDEX_GET] = &&L_OP_INDEX_GET,
+      [OP_INDEX_SET] = &&L_OP_INDEX_SET,
+      [OP_ADD_NUMBER] = &&L_OP_ADD_NUMBER,
+      [OP_SUBTRACT_NUMBER] = &&L_OP_SUBTRACT_NUMBER,
+      [OP_SET_LOCAL_POP] = &&L_OP_SET_LOCAL_POP,
+      [OP_SET_GLOBAL_POP] = &&L_OP_SET_GLOBAL_POP,
+      [OP_INCR_LOCAL] = &&L_OP_INCR_LOCAL,
+      [OP_INCR_GLOBAL] = &&L_OP_INCR_GLOBAL,
+      [OP_LESS_LOCALS_JUMP] = &&L_OP_LESS_LOCALS_JUMP,
   };
 
-  const auto READ_CONSTANT = [&frame, READ_BYTE]
-  { return frame->closure->function->chunk.constants.values[READ_BYTE()]; };
-
-  const auto READ_STRING = [READ_CONSTANT]
-  { return AS_STRING(READ_CONSTANT()); };
+#  define INTERPRET_LOOP DISPATCH();
+#  define CASE(name) L_##name
+#  define DISPATCH() \
+    do { \
+      TRACE_INSTRUCTION(); \
+      PROFILE_INSTRUCTION(); \
+      goto* dispatchTable[READ_BYTE()]; \
+    } while (false)
+#else
+#  define INTERPRET_LOOP \
+    loop: \
+    TRACE_INSTRUCTION(); \
+    PROFILE_INSTRUCTION(); \
+    switch (READ_BYTE())
+#  define CASE(name) case name
+#  define DISPATCH() goto loop
+#endif
 
-  const auto BINARY_OP = [this](char op)
+  INTERPRET_LOOP
   {
-    if (op == '+') {
-      if (IS_STRING(this->peek(0)) && IS_STRING(this->peek(1))) {
+    CASE(OP_CONSTANT):
+    {
+      PUSH(READ_CONSTANT());
+      DISPATCH();
+    }
+    CASE(OP_RETURN):
+    {
+      auto result = POP();
+      closeUpvalues(frame->slots);
+      this->frameCount--;
+      sp = frame->slots;
+      PUSH(result);
+      if (this->frameCount == 0) {
+        // Whoever started the run takes the result off the stack.
+        this->stackTop = sp;
+        return INTERPRET_OK;
+      }
+
+      frame = &this->frames[this->frameCount - 1];
+      ip = frame->ip;
+      DISPATCH();
+    }
+    CASE(OP_NEGATE):
+    {
+      if (!IS_NUMBER(PEEK(0))) {
+        RUNTIME_ERROR("Operand must be a number.");
+      }
+      PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+      DISPATCH();
+    }
+    CASE(OP_ADD):
+    {
+      if ((IS_STRING(PEEK(0)) || IS_ROPE(PEEK(0)))
+          && (IS_STRING(PEEK(1)) || IS_ROPE(PEEK(1))))
+      {
+        STORE_FRAME();
         concatenate();
-      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-        auto b = AS_NUMBER(pop());
-        auto a = AS_NUMBER(pop());
-        push(NUMBER_VAL(a + b));
+        sp = this->stackTop;
+      } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+        QUICKEN(OP_ADD_NUMBER);
+        auto b = AS_NUMBER(POP());
+        auto a = AS_NUMBER(POP());
+        PUSH(NUMBER_VAL(a + b));
       } else {
-        runtimeError("Operands must be two numbers or two strings.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+      }
+      DISPATCH();
+    }
+    CASE(OP_ADD_NUMBER):
+    {
+      if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+        DEOPTIMIZE(OP_ADD);
       }
-    } else if (op == '-') {
-      if (IS_STRING(this->peek(0)) && IS_STRING(this->peek(1))) {
-        auto a = AS_STRING(this->peek(0));
-        auto b = AS_STRING(this->peek(1));
+      PEEK(1) = NUMBER_VAL(AS_NUMBER(PEEK(1)) + AS_NUMBER(PEEK(0)));
+      sp--;
+      DISPATCH();
+    }
+    CASE(OP_SUBTRACT):
+    {
+      if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+        auto a = AS_STRING(PEEK(0));
+        auto b = AS_STRING(PEEK(1));
 
         if (b->length != 1 || a->length != 1) {
-          runtimeError("Operands must be two characters");
-          return INTERPRET_RUNTIME_ERROR;
+          RUNTIME_ERROR("Operands must be two characters");
         }
         auto diff = b->chars[0] - a->chars[0];
-        auto double_diff = static_cast<double>(diff);
-        pop();
-        pop();
-        push(NUMBER_VAL(double_diff));
-      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-        auto b = AS_NUMBER(pop());
-        auto a = AS_NUMBER(pop());
-        push(NUMBER_VAL(a - b));
+        sp -= 2;
+        PUSH(NUMBER_VAL(static_cast<double>(diff)));
+      } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+        QUICKEN(OP_SUBTRACT_NUMBER);
+        auto b = AS_NUMBER(POP());
+        auto a = AS_NUMBER(POP());
+        PUSH(NUMBER_VAL(a - b));
       } else {
-        runtimeError("Operands must be two numbers or two chars");
-        return INTERPRET_RUNTIME_ERROR;
-      }
-    } else {
-      if (!IS_NUMBER(this->peek(0)) || !IS_NUMBER(this->peek(1))) {
-        runtimeError("Operands must be numbers.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Operands must be two numbers or two chars");
       }
-      auto b = AS_NUMBER(pop());
-      auto a = AS_NUMBER(pop());
-      switch (op) {
-        case '+':
-          push(NUMBER_VAL(a + b));
-          break;
-        case '-':
-          push(NUMBER_VAL(a - b));
-          break;
-        case '*':
-          push(NUMBER_VAL(a * b));
-          break;
-        case '/': {
-          push(NUMBER_VAL(a / b));
-          break;
-        }
-        case '%': {
-          int i_a = static_cast<int>(a);
-          int i_b = static_cast<int>(b);
-          double response = static_cast<double>(i_a % i_b);
-          push(NUMBER_VAL(response));
-          break;
-        }
-        case '>':
-          push(BOOL_VAL(a > b));
-          break;
-        case '<':
-          push(BOOL_VAL(a < b));
-          break;
-        default:
-          runtimeError("Invalid Binary Operator.");
-          return INTERPRET_RUNTIME_ERROR;
-          break;
+      DISPATCH();
+    }
+    CASE(OP_SUBTRACT_NUMBER):
+    {
+      if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+        DEOPTIMIZE(OP_SUBTRACT);
       }
+      PEEK(1) = NUMBER_VAL(AS_NUMBER(PEEK(1)) - AS_NUMBER(PEEK(0)));
+      sp--;
+      DISPATCH();
     }
-    return INTERPRET_CONTINUE;
-  };
-
-  for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value* slot = this->stack; slot < this->stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
+    CASE(OP_MULTIPLY):
+    {
+      BINARY_OP(NUMBER_VAL, *);
+      DISPATCH();
     }
-    printf("\n");
-    disassembleInstruction(
-        &frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
-#endif
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-      case OP_CONSTANT: {
-        auto constant = READ_CONSTANT();
-        this->push(constant);
-        break;
-      }
-      case OP_RETURN: {
-        auto result = pop();
-        closeUpvalues(frame->slots);
-        this->frameCount--;
-        if (this->frameCount == 0) {
-          pop();
-          return INTERPRET_OK;
-        }
-
-        this->stackTop = frame->slots;
-        push(result);
-        frame = &this->frames[this->frameCount - 1];
-        break;
-      }
-      case OP_NEGATE: {
-        if (!IS_NUMBER(this->peek(0))) {
-          runtimeError("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(NUMBER_VAL(-AS_NUMBER(pop())));
-        break;
+    CASE(OP_DIVIDE):
+    {
+      BINARY_OP(NUMBER_VAL, /);
+      DISPATCH();
+    }
+    CASE(OP_MODULUS):
+    {
+      if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+        RUNTIME_ERROR("Operands must be numbers.");
       }
-      case OP_ADD: {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-          concatenate();
-        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          auto b = AS_NUMBER(pop());
-          auto a = AS_NUMBER(pop());
-          push(NUMBER_VAL(a + b));
+      int i_b = static_cast<int>(AS_NUMBER(POP()));
+      int i_a = static_cast<int>(AS_NUMBER(POP()));
+      PUSH(NUMBER_VAL(static_cast<double>(i_a % i_b)));
+      DISPATCH();
+    }
+    CASE(OP_NOT):
+    {
+      PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+      DISPATCH();
+    }
+    CASE(OP_NIL):
+    {
+      PUSH(NIL_VAL);
+      DISPATCH();
+    }
+    CASE(OP_TRUE):
+    {
+      PUSH(BOOL_VAL(true));
+      DISPATCH();
+    }
+    CASE(OP_FALSE):
+    {
+      PUSH(BOOL_VAL(false));
+      DISPATCH();
+    }
+    CASE(OP_GREATER):
+    {
+      BINARY_OP(BOOL_VAL, >);
+      DISPATCH();
+    }
+    CASE(OP_LESS):
+    {
+      BINARY_OP(BOOL_VAL, <);
+      DISPATCH();
+    }
+    CASE(OP_EQUAL):
+    {
+      // Comparing a rope can flatten it, so keep both on the stack.
+      STORE_FRAME();
+      auto equal = valuesEqual(PEEK(1), PEEK(0));
+      sp -= 2;
+      PUSH(BOOL_VAL(equal));
+      DISPATCH();
+    }
+    CASE(OP_METHOD):
+    {
+      auto name = READ_STRING();
+      STORE_FRAME();
+      defineMethod(name);
+      sp = this->stackTop;
+      DISPATCH();
+    }
+    CASE(OP_CLASS):
+    {
+      auto name = READ_STRING();
+      STORE_FRAME();
+      PUSH(OBJ_VAL(newClass(name)));
+      DISPATCH();
+    }
+    CASE(OP_CLOSURE):
+    {
+      auto function = AS_FUNCTION(READ_CONSTANT());
+      STORE_FRAME();
+      auto closure = newClosure(function);
+      PUSH(OBJ_VAL(closure));
+      this->stackTop = sp;
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        auto kind = READ_BYTE();
+        auto index = READ_BYTE();
+        if (kind == CAPTURE_VALUE) {
+          closure->upvalues[i] = frame->slots[index];
+        } else if (kind == CAPTURE_LOCAL) {
+          closure->upvalues[i] =
+              OBJ_VAL(captureUpvalue(frame->slots + index));
         } else {
-          runtimeError("Operands must be two numbers or two strings.");
-          return INTERPRET_RUNTIME_ERROR;
+          closure->upvalues[i] = frame->closure->upvalues[index];
         }
-        break;
+        writeBarrier((Obj*)closure, closure->upvalues[i]);
       }
-      case OP_SUBTRACT: {
-        auto res = BINARY_OP('-');
-        if (res != INTERPRET_CONTINUE) {
-          return res;
-        }
-        break;
-      }
-      case OP_MULTIPLY: {
-        auto res = BINARY_OP('*');
-        if (res != INTERPRET_CONTINUE) {
-          return res;
-        }
-        break;
-      }
-      case OP_DIVIDE: {
-        auto res = BINARY_OP('/');
-        if (res != INTERPRET_CONTINUE) {
-          return res;
-        }
-        break;
-      }
-      case OP_MODULUS: {
-        auto res = BINARY_OP('%');
-        if (res != INTERPRET_CONTINUE) {
-          return res;
-        }
-        break;
-      }
-      case OP_NOT: {
-        push(BOOL_VAL(isFalsey(pop())));
-        break;
+      DISPATCH();
+    }
+    CASE(OP_PRINT):
+    {
+      if (IS_ROPE(PEEK(0))) {
+        STORE_FRAME();
+        PEEK(0) = OBJ_VAL(flattenRope(AS_ROPE(PEEK(0))));
       }
-      case OP_NIL: {
-        push(NIL_VAL);
-        break;
+      printValue(POP());
+      writeOutput("\n", 1);
+      DISPATCH();
+    }
+    CASE(OP_CALL):
+    {
+      auto argCount = READ_BYTE();
+      STORE_FRAME();
+      if (!callValue(PEEK(argCount), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_TRUE: {
-        push(BOOL_VAL(true));
-        break;
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(OP_TAIL_CALL):
+    {
+      // Only closures get their caller's frame; anything else is called as
+      // usual and the OP_RETURN that follows returns its result.
+      auto argCount = READ_BYTE();
+      auto callee = PEEK(argCount);
+      STORE_FRAME();
+      if (IS_CLOSURE(callee) ? !tailCall(AS_CLOSURE(callee), argCount)
+                             : !callValue(callee, argCount))
+      {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_FALSE: {
-        push(BOOL_VAL(false));
-        break;
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(OP_POP):
+    {
+      sp--;
+      DISPATCH();
+    }
+    CASE(OP_DEFINE_GLOBAL):
+    {
+      auto slot = READ_SHORT();
+      this->globalValues.values[slot] = PEEK(0);
+      sp--;
+      DISPATCH();
+    }
+    CASE(OP_GET_GLOBAL):
+    {
+      auto slot = READ_SHORT();
+      auto value = this->globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.",
+                      AS_STRING(this->globalNames.values[slot])->chars);
       }
-      case OP_GREATER: {
-        auto res = BINARY_OP('>');
-        if (res != INTERPRET_CONTINUE) {
-          return res;
-          break;
-        }
-        break;
+      PUSH(value);
+      DISPATCH();
+    }
+    CASE(OP_GET_UPVALUE):
+    {
+      auto captured = frame->closure->upvalues[READ_BYTE()];
+      PUSH(IS_UPVALUE(captured) ? *AS_UPVALUE(captured)->location : captured);
+      DISPATCH();
+    }
+    CASE(OP_SET_UPVALUE):
+    {
+      // Assigned variables are never copied.
+      auto upvalue = AS_UPVALUE(frame->closure->upvalues[READ_BYTE()]);
+      *upvalue->location = PEEK(0);
+      writeBarrier((Obj*)upvalue, PEEK(0));
+      DISPATCH();
+    }
+    CASE(OP_GET_PROPERTY):
+    {
+      if (!IS_INSTANCE(PEEK(0))) {
+        RUNTIME_ERROR("Only instances have properties.");
       }
 
-      case OP_LESS: {
-        auto res = BINARY_OP('<');
-        if (res != INTERPRET_CONTINUE) {
-          return res;
-        }
-        break;
-      }
+      auto instance = AS_INSTANCE(PEEK(0));
+      auto name = READ_STRING();
+      auto cache = READ_CACHE();
 
-      case OP_EQUAL: {
-        auto b = pop();
-        auto a = pop();
-        push(BOOL_VAL(valuesEqual(a, b)));
-        break;
-      }
-      case OP_METHOD:
-        defineMethod(READ_STRING());
-        break;
-      case OP_CLASS:
-        push(OBJ_VAL(newClass(READ_STRING())));
-        break;
-      case OP_CLOSURE: {
-        auto function = AS_FUNCTION(READ_CONSTANT());
-        auto closure = newClosure(function);
-        push(OBJ_VAL(closure));
-        for (int i = 0; i < closure->upvalueCount; i++) {
-          auto isLocal = READ_BYTE();
-          auto index = READ_BYTE();
-          if (isLocal) {
-            closure->upvalues[i] = captureUpvalue(frame->slots + index);
-          } else {
-            closure->upvalues[i] = frame->closure->upvalues[index];
-          }
-        }
-        break;
+      Value value;
+      if (getField(instance, name, cache, &value)) {
+        PEEK(0) = value;
+        DISPATCH();
       }
-      case OP_PRINT: {
-        printValue(pop());
-        printf("\n");
-        break;
+      STORE_FRAME();
+      if (!bindMethod(instance->klass, name, cache)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_CALL: {
-        auto argCount = READ_BYTE();
-        if (!callValue(peek(argCount), argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &this->frames[this->frameCount - 1];
-        break;
+      sp = this->stackTop;
+      DISPATCH();
+    }
+    CASE(OP_SET_PROPERTY):
+    {
+      if (!IS_INSTANCE(PEEK(1))) {
+        RUNTIME_ERROR("Only instances have fields.");
       }
-      case OP_POP:
-        pop();
-        break;
-      case OP_DEFINE_GLOBAL: {
-        auto name = READ_STRING();
-        this->globals.tableSet(name, peek(0));
-        pop();
-        break;
+      auto instance = AS_INSTANCE(PEEK(1));
+      auto name = READ_STRING();
+      auto cache = READ_CACHE();
+      STORE_FRAME();
+      setField(instance, name, cache, PEEK(0));
+      auto value = POP();
+      PEEK(0) = value;
+      DISPATCH();
+    }
+    CASE(OP_CLOSE_UPVALUE):
+    {
+      closeUpvalues(sp - 1);
+      sp--;
+      DISPATCH();
+    }
+    CASE(OP_GET_LOCAL):
+    {
+      auto slot = READ_BYTE();
+      PUSH(frame->slots[slot]);
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL):
+    {
+      auto slot = READ_BYTE();
+      frame->slots[slot] = PEEK(0);
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_FALSE):
+    {
+      auto offset = READ_SHORT();
+      if (isFalsey(PEEK(0)))
+        ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL_POP):
+    {
+      auto slot = READ_BYTE();
+      frame->slots[slot] = POP();
+      DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL_POP):
+    {
+      auto slot = READ_SHORT();
+      if (IS_UNDEFINED(this->globalValues.values[slot])) {
+        RUNTIME_ERROR("Undefined variable '%s'.",
+                      AS_STRING(this->globalNames.values[slot])->chars);
       }
-      case OP_GET_GLOBAL: {
-        auto name = READ_STRING();
-        Value value;
-        if (!this->globals.tableGet(name, &value)) {
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(value);
-        break;
+      this->globalValues.values[slot] = POP();
+      DISPATCH();
+    }
+    CASE(OP_INCR_LOCAL):
+    {
+      auto slot = READ_BYTE();
+      auto increment = AS_NUMBER(READ_CONSTANT());
+      auto value = &frame->slots[slot];
+      if (!IS_NUMBER(*value)) {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
       }
-      case OP_GET_UPVALUE: {
-        auto slot = READ_BYTE();
-        push(*frame->closure->upvalues[slot]->location);
-        break;
+      *value = NUMBER_VAL(AS_NUMBER(*value) + increment);
+      DISPATCH();
+    }
+    CASE(OP_INCR_GLOBAL):
+    {
+      auto slot = READ_SHORT();
+      auto increment = AS_NUMBER(READ_CONSTANT());
+      auto value = &this->globalValues.values[slot];
+      if (IS_UNDEFINED(*value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.",
+                      AS_STRING(this->globalNames.values[slot])->chars);
       }
-      case OP_SET_UPVALUE: {
-        auto slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
-        break;
+      if (!IS_NUMBER(*value)) {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
       }
-      case OP_GET_PROPERTY: {
-        if (!IS_INSTANCE(peek(0))) {
-          runtimeError("Only instances have properties.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-
-        auto instance = AS_INSTANCE(peek(0));
-        auto name = READ_STRING();
-
-        Value value;
-        if (instance->fields.tableGet(name, &value)) {
-          pop();  // Instance.
-          push(value);
-          break;
-        }
-        if (!bindMethod(instance->klass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      *value = NUMBER_VAL(AS_NUMBER(*value) + increment);
+      DISPATCH();
+    }
+    CASE(OP_LESS_LOCALS_JUMP):
+    {
+      auto a = frame->slots[READ_BYTE()];
+      auto b = frame->slots[READ_BYTE()];
+      auto offset = READ_SHORT();
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        RUNTIME_ERROR("Operands must be numbers.");
       }
-      case OP_SET_PROPERTY: {
-        if (!IS_INSTANCE(peek(1))) {
-          runtimeError("Only instances have fields.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        auto instance = AS_INSTANCE(peek(1));
-        instance->fields.tableSet(READ_STRING(), peek(0));
-        auto value = pop();
-        pop();
-        push(value);
-        break;
+      // The condition is only left on the stack for the exit path, where the
+      // jump target pops it.
+      if (!(AS_NUMBER(a) < AS_NUMBER(b))) {
+        PUSH(BOOL_VAL(false));
+        ip += offset;
       }
-      case OP_CLOSE_UPVALUE:
-        closeUpvalues(this->stackTop - 1);
-        pop();
-        break;
-      case OP_GET_LOCAL: {
-        auto slot = READ_BYTE();
-        push(frame->slots[slot]);
-        break;
+      DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL):
+    {
+      auto slot = READ_SHORT();
+      if (IS_UNDEFINED(this->globalValues.values[slot])) {
+        RUNTIME_ERROR("Undefined variable '%s'.",
+                      AS_STRING(this->globalNames.values[slot])->chars);
       }
-      case OP_SET_LOCAL: {
-        auto slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
-        break;
+      this->globalValues.values[slot] = PEEK(0);
+      DISPATCH();
+    }
+    CASE(OP_LOOP):
+    {
+      auto offset = READ_SHORT();
+      ip -= offset;
+      DISPATCH();
+    }
+    CASE(OP_JUMP):
+    {
+      auto offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_INHERIT):
+    {
+      auto superclass = PEEK(1);
+      if (!IS_CLASS(superclass)) {
+        RUNTIME_ERROR("Superclass must be a class.");
       }
-      case OP_JUMP_IF_FALSE: {
-        auto offset = READ_SHORT();
-        if (isFalsey(peek(0)))
-          frame->ip += offset;
-        break;
+      auto subclass = AS_CLASS(PEEK(0));
+      STORE_FRAME();
+      tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+      subclass->version = ++this->classVersion;
+      sp--;  // Subclass.
+      DISPATCH();
+    }
+    CASE(OP_INVOKE):
+    {
+      auto method = READ_STRING();
+      auto argCount = READ_BYTE();
+      auto cache = READ_CACHE();
+      STORE_FRAME();
+      if (!invoke(method, argCount, cache)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_SET_GLOBAL: {
-        auto name = READ_STRING();
-        if (this->globals.tableSet(name, peek(0))) {
-          this->globals.tableDelete(name);
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(OP_GET_SUPER):
+    {
+      auto name = READ_STRING();
+      auto superclass = AS_CLASS(POP());
+      STORE_FRAME();
+      if (!bindMethod(superclass, name, NULL)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_LOOP: {
-        auto offset = READ_SHORT();
-        frame->ip -= offset;
-        break;
+      sp = this->stackTop;
+      DISPATCH();
+    }
+    CASE(OP_SUPER_INVOKE):
+    {
+      auto method = READ_STRING();
+      auto argCount = READ_BYTE();
+      auto superclass = AS_CLASS(POP());
+      STORE_FRAME();
+      if (!invokeFromClass(superclass, method, argCount, NULL)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_JUMP: {
-        auto offset = READ_SHORT();
-        frame->ip += offset;
-        break;
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(OP_BUILD_LIST):
+    {
+      uint8_t itemCount = READ_BYTE();
+      STORE_FRAME();
+      ObjList* list = newList();
+      PUSH(OBJ_VAL(list));  // So list isn't sweeped by GC in reserveList
+      this->stackTop = sp;
+      reserveList(list, itemCount);
+      for (int i = 0; i < itemCount; i++) {
+        list->items[i] = PEEK(itemCount - i);
+        writeListBarrier(list, i, list->items[i]);
       }
-      case OP_INHERIT: {
-        auto superclass = peek(1);
-        if (!IS_CLASS(superclass)) {
-          runtimeError("Superclass must be a class.");
-          return INTERPRET_RUNTIME_ERROR;
+      list->count = itemCount;
+      sp -= itemCount + 1;
+      PUSH(OBJ_VAL(list));
+      DISPATCH();
+    }
+    CASE(OP_INDEX_GET):
+    {
+      if (IS_NUM_ARRAY(PEEK(1)) && IS_NUMBER(PEEK(0))) {
+        auto array = AS_NUM_ARRAY(PEEK(1));
+        int index = AS_NUMBER(PEEK(0));
+        if (!isValidNumArrayIndex(array, index)) {
+          RUNTIME_ERROR("List index out of range.");
         }
-        auto subclass = AS_CLASS(peek(0));
-        tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-        pop();  // Subclass.
-        break;
+        sp--;
+        PEEK(0) = NUMBER_VAL(array->items[index]);
+        DISPATCH();
       }
-      case OP_INVOKE: {
-        auto method = READ_STRING();
-        auto argCount = READ_BYTE();
-        if (!invoke(method, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &this->frames[this->frameCount - 1];
-        break;
+      if (IS_ROPE(PEEK(1))) {
+        STORE_FRAME();
+        PEEK(1) = OBJ_VAL(flattenRope(AS_ROPE(PEEK(1))));
       }
-      case OP_GET_SUPER: {
-        auto name = READ_STRING();
-        auto superclass = AS_CLASS(pop());
-        if (!bindMethod(superclass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      Value st_index = PEEK(0);
+      Value st_obj = PEEK(1);
+      Value result;
+
+      if (!IS_LIST(st_obj) && !IS_STRING(st_obj) && !IS_NUM_ARRAY(st_obj)) {
+        RUNTIME_ERROR("Invalid type to index into.");
       }
-      case OP_SUPER_INVOKE: {
-        auto method = READ_STRING();
-        auto argCount = READ_BYTE();
-        auto superclass = AS_CLASS(pop());
-        if (!invokeFromClass(superclass, method, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &this->frames[this->frameCount - 1];
-        break;
+      if (!IS_NUMBER(st_index)) {
+        RUNTIME_ERROR("List index is not a number.");
       }
-      case OP_BUILD_LIST: {
-        ObjList* list = newList();
-        uint8_t itemCount = READ_BYTE();
-        push(OBJ_VAL(list));  // So list isn't sweeped by GC in appendToList
-        for (int i = itemCount; i > 0; i--) {
-          appendToList(list, peek(i));
+      if (IS_LIST(st_obj)) {
+        ObjList* list = AS_LIST(st_obj);
+        int index = AS_NUMBER(st_index);
+        if (!isValidListIndex(list, index)) {
+          RUNTIME_ERROR("List index out of range.");
         }
-        pop();
-        while (itemCount-- > 0) {
-          pop();
+
+        result = indexFromList(list, index);
+      } else {
+        ObjString* string = AS_STRING(st_obj);
+        int index = AS_NUMBER(st_index);
+        if (!isValidStringIndex(string, index)) {
+          RUNTIME_ERROR("String index out of range");
         }
-        push(OBJ_VAL(list));
-        break;
+        // One-character strings are preallocated, so this can't collect.
+        result = indexFromString(string, index);
       }
-      case OP_INDEX_GET: {
-        Value st_index = pop();
-        Value st_obj = pop();
-        Value result;
-
-        if (!IS_LIST(st_obj) && !IS_STRING(st_obj)) {
-          runtimeError("Invalid type to index into.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        if (!IS_NUMBER(st_index)) {
-          runtimeError("List index is not a number.");
-          return INTERPRET_RUNTIME_ERROR;
+      sp -= 2;
+      PUSH(result);
+      DISPATCH();
+    }
+    CASE(OP_INDEX_SET):
+    {
+      // Stack before: [list, index, item] and after: [item]
+      if (IS_NUM_ARRAY(PEEK(2)) && IS_NUMBER(PEEK(1))) {
+        auto array = AS_NUM_ARRAY(PEEK(2));
+        int index = AS_NUMBER(PEEK(1));
+        if (!isValidNumArrayIndex(array, index)) {
+          RUNTIME_ERROR("Invalid list index.");
         }
-        if (IS_LIST(st_obj)) {
-          ObjList* list = AS_LIST(st_obj);
-          int index = AS_NUMBER(st_index);
-          if (!isValidListIndex(list, index)) {
-            runtimeError("List index out of range.");
-            return INTERPRET_RUNTIME_ERROR;
-          }
-
-          result = indexFromList(list, index);
-          push(result);
-        } else if (IS_STRING(st_obj)) {
-          ObjString* string = AS_STRING(st_obj);
-          int index = AS_NUMBER(st_index);
-          if (!isValidStringIndex(string, index)) {
-            runtimeError("String index out of range");
-            return INTERPRET_RUNTIME_ERROR;
-          }
-          result = indexFromString(string, index);
-          push(result);
+        if (!IS_NUMBER(PEEK(0))) {
+          RUNTIME_ERROR("Number arrays can only hold numbers.");
         }
-
-        break;
+        array->items[index] = AS_NUMBER(PEEK(0));
+        PEEK(2) = PEEK(0);
+        sp -= 2;
+        DISPATCH();
       }
-      case OP_INDEX_SET: {
-        // Stack before: [list, index, item] and after: [item]
-        Value st_item = pop();
-        Value st_index = pop();
-        Value st_obj = pop();
-
-        if (!IS_LIST(st_obj) && !IS_STRING(st_obj)) {
-          runtimeError("Cannot store value in a non-list.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
+      if (IS_ROPE(PEEK(2))) {
+        STORE_FRAME();
+        PEEK(2) = OBJ_VAL(flattenRope(AS_ROPE(PEEK(2))));
+      }
+      Value st_item = POP();
+      Value st_index = POP();
+      Value st_obj = POP();
 
-        if (!IS_NUMBER(st_index)) {
-          runtimeError("List index is not a number.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
+      if (!IS_LIST(st_obj) && !IS_STRING(st_obj) && !IS_NUM_ARRAY(st_obj)) {
+        RUNTIME_ERROR("Cannot store value in a non-list.");
+      }
 
-        if (IS_LIST(st_obj)) {
-          ObjList* list = AS_LIST(st_obj);
-          int index = AS_NUMBER(st_index);
+      if (!IS_NUMBER(st_index)) {
+        RUNTIME_ERROR("List index is not a number.");
+      }
 
-          if (!isValidListIndex(list, index)) {
-            runtimeError("Invalid list index.");
-            return INTERPRET_RUNTIME_ERROR;
-          }
+      if (IS_LIST(st_obj)) {
+        ObjList* list = AS_LIST(st_obj);
+        int index = AS_NUMBER(st_index);
 
-          storeToList(list, index, st_item);
-          push(st_item);
-        } else if (IS_STRING(st_obj)) {
-          ObjString* string = AS_STRING(st_obj);
-          int index = AS_NUMBER(st_index);
+        if (!isValidListIndex(list, index)) {
+          RUNTIME_ERROR("Invalid list index.");
+        }
 
-          if (!isValidStringIndex(string, index)) {
-            runtimeError("Invalid list index.");
-            return INTERPRET_RUNTIME_ERROR;
-          }
+        storeToList(list, index, st_item);
+        PUSH(st_item);
+      } else {
+        ObjString* string = AS_STRING(st_obj);
+        int index = AS_NUMBER(st_index);
 
-          ObjString* item = AS_STRING(st_item);
+        if (!isValidStringIndex(string, index)) {
+          RUNTIME_ERROR("Invalid list index.");
+        }
 
-          if (item->length > 1) {
-            runtimeError("Invalid assignment value");
-            return INTERPRET_RUNTIME_ERROR;
-          }
+        ObjString* item = AS_STRING(st_item);
 
-          storeToString(string, index, item);
-          push(st_item);
+        if (item->length > 1) {
+          RUNTIME_ERROR("Invalid assignment value");
         }
 
-        break;
+        storeToString(string, index, item);
+        PUSH(st_item);
       }
+      DISPATCH();
     }
   }
-}
 
-/**
- * @brief Gets the singleton virtual machine instance.
- *
- * Returns a pointer to the globally accessible virtual machine object.
- *
- * @return A pointer to the virtual machine instance.
- */
-VM* VM::getVM()
-{
-  return vm;
+  return INTERPRET_RUNTIME_ERROR;  // Unreachable.
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef READ_CACHE
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef BINARY_OP
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
 /**
@@ -883,11 +2127,71 @@ VM* VM::getVM()
  */
 void VM::resetStack()
 {
+  for (auto upvalue = this->openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next)
+  {
+    this->slotUpvalues[upvalue->location - this->stack] = NULL;
+  }
   this->stackTop = this->stack;
   this->frameCount = 0;
   this->openUpvalues = NULL;
 }
 
+/**
+ * @brief Grows the frame array or the stack, or both, so that another frame
+ * fits with `slots` slots above the stack top.
+ *
+ * Both are allocated outside of `reallocate`, like the gray stack, so growing
+ * them can't start a collection. Moving the stack moves the slots of every
+ * frame, the stack top and the location of every open upvalue along with it,
+ * while `slotUpvalues` is indexed by slot and only needs to grow.
+ *
+ * @param slots The free slots the stack needs above its top.
+ */
+void VM::growStack(int slots)
+{
+  if (this->frameCount == this->frameCapacity) {
+    this->frameCapacity = GROW_CAPACITY(this->frameCapacity);
+    if (this->frameCapacity > FRAMES_MAX)
+      this->frameCapacity = FRAMES_MAX;
+    this->frames = (CallFrame*)realloc(
+        this->frames, sizeof(CallFrame) * this->frameCapacity);
+    if (this->frames == NULL)
+      exit(1);
+  }
+
+  auto used = (int)(this->stackTop - this->stack);
+  if (this->stackCapacity - used >= slots)
+    return;
+  auto capacity = this->stackCapacity;
+  while (capacity - used < slots)
+    capacity = GROW_CAPACITY(capacity);
+  auto stack = (Value*)malloc(sizeof(Value) * capacity);
+  auto slotUpvalues = (ObjUpvalue**)realloc(this->slotUpvalues,
+                                            sizeof(ObjUpvalue*) * capacity);
+  if (stack == NULL || slotUpvalues == NULL)
+    exit(1);
+  memcpy(stack, this->stack, sizeof(Value) * used);
+  for (int i = this->stackCapacity; i < capacity; i++) {
+    slotUpvalues[i] = NULL;
+  }
+  this->slotUpvalues = slotUpvalues;
+
+  for (int i = 0; i < this->frameCount; i++) {
+    auto frame = &this->frames[i];
+    frame->slots = stack + (frame->slots - this->stack);
+  }
+  for (auto upvalue = this->openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next)
+  {
+    upvalue->location = stack + (upvalue->location - this->stack);
+  }
+  this->stackTop = stack + used;
+  free(this->stack);
+  this->stack = stack;
+  this->stackCapacity = capacity;
+}
+
 /**
  * @brief Pushes a value onto the top of the stack.
  *
@@ -952,6 +2256,11 @@ bool VM::call(ObjClosure* closure, int argCount)
     runtimeError("Stack overflow.");
     return false;
   }
+  // The callee and its arguments are already on the stack.
+  auto slots = closure->function->maxSlots - argCount - 1 + STACK_HEADROOM;
+  if (this->frameCount == this->frameCapacity
+      || this->stack + this->stackCapacity - this->stackTop < slots)
+    this->growStack(slots);
 
   CallFrame* frame = &this->frames[this->frameCount++];
   frame->closure = closure;
@@ -960,6 +2269,44 @@ bool VM::call(ObjClosure* closure, int argCount)
   return true;
 }
 
+/**
+ * @brief Calls a closure in place of the function running in the current
+ * frame, whose result it returns.
+ *
+ * Closes the upvalues of the current frame and moves the callee and its
+ * arguments down to the frame's slots, so that a chain of tail calls runs in
+ * one frame.
+ *
+ * @param closure The closure to call.
+ * @param argCount The number of arguments passed to the closure.
+ * @return `true` if the call was successful, `false` if an error occurred.
+ */
+bool VM::tailCall(ObjClosure* closure, int argCount)
+{
+  if (argCount != closure->function->arity) {
+    runtimeError("Expected %d arguments but got %d.",
+                 closure->function->arity,
+                 argCount);
+    return false;
+  }
+
+  auto frame = &this->frames[this->frameCount - 1];
+  closeUpvalues(frame->slots);
+  memmove(frame->slots,
+          this->stackTop - argCount - 1,
+          (size_t)(argCount + 1) * sizeof(Value));
+  this->stackTop = frame->slots + argCount + 1;
+  auto slots = closure->function->maxSlots - argCount - 1 + STACK_HEADROOM;
+  if (this->stack + this->stackCapacity - this->stackTop < slots) {
+    this->growStack(slots);
+    frame = &this->frames[this->frameCount - 1];
+  }
+
+  frame->closure = closure;
+  frame->ip = closure->function->chunk.code;
+  return true;
+}
+
 /**
  * @brief Calls a callable value.
  *
@@ -998,6 +2345,12 @@ bool VM::callValue(Value callee, int argCount)
       case OBJ_NATIVE: {
         NativeFn native = AS_NATIVE(callee);
         Value result = native(argCount, this->stackTop - argCount);
+        if (this->nativeError != NULL) {
+          auto message = this->nativeError;
+          this->nativeError = NULL;
+          runtimeError("%s", message);
+          return false;
+        }
         this->stackTop -= argCount + 1;
         push(result);
         return true;
@@ -1019,13 +2372,17 @@ bool VM::callValue(Value callee, int argCount)
  * @param klass The class instance.
  * @param name The name of the method to invoke.
  * @param argCount The number of arguments passed to the method.
+ * @param cache The inline cache of the call site, or NULL if it has none.
  * @return `true` if the method was invoked successfully, `false` if an error
  * occurred.
  */
-bool VM::invokeFromClass(ObjClass* klass, ObjString* name, int argCount)
+bool VM::invokeFromClass(ObjClass* klass,
+                         ObjString* name,
+                         int argCount,
+                         InlineCache* cache)
 {
   Value method;
-  if (!klass->methods.tableGet(name, &method)) {
+  if (!findMethod(klass, name, cache, &method)) {
     runtimeError("Undefined property '%s'.", name->chars);
     return false;
   }
@@ -1040,10 +2397,11 @@ bool VM::invokeFromClass(ObjClass* klass, ObjString* name, int argCount)
  *
  * @param name The name of the method to invoke.
  * @param argCount The number of arguments passed to the method.
+ * @param cache The inline cache of the call site.
  * @return `true` if the method was invoked successfully, `false` if an error
  * occurred.
  */
-bool VM::invoke(ObjString* name, int argCount)
+bool VM::invoke(ObjString* name, int argCount, InlineCache* cache)
 {
   Value receiver = peek(argCount);
   if (!IS_INSTANCE(receiver)) {
@@ -1053,11 +2411,11 @@ bool VM::invoke(ObjString* name, int argCount)
   ObjInstance* instance = AS_INSTANCE(receiver);
 
   Value value;
-  if (instance->fields.tableGet(name, &value)) {
+  if (getField(instance, name, cache, &value)) {
     this->stackTop[-argCount - 1] = value;
     return callValue(value, argCount);
   }
-  return invokeFromClass(instance->klass, name, argCount);
+  return invokeFromClass(instance->klass, name, argCount, cache);
 }
 
 /**
@@ -1084,6 +2442,9 @@ bool VM::isFalsey(Value value)
  */
 void VM::runtimeError(const char* format, ...)
 {
+  // Show the output that led up to the error before the error itself.
+  flushOutput();
+
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
@@ -1094,7 +2455,7 @@ void VM::runtimeError(const char* format, ...)
     CallFrame* frame = &this->frames[i];
     ObjFunction* function = frame->closure->function;
     size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+    fprintf(stderr, "[line %d] in ", function->chunk.getLine((int)instruction));
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
@@ -1118,9 +2479,35 @@ void VM::defineNative(const char* name, NativeFn function)
 {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(function)));
-  this->globals.tableSet(AS_STRING(this->stack[0]), this->stack[1]);
+  auto slot = globalSlot(AS_STRING(this->stack[0]));
+  this->globalValues.values[slot] = this->stack[1];
   pop();
   pop();
 }
 
-VM* VM::vm = new VM;
+/**
+ * @brief Returns the slot of a global variable, reserving one if needed.
+ *
+ * The compiler resolves every global name through this function, so each name
+ * maps to one index in `globalValues` for the lifetime of the VM. New slots
+ * hold `UNDEFINED_VAL` until the variable is defined.
+ *
+ * @param name The name of the global variable.
+ * @return The index of the variable in `globalValues`.
+ */
+int VM::globalSlot(ObjString* name)
+{
+  Value slot;
+  if (this->globals.tableGet(name, &slot))
+    return (int)AS_NUMBER(slot);
+
+  auto index = this->globalValues.count;
+  push(OBJ_VAL(name));
+  this->globalNames.writeValueArray(OBJ_VAL(name));
+  this->globalValues.writeValueArray(UNDEFINED_VAL);
+  this->globals.tableSet(name, NUMBER_VAL((double)index));
+  pop();
+  return index;
+}
+
+thread_local VM* VM::current = NULL;
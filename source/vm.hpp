@@ -1,11 +1,24 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include "memory.hpp"
 #include "object.hpp"
 #include "table.hpp"
 
-constexpr int FRAMES_MAX = 2048;
-constexpr int STACK_MAX = (FRAMES_MAX * UINT8_COUNT);
+class Profile;
+
+/**
+ * @brief The frames the frame array starts with.
+ */
+constexpr int FRAMES_INITIAL = 64;
+
+/**
+ * @brief The stack slots kept free above the deepest point the code of the
+ * newest frame reaches, for what natives and the VM itself push.
+ *
+ * The stack starts with this many slots.
+ */
+constexpr int STACK_HEADROOM = 4 * UINT8_COUNT;
 
 /**
  * @brief Represents a call frame on the virtual machine's stack.
@@ -51,13 +64,22 @@ typedef enum
   INTERPRET_CONTINUE
 } InterpretResult;
 
+/**
+ * @brief A virtual machine, with its own heap, globals and stack.
+ *
+ * Any number of them can exist at once. The memory functions and object
+ * constructors work on the calling thread's current VM, which `setVM`
+ * selects, and `initVM`, `freeVM` and `interpret` select for as long as they
+ * run. Two threads can run two VMs at the same time, but a VM must only be
+ * used by one thread at a time.
+ */
 class VM
 {
 private:
   /**
-   * @brief Constructs a new virtual machine instance.
+   * @brief The VM the calling thread is running.
    */
-  VM();
+  static thread_local VM* current;
 
   /**
    * @brief Resets the virtual machine's stack.
@@ -67,6 +89,17 @@ private:
    */
   void resetStack();
 
+  /**
+   * @brief Grows the frame array or the stack, or both, so that another
+   * frame fits with `slots` slots above the stack top.
+   *
+   * Moving the stack moves the slots of every frame, the stack top and the
+   * location of every open upvalue along with it.
+   *
+   * @param slots The free slots the stack needs above its top.
+   */
+  void growStack(int slots);
+
   /**
    * @brief Concatenates two strings.
    *
@@ -90,6 +123,16 @@ private:
    */
   bool call(ObjClosure* closure, int argCount);
 
+  /**
+   * @brief Calls a closure in place of the function running in the current
+   * frame, for a call in tail position.
+   *
+   * @param closure The closure to call.
+   * @param argCount The number of arguments passed to the function.
+   * @return `true` if the call was successful, `false` if an error occurred.
+   */
+  bool tailCall(ObjClosure* closure, int argCount);
+
   /**
    * @brief Calls a callable value.
    *
@@ -104,24 +147,127 @@ private:
   bool callValue(Value callee, int argCount);
 
 public:
-  static VM* vm;
+  /**
+   * @brief Constructs a virtual machine, which `initVM` has to initialise
+   * before it runs anything.
+   */
+  VM();
 
-  CallFrame frames[FRAMES_MAX];
+  /**
+   * @brief The active call frames, grown as calls nest deeper.
+   */
+  CallFrame* frames;
   int frameCount;
+  int frameCapacity;
 
-  Value stack[STACK_MAX];
+  /**
+   * @brief The value stack, grown as calls nest deeper.
+   *
+   * Anything that points into it has to be read again after a call, which
+   * may move it.
+   */
+  Value* stack;
   Value* stackTop;
+  int stackCapacity;
+
+  /**
+   * @brief The open upvalue of each stack slot, or NULL, so that capturing a
+   * local a closure of the same frame already captured doesn't walk
+   * `openUpvalues`.
+   */
+  ObjUpvalue** slotUpvalues;
   Table strings;
+
+  /**
+   * @brief Maps global variable names to their slot in `globalValues`.
+   */
   Table globals;
+
+  /**
+   * @brief The values of all global variables, indexed by slot.
+   */
+  ValueArray globalValues;
+
+  /**
+   * @brief The name of each global slot, for error messages.
+   */
+  ValueArray globalNames;
   ObjUpvalue* openUpvalues;
   size_t bytesAllocated;
   size_t nextGC;
-  Obj* objects;
+  ObjectArray objects;
+  ObjectArray nursery;
+  size_t nurseryBytes;
+  bool collectingNursery;
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj** remembered;
+
+  /**
+   * @brief Whether an incremental collection is marking.
+   */
+  bool gcMarking;
+
+  /**
+   * @brief Old objects an incremental collection has yet to sweep.
+   */
+  ObjectArray sweeping;
+
+  /**
+   * @brief The longest an incremental step may take, in microseconds, or 0
+   * to collect without interruption.
+   */
+  double gcMaxPause;
+
+  /**
+   * @brief How many times its size the heap may grow to after a full
+   * collection before the next one starts.
+   */
+  double gcGrowFactor;
+
+  /**
+   * @brief Bytes allocated since the last incremental step.
+   */
+  size_t gcStepBytes;
+  GCStats gcStats;
+
+  /**
+   * @brief A big list an incremental collection is part way through scanning.
+   */
+  ObjList* grayList;
+#ifdef ENABLE_MP
+  Sweeper sweeper;
+#endif
+
+  /**
+   * @brief The index of the next item of `grayList` to scan.
+   */
+  int grayListIndex;
   int grayCount;
   int grayCapacity;
   Obj** grayStack;
+  ObjectPool pool;
   ObjString* initString;
 
+  /**
+   * @brief The interned one-character strings, indexed by their character.
+   */
+  ObjString* charStrings[UINT8_COUNT];
+
+  /**
+   * @brief Where `--profile` collects its counts and samples, or NULL when
+   * the program isn't being profiled.
+   */
+  Profile* profile;
+
+  /**
+   * @brief Set by a native to the message of the runtime error its call
+   * raises, in place of the value it returns.
+   */
+  const char* nativeError;
+  uint32_t classVersion;
+  uint32_t shapeCount;
+
   /**
    * @brief Initializes the virtual machine.
    *
@@ -140,13 +286,20 @@ public:
   void freeVM();
 
   /**
-   * @brief Gets the singleton virtual machine instance.
+   * @brief Gets the virtual machine the calling thread is running.
    *
-   * Returns a pointer to the globally accessible virtual machine object.
+   * @return A pointer to the current virtual machine, or NULL if the thread
+   * hasn't selected one.
+   */
+  static VM* getVM() { return current; }
+
+  /**
+   * @brief Selects the virtual machine the calling thread runs.
    *
-   * @return A pointer to the virtual machine instance.
+   * @param vm The virtual machine, or NULL for none.
+   * @return The virtual machine that was selected before.
    */
-  static VM* getVM();
+  static VM* setVM(VM* vm);
 
   /**
    * @brief Interprets the given source code.
@@ -154,11 +307,37 @@ public:
    * Compiles the source code into a function, creates a closure for it, and
    * executes the function.
    *
-   * @param source The source code to interpret.
+   * @param source The source code to interpret, which doesn't need to be
+   * null-terminated.
+   * @param length The number of characters in the source code.
    * @return The interpretation result, indicating success, compile error, or
    * runtime error.
    */
-  InterpretResult interpret(const char* source);
+  InterpretResult interpret(const char* source, size_t length);
+
+  /**
+   * @brief Runs a script that has already been compiled.
+   *
+   * Wraps the function in a closure and executes it.
+   *
+   * @param function The top-level function of the script, as returned by
+   * `compile` or loaded from a bytecode cache while this VM was current.
+   * @return The interpretation result, indicating success or runtime error.
+   */
+  InterpretResult interpret(ObjFunction* function);
+
+  /**
+   * @brief Calls the value below the top `argCount` values of the stack and
+   * runs the call to completion.
+   *
+   * Only for a VM that isn't running any code, such as the one an isolate
+   * starts with.
+   *
+   * @param argCount The number of arguments above the callee.
+   * @param result Set to the value the call returns, or nil on an error.
+   * @return The interpretation result, indicating success or runtime error.
+   */
+  InterpretResult runCall(int argCount, Value* result);
 
   /**
    * @brief Executes the bytecode in the current call frame.
@@ -172,6 +351,15 @@ public:
    */
   InterpretResult run();
 
+  /**
+   * @brief The interpreter loop behind `run`, with or without profiling.
+   *
+   * @tparam PROFILE Whether to count and time every instruction in `profile`.
+   * @return The interpretation result.
+   */
+  template<bool PROFILE>
+  InterpretResult runLoop();
+
   /**
    * @brief Pushes a value onto the top of the stack.
    *
@@ -224,6 +412,18 @@ public:
    */
   void defineNative(const char* name, NativeFn function);
 
+  /**
+   * @brief Returns the slot of a global variable, reserving one if needed.
+   *
+   * The compiler resolves every global name through this function, so each
+   * name maps to one index in `globalValues` for the lifetime of the VM. New
+   * slots hold `UNDEFINED_VAL` until the variable is defined.
+   *
+   * @param name The name of the global variable.
+   * @return The index of the variable in `globalValues`.
+   */
+  int globalSlot(ObjString* name);
+
   /**
    * @brief Reports a runtime error and terminates execution.
    *
@@ -256,9 +456,10 @@ public:
    *
    * @param klass The class of the object.
    * @param name The name of the method to bind.
+   * @param cache The inline cache of the access site, or NULL if it has none.
    * @return `true` if the method was bound successfully, `false` otherwise.
    */
-  bool bindMethod(ObjClass* klass, ObjString* name);
+  bool bindMethod(ObjClass* klass, ObjString* name, InlineCache* cache);
 
   /**
    * @brief Invokes a method on an object.
@@ -268,10 +469,11 @@ public:
    *
    * @param name The name of the method to invoke.
    * @param argCount The number of arguments passed to the method.
+   * @param cache The inline cache of the call site.
    * @return `true` if the method was invoked successfully, `false` if an error
    * occurred.
    */
-  bool invoke(ObjString* name, int argCount);
+  bool invoke(ObjString* name, int argCount, InlineCache* cache);
 
   /**
    * @brief Invokes a method on a class instance.
@@ -282,10 +484,14 @@ public:
    * @param klass The class instance.
    * @param name The name of the method to invoke.
    * @param argCount The number of arguments passed to the method.
+   * @param cache The inline cache of the call site, or NULL if it has none.
    * @return `true` if the method was invoked successfully, `false` if an error
    * occurred.
    */
-  bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount);
+  bool invokeFromClass(ObjClass* klass,
+                       ObjString* name,
+                       int argCount,
+                       InlineCache* cache);
 };
 
 #endif
\ No newline at end of file
@@ -1,17 +1,241 @@
+"""Runs the Lox scripts in lox_test/src and checks what they print.
+
+A script says what it should print in comments, in order:
+
+    print 1 + 2; // expect: 3
+
+A script that should stop with a runtime error says so on the line that
+raises it, and one that shouldn't compile says so on the line of the error:
+
+    print nil + 1; // expect runtime error: Operands must be numbers.
+    print 1 +;     // expect compile error: Error at ';': Expect expression.
+
+A script reads `<name>.in` from stdin when there is one.
+
+Every script that compiles is also run from its bytecode cache, written by
+`--compile-only` into a scratch directory, to check that a cached script
+behaves like the source it was compiled from.
+
+The interpreter is `./build/CppLox`, unless `LOX_PATH` is set or a path is
+given on the command line. With pytest installed, run `pytest test`; ctest
+runs this file directly instead, as `python3 test/test_main.py <CppLox>`.
+"""
+
+import mmap
+import os
+import re
+import shutil
 import subprocess
-import pytest
+import sys
+import tempfile
+
+try:
+    import pytest
+except ImportError:
+    pytest = None
 
 # CppLox Path
-LOX_PATH = "./build/CppLox"
+LOX_PATH = os.environ.get("LOX_PATH", "./build/CppLox")
 
 # TEST_PROGRAM_LOCATION
-LOX_HELLO_WORLD = "./test/src/hello.lox"
+TEST_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "lox_test", "src")
+LOX_HELLO_WORLD = os.path.join(TEST_DIR, "hello.lox")
+
+EXPECT = re.compile(r"// expect: ?(.*)")
+EXPECT_RUNTIME_ERROR = re.compile(r"// expect runtime error: (.+)")
+EXPECT_COMPILE_ERROR = re.compile(r"// expect compile error: (.+)")
+
+EXIT_COMPILE_ERROR = 65
+EXIT_RUNTIME_ERROR = 70
+
+
+def list_scripts():
+    return sorted(name for name in os.listdir(TEST_DIR) if name.endswith(".lox"))
+
+
+def run_program(file_name, stdin=None, extra_args=()):
+    result = subprocess.run(
+        [LOX_PATH, *extra_args, file_name],
+        input=stdin,
+        capture_output=True,
+        text=True,
+        timeout=120,
+    )
+    return result
+
+
+class Expectation:
+    """What a script says it should print, exit with and report."""
+
+    def __init__(self, path):
+        self.stdout = []
+        self.error = None
+        self.error_line = None
+        self.status = 0
+        with open(path, encoding="utf-8") as source:
+            for number, line in enumerate(source, start=1):
+                match = EXPECT.search(line)
+                if match:
+                    self.stdout.append(match.group(1))
+                    continue
+                match = EXPECT_RUNTIME_ERROR.search(line)
+                if match:
+                    self.error = match.group(1)
+                    self.error_line = "[line %d]" % number
+                    self.status = EXIT_RUNTIME_ERROR
+                    continue
+                match = EXPECT_COMPILE_ERROR.search(line)
+                if match:
+                    self.error = "[line %d] %s" % (number, match.group(1))
+                    self.status = EXIT_COMPILE_ERROR
+
+    def check(self, result, name):
+        stdout = result.stdout.splitlines()
+        assert stdout == self.stdout, "%s printed:\n%s" % (name, result.stdout)
+        assert result.returncode == self.status, "%s exited with %d:\n%s" % (
+            name,
+            result.returncode,
+            result.stderr,
+        )
+        if self.error is None:
+            assert result.stderr == "", "%s reported:\n%s" % (name, result.stderr)
+            return
+        stderr = result.stderr.splitlines()
+        assert stderr and stderr[0] == self.error, "%s reported:\n%s" % (
+            name,
+            result.stderr,
+        )
+        if self.error_line is not None:
+            assert len(stderr) > 1 and stderr[1].startswith(self.error_line), (
+                "%s reported:\n%s" % (name, result.stderr)
+            )
+
+
+def read_input(name):
+    path = os.path.join(TEST_DIR, name[: -len(".lox")] + ".in")
+    if not os.path.exists(path):
+        return None
+    with open(path, encoding="utf-8") as data:
+        return data.read()
+
+
+def copy_script(name, directory):
+    script = os.path.join(directory, name)
+    shutil.copy2(os.path.join(TEST_DIR, name), script)
+    return script
+
+
+def hide_source(script):
+    """Blanks a script but keeps its size and modification time, so that only
+    a cache compiled from it can still print what it expects."""
+    info = os.stat(script)
+    with open(script, "w", encoding="utf-8") as source:
+        source.write(" " * info.st_size)
+    os.utime(script, ns=(info.st_atime_ns, info.st_mtime_ns))
+
+
+def check_script(name):
+    expected = Expectation(os.path.join(TEST_DIR, name))
+    stdin = read_input(name)
+    expected.check(run_program(os.path.join(TEST_DIR, name), stdin), name)
+
+
+def check_cached_script(name):
+    expected = Expectation(os.path.join(TEST_DIR, name))
+    if expected.status == EXIT_COMPILE_ERROR:
+        return
+    with tempfile.TemporaryDirectory() as directory:
+        script = copy_script(name, directory)
+        compiled = run_program(script, extra_args=["--compile-only"])
+        assert compiled.returncode == 0, compiled.stderr
+        assert os.path.exists(script + "c")
+        hide_source(script)
+        expected.check(run_program(script, read_input(name)), name + "c")
 
-def run_program(file_name):
-    result = subprocess.run([LOX_PATH, file_name], capture_output=True, text=True)
-    return result.stdout
-    
 
 def test_hello_world():
-    assert run_program(LOX_HELLO_WORLD) == "Hello World!\n"
-    
\ No newline at end of file
+    assert run_program(LOX_HELLO_WORLD).stdout == "Hello World!\n"
+
+
+def test_edited_script_ignores_its_cache():
+    # The edit keeps the size of the script, so only its modification time,
+    # set apart explicitly rather than left to the file system's clock, tells
+    # it from what the cache was compiled from.
+    with tempfile.TemporaryDirectory() as directory:
+        script = os.path.join(directory, "edited.lox")
+        with open(script, "w", encoding="utf-8") as source:
+            source.write('print "old";\n')
+        assert run_program(script, extra_args=["--compile-only"]).returncode == 0
+        compiled = os.stat(script)
+        with open(script, "w", encoding="utf-8") as source:
+            source.write('print "new";\n')
+        modified = compiled.st_mtime_ns + 1000000000
+        os.utime(script, ns=(compiled.st_atime_ns, modified))
+        assert run_program(script).stdout == "new\n"
+
+
+def test_corrupt_cache_is_recompiled():
+    with tempfile.TemporaryDirectory() as directory:
+        script = copy_script("ropes.lox", directory)
+        assert run_program(script, extra_args=["--compile-only"]).returncode == 0
+        with open(script + "c", "r+b") as cache:
+            cache.truncate(os.path.getsize(script + "c") - 1)
+        expected = Expectation(os.path.join(TEST_DIR, "ropes.lox"))
+        expected.check(run_program(script), "ropes.lox")
+
+
+def test_number_at_end_of_page():
+    # A script filling whole pages is mapped with nothing after its last byte,
+    # so a number there has to be parsed without reading past it.
+    with tempfile.TemporaryDirectory() as directory:
+        script = os.path.join(directory, "page.lox")
+        ending = "\nprint 1"
+        with open(script, "w", encoding="utf-8") as source:
+            source.write("//" + "x" * (mmap.PAGESIZE - 2 - len(ending)) + ending)
+        result = run_program(script)
+        assert result.returncode == EXIT_COMPILE_ERROR, result.stderr
+        assert result.stderr == "[line 2] Error at end: Expect ';' after value.\n"
+
+
+if pytest is not None:
+
+    @pytest.mark.parametrize("name", list_scripts())
+    def test_script(name):
+        check_script(name)
+
+    @pytest.mark.parametrize("name", list_scripts())
+    def test_cached_script(name):
+        check_cached_script(name)
+
+
+def main():
+    global LOX_PATH
+    if len(sys.argv) > 1:
+        LOX_PATH = sys.argv[1]
+    tests = [(name, check_script) for name in list_scripts()]
+    tests += [(name + " (cached)", check_cached_script) for name in list_scripts()]
+    tests += [
+        (test.__name__, lambda name, test=test: test())
+        for test in (
+            test_hello_world,
+            test_edited_script_ignores_its_cache,
+            test_corrupt_cache_is_recompiled,
+            test_number_at_end_of_page,
+        )
+    ]
+    failures = 0
+    for label, test in tests:
+        name = label.split(" ")[0]
+        try:
+            test(name)
+        except (AssertionError, subprocess.TimeoutExpired) as error:
+            failures += 1
+            print("FAIL %s\n%s" % (label, error))
+        else:
+            print("ok   %s" % label)
+    print("%d of %d failed" % (failures, len(tests)))
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
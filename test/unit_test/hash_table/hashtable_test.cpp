@@ -5,16 +5,26 @@
 #include <omp.h>
 #include <string.h>
 
+#include "../../../source/bytecode.cpp"
+#include "../../../source/bytecode.hpp"
 #include "../../../source/chunk.cpp"
 #include "../../../source/chunk.hpp"
 #include "../../../source/compiler.cpp"
 #include "../../../source/compiler.hpp"
 #include "../../../source/debug.cpp"
 #include "../../../source/debug.hpp"
+#include "../../../source/input.cpp"
+#include "../../../source/input.hpp"
+#include "../../../source/isolate.cpp"
+#include "../../../source/isolate.hpp"
 #include "../../../source/memory.cpp"
 #include "../../../source/memory.hpp"
 #include "../../../source/object.cpp"
 #include "../../../source/object.hpp"
+#include "../../../source/output.cpp"
+#include "../../../source/output.hpp"
+#include "../../../source/profile.cpp"
+#include "../../../source/profile.hpp"
 #include "../../../source/scanner.cpp"
 #include "../../../source/scanner.hpp"
 #include "../../../source/table.cpp"
@@ -148,6 +158,10 @@ void test_hash()
 
 int main()
 {
+  VM vm;
+  VM::setVM(&vm);
+  vm.initVM();
   test_hash();
+  vm.freeVM();
   return 0;
 }
\ No newline at end of file
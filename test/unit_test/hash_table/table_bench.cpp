@@ -0,0 +1,285 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <string.h>
+
+#include "../../../source/bytecode.cpp"
+#include "../../../source/bytecode.hpp"
+#include "../../../source/chunk.cpp"
+#include "../../../source/chunk.hpp"
+#include "../../../source/compiler.cpp"
+#include "../../../source/compiler.hpp"
+#include "../../../source/debug.cpp"
+#include "../../../source/debug.hpp"
+#include "../../../source/input.cpp"
+#include "../../../source/input.hpp"
+#include "../../../source/isolate.cpp"
+#include "../../../source/isolate.hpp"
+#include "../../../source/memory.cpp"
+#include "../../../source/memory.hpp"
+#include "../../../source/object.cpp"
+#include "../../../source/object.hpp"
+#include "../../../source/output.cpp"
+#include "../../../source/output.hpp"
+#include "../../../source/profile.cpp"
+#include "../../../source/profile.hpp"
+#include "../../../source/scanner.cpp"
+#include "../../../source/scanner.hpp"
+#include "../../../source/table.cpp"
+#include "../../../source/table.hpp"
+#include "../../../source/value.cpp"
+#include "../../../source/value.hpp"
+#include "../../../source/vm.cpp"
+#include "../../../source/vm.hpp"
+
+/**
+ * @brief The linear probing table `Table` replaced, kept to compare against.
+ */
+class LinearTable
+{
+public:
+  int count;
+  int capacity;
+  Entry* entries;
+
+  void initTable()
+  {
+    this->count = 0;
+    this->capacity = 0;
+    this->entries = NULL;
+  }
+
+  void freeTable()
+  {
+    FREE_ARRAY<Entry>(this->entries, this->capacity);
+    this->initTable();
+  }
+
+  static Entry* findEntry(Entry* entries, int capacity, ObjString* key)
+  {
+    uint32_t index = key->hash & (capacity - 1);
+    Entry* tombstone = NULL;
+    for (;;) {
+      Entry* entry = &entries[index];
+      if (entry->key == NULL) {
+        if (IS_NIL(entry->value))
+          return tombstone != NULL ? tombstone : entry;
+        if (tombstone == NULL)
+          tombstone = entry;
+      } else if (entry->key == key) {
+        return entry;
+      }
+      index = (index + 1) & (capacity - 1);
+    }
+  }
+
+  void adjustCapacity(int capacity)
+  {
+    Entry* entries = ALLOCATE<Entry>(capacity);
+    for (int i = 0; i < capacity; i++) {
+      entries[i].key = NULL;
+      entries[i].value = NIL_VAL;
+    }
+    this->count = 0;
+    for (int i = 0; i < this->capacity; i++) {
+      Entry* entry = &this->entries[i];
+      if (entry->key == NULL)
+        continue;
+      Entry* dest = findEntry(entries, capacity, entry->key);
+      dest->key = entry->key;
+      dest->value = entry->value;
+      this->count++;
+    }
+    FREE_ARRAY<Entry>(this->entries, this->capacity);
+    this->entries = entries;
+    this->capacity = capacity;
+  }
+
+  bool tableSet(ObjString* key, Value value)
+  {
+    if (this->count + 1 > this->capacity * TABLE_MAX_LOAD)
+      this->adjustCapacity(GROW_CAPACITY(this->capacity));
+    Entry* entry = findEntry(this->entries, this->capacity, key);
+    bool isNewKey = entry->key == NULL;
+    if (isNewKey && IS_NIL(entry->value))
+      this->count++;
+    entry->key = key;
+    entry->value = value;
+    return isNewKey;
+  }
+
+  bool tableGet(ObjString* key, Value* value)
+  {
+    if (this->count == 0)
+      return false;
+    Entry* entry = findEntry(this->entries, this->capacity, key);
+    if (entry->key == NULL)
+      return false;
+    *value = entry->value;
+    return true;
+  }
+
+  ObjString* tableFindString(const char* chars, int length, uint32_t hash)
+  {
+    if (this->count == 0)
+      return NULL;
+    uint32_t index = hash & (this->capacity - 1);
+    for (;;) {
+      Entry* entry = &this->entries[index];
+      if (entry->key == NULL) {
+        if (IS_NIL(entry->value))
+          return NULL;
+      } else if (entry->key->length == length && entry->key->hash == hash
+                 && memcmp(entry->key->chars, chars, length) == 0)
+      {
+        return entry->key;
+      }
+      index = (index + 1) & (this->capacity - 1);
+    }
+  }
+};
+
+/**
+ * @brief Lookups timed per table size, so small tables are timed long enough.
+ */
+const int OPERATIONS = 1 << 22;
+
+std::mt19937 rng(42);
+
+/**
+ * @brief Makes `count` distinct identifier-like keys outside the GC heap.
+ */
+static ObjString* makeKeys(std::vector<std::string>& names, int count)
+{
+  static const char alphanum[] =
+      "0123456789_"
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+      "abcdefghijklmnopqrstuvwxyz";
+  auto keys = new ObjString[count];
+  names.resize(count);
+  for (int i = 0; i < count; i++) {
+    auto length = 4 + rng() % 12;
+    for (size_t j = 0; j < length; j++)
+      names[i] += alphanum[rng() % (sizeof(alphanum) - 1)];
+    // Keep the keys distinct without looking them up.
+    names[i] += std::to_string(i);
+
+    auto key = &keys[i];
+    key->type = OBJ_STRING;
+    key->isMarked.store(false);
+    key->isOld = true;
+    key->isRemembered = false;
+    key->length = names[i].size();
+    key->chars = &names[i][0];
+    key->hash = hashString(key->chars, key->length);
+  }
+  return keys;
+}
+
+/**
+ * @brief Returns the nanoseconds per operation of `body`, run `count` times.
+ */
+template<typename Body>
+static double timePerOperation(int count, Body body)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < count; i++)
+    body(i);
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / count;
+}
+
+/**
+ * @brief Times inserts, hits, misses and string lookups on a table.
+ */
+template<typename TableType>
+static void benchTable(const char* name,
+                       ObjString* keys,
+                       ObjString* missing,
+                       const std::vector<int>& order,
+                       int size)
+{
+  TableType table;
+  table.initTable();
+  uintptr_t sink = 0;
+
+  auto rounds = std::max(1, OPERATIONS / size);
+  auto insert = 0.0;
+  for (int round = 0; round < std::min(rounds, 64); round++) {
+    table.freeTable();
+    insert += timePerOperation(
+        size, [&](int i) { table.tableSet(&keys[i], NUMBER_VAL((double)i)); });
+  }
+  insert /= std::min(rounds, 64);
+
+  auto count = rounds * size;
+  auto hit = timePerOperation(count,
+                              [&](int i)
+                              {
+                                Value value;
+                                auto key = &keys[order[i % size]];
+                                sink += table.tableGet(key, &value);
+                              });
+  auto miss = timePerOperation(count,
+                               [&](int i)
+                               {
+                                 Value value;
+                                 auto key = &missing[order[i % size]];
+                                 sink += table.tableGet(key, &value);
+                               });
+  auto find = timePerOperation(
+      count,
+      [&](int i)
+      {
+        auto key = &keys[order[i % size]];
+        sink += (uintptr_t)table.tableFindString(
+            key->chars, key->length, key->hash);
+      });
+  table.freeTable();
+
+  // Print the results of the lookups so they aren't optimized away.
+  printf("%-8s %8d %10.2f %10.2f %10.2f %10.2f %s\n",
+         name,
+         size,
+         insert,
+         hit,
+         miss,
+         find,
+         sink == 0 ? "" : " ");
+}
+
+int main()
+{
+  VM vm;
+  VM::setVM(&vm);
+  vm.initVM();
+
+  printf("%-8s %8s %10s %10s %10s %10s  (ns/op)\n",
+         "table",
+         "size",
+         "insert",
+         "hit",
+         "miss",
+         "find");
+  for (int size = 8; size <= (1 << 20); size *= 8) {
+    std::vector<std::string> names, missingNames;
+    auto keys = makeKeys(names, size);
+    auto missing = makeKeys(missingNames, size);
+    std::vector<int> order(size);
+    for (int i = 0; i < size; i++)
+      order[i] = i;
+    std::shuffle(order.begin(), order.end(), rng);
+
+    benchTable<LinearTable>("linear", keys, missing, order, size);
+    benchTable<Table>("swiss", keys, missing, order, size);
+    delete[] keys;
+    delete[] missing;
+  }
+
+  vm.freeVM();
+  return 0;
+}
@@ -4,3 +4,7 @@ g++ ./hashtable_test.cpp -g -fopenmp -o hashtable_test
 # gdb ./hashtable_test --tui 
 ./hashtable_test
 rm ./hashtable_test
+
+g++ ./table_bench.cpp -O2 -o table_bench
+./table_bench
+rm ./table_bench